@@ -22,10 +22,13 @@ Background::Background (Configuration *loaded_conf)
 {
   running = false;
   pconf = loaded_conf;
+  wallpaper = NULL;
+  primary = 0;
 }
 
 Background::~Background (void)
 {
+  free_sources();
 }
 
 bool Background::setup(Display *display)
@@ -37,17 +40,31 @@ bool Background::setup(Display *display)
   vis = DefaultVisual (display, screen);
   cm = DefaultColormap (display, screen);
   root = RootWindow (display, screen);
-  XSelectInput (display, root, StructureNotifyMask);
-
-  deskw = DisplayWidth(display, screen);
-  deskh = DisplayHeight(display, screen);
+  // Keep root events other kdesk modules might have already selected
+  XWindowAttributes attr;
+  memset (&attr, 0x00, sizeof (attr));
+  XGetWindowAttributes (display, root, &attr);
+  XSelectInput (display, root, attr.your_event_mask | StructureNotifyMask);
 
   // Bind resources to Imlib2
   imlib_context_set_display(display);
   imlib_context_set_visual(vis);
   imlib_context_set_colormap(cm);
 
-  pmap = XCreatePixmap (display, root, deskw, deskh, DefaultDepth (display, DefaultScreen (display)));
+  // Settings might point to other wallpaper files, or the files might have changed
+  free_sources();
+  return update_geometry (display);
+}
+
+bool Background::update_geometry (Display *display)
+{
+  // Takes the current screen size and monitor areas, and a pixmap the size of the screen
+  int screen = DefaultScreen (display);
+  deskw = DisplayWidth(display, screen);
+  deskh = DisplayHeight(display, screen);
+  primary = Monitors::query (display, monitors);
+
+  pmap = XCreatePixmap (display, root, deskw, deskh, DefaultDepth (display, screen));
   if (!pmap) {
     log ("error creating pixmap for desktop background");
     return false;
@@ -56,109 +73,159 @@ bool Background::setup(Display *display)
   return true;
 }
 
-bool Background::load (Display *display)
+std::string Background::choose_file (int width, int height)
 {
-  int i, w, h, nx, ny, nh, nw, tmp;
-  float ratio, dist43, dist169;
-  double factor;
+  // Decide which image to load depending on monitor resolution and aspect/ratio
   string background_file;
-  Imlib_Image tmpimg, buffer;
+  float ratio = (width * 1.0) / (height);
+  float dist43 = std::abs (ratio - 4.0/3.0);
+  float dist169 = std::abs (ratio - 16.0/9);
+
+  unsigned int midreswidth=pconf->get_config_int ("screenmedreswidth");
+  if (midreswidth > 0 && (unsigned int) width < midreswidth) {
+    // If a minimal medium resolution is specified, and
+    // the screen resolution falls below this setting, then
+    // Take the middle resolution wallpaper image
+    background_file = pconf->get_config_string ("background.file-medium");
+    log1 ("loading medium resolution wallpaper image", background_file);
+  }
+  else {
+    //
+    // Otherwise we are on a high resolution screen,
+    // display the appropiate wallpaper based on the screen aspect/ratio.
+    //
+    if (dist43 < dist169) {
+      background_file = pconf->get_config_string ("background.file-4-3");
+      log1 ("loading 4:3 wallpaper image", background_file);
+    }
+    else {
+      background_file = pconf->get_config_string ("background.file-16-9");
+      log1 ("loading 16:9 wallpaper image", background_file);
+    }
+  }
+
+  return background_file;
+}
+
+Imlib_Image Background::load_source (std::string background_file)
+{
+  // Wallpaper files are decoded once, monitor changes only scale them again
+  std::map <std::string, Imlib_Image>::iterator it = sources.find (background_file);
+  if (it != sources.end()) {
+    return it->second;
+  }
+
+  Imlib_Image image = imlib_load_image_without_cache(background_file.c_str());
+  if (!image) {
+    log1 ("error loading background", background_file);
+    return NULL;
+  }
+
+  sources[background_file] = image;
+  return image;
+}
+
+void Background::free_sources (void)
+{
+  std::map <std::string, Imlib_Image>::iterator it;
+  for (it=sources.begin(); it != sources.end(); ++it) {
+    imlib_context_set_image(it->second);
+    imlib_free_image();
+  }
+
+  sources.clear();
+}
+
+bool Background::load (Display *display)
+{
+  int w, h;
+  Imlib_Image buffer;
   bool bsuccess=false;
 
+  // Discard the wallpaper kept from a previous load
+  if (wallpaper) {
+    imlib_context_set_image(wallpaper);
+    imlib_free_image();
+    wallpaper = NULL;
+  }
+
   buffer = imlib_create_image (deskw, deskh);
   if (!buffer)
     {
       log ("error creating an image surface for the background");
+      return false;
     }
-  else
-    {
-      ratio = (deskw *1.0) / (deskh);
-      dist43 = std::abs (ratio - 4.0/3.0);
-      dist169 = std::abs (ratio - 16.0/9);
-
-      // Decide which image to load depending on screen resolution and aspect/ratio
-      unsigned int midreswidth=pconf->get_config_int ("screenmedreswidth");
-      if (midreswidth > 0 && deskw < midreswidth) {
-	// If a minimal medium resolution is specified, and
-	// the screen resolution falls below this setting, then
-	// Take the middle resolution wallpaper image
-	background_file = pconf->get_config_string ("background.file-medium");
-	log1 ("loading medium resolution wallpaper image", background_file);
-      }
-      else {
-	//
-	// Otherwise we are on a high resolution screen,
-	// display the appropiate wallpaper based on the screen aspect/ratio.
-	//
-	if (dist43 < dist169) {
-	  background_file = pconf->get_config_string ("background.file-4-3");
-	  log1 ("loading 4:3 wallpaper image", background_file);
-	}
-	else {
-	  background_file = pconf->get_config_string ("background.file-16-9");
-	  log1 ("loading 16:9 wallpaper image", background_file);
-	}
-      }
 
-      image = imlib_load_image_without_cache(background_file.c_str());
+  // Prepare imlib2 drawing spaces
+  imlib_context_set_image(buffer);
+  imlib_context_set_color(0,0,0,0);
+  imlib_image_fill_rectangle(0, 0, deskw, deskh);
+  imlib_context_set_blend(1);
+
+  // Each monitor gets the wallpaper that suits its own aspect ratio, scaled to its area
+  for (unsigned int n=0; n < monitors.size(); n++)
+    {
+      Imlib_Image image = load_source (choose_file (monitors[n].width, monitors[n].height));
       if (!image) {
-	log1 ("error loading background", background_file);
-      }
-      else {
-	// Prepare imlib2 drawing spaces
-	imlib_context_set_image(buffer);
-	imlib_context_set_color(0,0,0,0);
-	imlib_image_fill_rectangle(0, 0, deskw, deskh);
-	imlib_context_set_blend(1);
-      
-	imlib_context_set_image(image);
-	w = imlib_image_get_width();
-	h = imlib_image_get_height();
-	if (!(tmpimg = imlib_clone_image())) {
-	  log ("error cloning the desktop background image");
-	}
-	else {
-	  imlib_context_set_image(tmpimg);
-	  imlib_context_set_image(buffer);
-	  
-	  int screen_num = DefaultScreen(display);
-	  int nw = DisplayWidth(display, screen_num);
-	  int nh = DisplayHeight(display, screen_num);
-
-	  imlib_blend_image_onto_image(tmpimg, 0, 0, 0, w, h, 0, 0, nw, nh);
-	  imlib_context_set_image(tmpimg);
-	  imlib_free_image();
-	  
-	  imlib_context_set_blend(0);
-	  imlib_context_set_image(buffer);
-	  imlib_context_set_drawable(root);
-	  imlib_render_image_on_drawable(0, 0);
-	  imlib_context_set_drawable(pmap);
-	  imlib_render_image_on_drawable(0, 0);
-	  XSetWindowBackgroundPixmap(display, root, pmap);
-
-	  // Apply the background to the root window
-	  // so it stays permanently even if kdesk quits (-w parameter)
-	  XClearWindow (display, root);
-	  XFlush (display);
-
-	  // Free imlib and Xlib image resources
-	  imlib_context_set_image(buffer);
-	  imlib_free_image();
-	  imlib_context_set_image(image);
-	  imlib_free_image();
-
-	  XFreePixmap(display, pmap);
-
-	  bsuccess = true;
-	  log1 ("desktop background created successfully", image);
-	}
+        continue;
       }
+
+      imlib_context_set_image(image);
+      w = imlib_image_get_width();
+      h = imlib_image_get_height();
+
+      imlib_context_set_image(buffer);
+      imlib_blend_image_onto_image(image, 0, 0, 0, w, h,
+                                   monitors[n].x, monitors[n].y, monitors[n].width, monitors[n].height);
+      bsuccess = true;
     }
 
+  if (bsuccess) {
+    imlib_context_set_blend(0);
+    imlib_context_set_image(buffer);
+    imlib_context_set_drawable(root);
+    imlib_render_image_on_drawable(0, 0);
+    imlib_context_set_drawable(pmap);
+    imlib_render_image_on_drawable(0, 0);
+    XSetWindowBackgroundPixmap(display, root, pmap);
+
+    // Apply the background to the root window
+    // so it stays permanently even if kdesk quits (-w parameter)
+    XClearWindow (display, root);
+    XFlush (display);
+  }
+
+  // Free imlib and Xlib image resources. The scaled wallpaper is kept in memory
+  // if icons are requested to be composited against it (CompositeWallpaper: true)
+  if (bsuccess && pconf->get_settings().composite_wallpaper) {
+    log ("keeping the wallpaper in memory for icon compositing");
+    wallpaper = buffer;
+  }
+  else {
+    imlib_context_set_image(buffer);
+    imlib_free_image();
+  }
+
+  XFreePixmap(display, pmap);
+  pmap = None;
+
+  if (bsuccess) {
+    log1 ("desktop background created successfully (monitors)", monitors.size());
+  }
   return bsuccess;
 }
 
+bool Background::relayout (Display *display)
+{
+  // Monitors have changed: the wallpaper is scaled again for the new areas
+  // from the images already decoded, nothing is read from disk.
+  if (!update_geometry (display)) {
+    return false;
+  }
+
+  return load (display);
+}
+
 int Background::refresh_background(Display *display)
 {
   Window root_return, parent_return, *children_return;
@@ -185,3 +252,58 @@ int Background::refresh_background(Display *display)
 
   return nchildren_return;
 }
+
+bool Background::has_wallpaper (void)
+{
+  return (wallpaper != NULL);
+}
+
+Imlib_Image Background::crop_wallpaper (int x, int y, int width, int height)
+{
+  // Returns a new opaque image with the wallpaper area at the given screen coordinates,
+  // the parts that fall outside the screen are painted black. The caller frees the image.
+  Imlib_Image region=NULL;
+
+  if (!wallpaper || width <= 0 || height <= 0) {
+    return NULL;
+  }
+
+  region = imlib_create_image (width, height);
+  if (!region) {
+    log ("error creating an image surface for the wallpaper region");
+    return NULL;
+  }
+
+  imlib_context_set_image(region);
+  imlib_image_set_has_alpha(0);
+  imlib_context_set_blend(0);
+  imlib_context_set_color(0, 0, 0, 255);
+  imlib_image_fill_rectangle(0, 0, width, height);
+
+  // Clip the requested area to the screen boundaries
+  int sx = (x < 0 ? 0 : x);
+  int sy = (y < 0 ? 0 : y);
+  int ex = (x + width > (int) deskw ? deskw : x + width);
+  int ey = (y + height > (int) deskh ? deskh : y + height);
+  if (ex > sx && ey > sy) {
+    imlib_blend_image_onto_image (wallpaper, 0, sx, sy, ex - sx, ey - sy,
+                                  sx - x, sy - y, ex - sx, ey - sy);
+  }
+
+  return region;
+}
+
+MONITOR Background::get_primary_monitor (void)
+{
+  // The icon grid and absolutely placed icons go on this monitor
+  if (primary < 0 || primary >= (int) monitors.size()) {
+    MONITOR whole;
+    whole.x = whole.y = 0;
+    whole.width = deskw;
+    whole.height = deskh;
+    whole.primary = true;
+    return whole;
+  }
+
+  return monitors[primary];
+}
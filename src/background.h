@@ -7,6 +7,11 @@
 // An app to show and bring life to Kano-Make Desktop Icons.
 //
 
+#include <map>
+#include <string>
+
+#include "monitors.h"
+
 class Background
 {
  private:
@@ -15,8 +20,16 @@ class Background
   Visual *vis;
   Colormap cm;
   Pixmap pmap;
-  Imlib_Image image;
+  Imlib_Image wallpaper;
   unsigned int deskw, deskh;
+  std::vector <MONITOR> monitors;
+  int primary;
+  std::map <std::string, Imlib_Image> sources;   // wallpaper files as decoded, to scale again on monitor changes
+
+  bool update_geometry (Display *display);
+  std::string choose_file (int width, int height);
+  Imlib_Image load_source (std::string background_file);
+  void free_sources (void);
 
  public:
   bool running;
@@ -27,7 +40,12 @@ class Background
   
   bool setup (Display *display);
   bool load (Display *display);
+  bool relayout (Display *display);
   bool draw (Display *display);
   int refresh_background(Display *display);
 
+  bool has_wallpaper (void);
+  Imlib_Image crop_wallpaper (int x, int y, int width, int height);
+  MONITOR get_primary_monitor (void);
+
 };
@@ -7,8 +7,10 @@
 // An app to show and bring life to Kano-Make Desktop Icons.
 //
 
+#include <ctype.h>
 #include <dirent.h>
 #include <sstream>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
@@ -17,6 +19,8 @@
 
 #include "main.h"
 #include "configuration.h"
+#include "svgrender.h"
+#include "iconstore.h"
 #include "logging.h"
 
 // Name of the reserved icon filename which will always
@@ -27,10 +31,15 @@ char *kdesk_plus_icon_filename=NULL;
 Configuration::Configuration()
 {
   numicons=0;
+  svg_renderer = new SvgRenderer();
+  icon_store = new IconStore();
+  build_settings();
 }
 
 Configuration::~Configuration()
 {
+  delete svg_renderer;
+  delete icon_store;
 }
 
 bool Configuration::load_conf(const char *filename)
@@ -207,6 +216,41 @@ bool Configuration::load_conf(const char *filename)
 	configuration["iconhook"] = value;
       }
 
+      if (token == "HookConcurrency:") {
+	ifile >> value;
+	configuration["hookconcurrency"] = value;
+      }
+
+      if (token == "HookTimeout:") {
+	ifile >> value;
+	configuration["hooktimeout"] = value;
+      }
+
+      if (token == "HookCoprocess:") {
+	ifile >> value;
+	configuration["hookcoprocess"] = value;
+      }
+
+      if (token == "HookBatch:") {
+	ifile >> value;
+	configuration["hookbatch"] = value;
+      }
+
+      if (token == "IconCacheSize:") {
+	ifile >> value;
+	configuration["iconcachesize"] = value;
+      }
+
+      if (token == "PixelCacheSize:") {
+	ifile >> value;
+	configuration["pixelcachesize"] = value;
+      }
+
+      if (token == "DecodeThreads:") {
+	ifile >> value;
+	configuration["decodethreads"] = value;
+      }
+
       if (token == "GridWidth:") {
 	ifile >> value;
 	configuration["gridwidth"] = value;
@@ -217,6 +261,11 @@ bool Configuration::load_conf(const char *filename)
 	configuration["gridheight"] = value;
       }
 
+      if (token == "GridColumns:") {
+	ifile >> value;
+	configuration["gridcolumns"] = value;
+      }
+
       if (token == "GridIconWidth:") {
 	ifile >> value;
 	configuration["gridiconwidth"] = value;
@@ -237,6 +286,11 @@ bool Configuration::load_conf(const char *filename)
 	configuration["imagecachesize"] = value;
       }
 
+      if (token == "CompositeWallpaper:") {
+	ifile >> value;
+	configuration["compositewallpaper"] = value;
+      }
+
       if (token == "LastGridIcon:") {
 	ifile >> value;
 	configuration["lastgridicon"] = value;
@@ -249,6 +303,7 @@ bool Configuration::load_conf(const char *filename)
     }
 
   ifile.close();
+  build_settings();
   return true;
 }
 
@@ -265,8 +320,10 @@ bool Configuration::load_conf(const char *filename)
  *  This function assumes that the icon filenames are suffixed with correct extensions in lowercase (.svg, .png)
  *
  */
-string Configuration::convert_svg(string icon_filename)
+string Configuration::convert_svg(string icon_filename, int width, int height)
 {
+  // SVG icons are rendered into the cache, at width x height unless they are zero.
+  // Rendering is queued, call wait_svg_rendering() before the cached file is needed.
   string svg_extension=".svg";
   string converted;
 
@@ -278,70 +335,22 @@ string Configuration::convert_svg(string icon_filename)
 
     log1("converting svg icon", icon_filename);
 
-    // Locate the png file in the cache directory
-    converted=string(getenv("HOME"));
-    converted += "/";
-    converted += CACHE_DIRECTORY_ICONS;
-    converted += "/";
-
-    // Extract the filename without the path
-    const char *pathless=NULL;
-    if (strchr(icon_filename.c_str(), '/')) {
-      size_t i = icon_filename.find_last_of(string("/"));
-      pathless = &icon_filename.c_str()[i+1];
-    }
-    else {
-      // Icon files without a path should never happen, but just in case
-      pathless=icon_filename.c_str();
+    // Renders are kept in the icon cache, named after the SVG contents and the size
+    bool needs_render=false;
+    if (!icon_store->lookup(icon_filename, width, height, converted, needs_render)) {
+      converted=configuration["defaultdesktopicon"];
+      log1("could not read svg icon, providing a default icon", converted);
     }
-    converted += pathless;
-
-    // replace filename extension svg to png
-    size_t i = converted.find_last_of(string(".svg"));
-    if (i != std::string::npos) {
-      converted.replace(i - 3, 4, ".png");
-
-      // is the png already cached, and is it up-to-date?
-      struct stat info_original, info_cached;
-      int rc_original = stat(icon_filename.c_str(), &info_original);
-      int not_cached  = stat(converted.c_str(), &info_cached);
-
-      if (not_cached || ! S_ISREG(info_cached.st_mode) || ! info_cached.st_size ||
-	  // Timestamp comparision between original and cached
-	  (!rc_original && !not_cached && info_original.st_mtime > info_cached.st_mtime))
-	{
-	  // ok, let's convert and cache it now
-	  string cmdline = SVG_PNG_CONVERTER;
-	  cmdline  = SVG_PNG_CONVERTER;
-	  cmdline += " ";
-	  cmdline += icon_filename;
-	  cmdline += " --format png --output ";
-	  cmdline += converted;
-	  log1("svg conversion command", cmdline);
-	  int rc=system(cmdline.c_str());
-
-	  // make sure it has actually been converted succesfully
-	  memset(&info_cached, 0, sizeof(info_cached));
-	  not_cached = stat(converted.c_str(), &info_cached);
-	  if (not_cached || ! S_ISREG(info_cached.st_mode) || ! info_cached.st_size) {
-	    converted=configuration["defaultdesktopicon"];
-	    log2("error converting svg, providing a default icon - rc,icon",
-		 WEXITSTATUS(rc), converted);
-	  }
-	  else {
-	    // enforce the cached file access times
-	    struct timeval access_time;
-	    memset(&access_time, 0, sizeof(access_time));
-	    utimes(converted.c_str(), &access_time);
-	  }
-	}
-      else {
-	log1("svg icon is already cached", converted);
+    else if (needs_render) {
+      // Have it rendered in the background, or right now if no thread could be started
+      if (!svg_renderer->submit(icon_filename, converted, width, height) &&
+          !SvgRenderer::render(icon_filename, converted, width, height)) {
+        converted=configuration["defaultdesktopicon"];
+        log1("error converting svg, providing a default icon", converted);
       }
     }
     else {
-      converted=configuration["defaultdesktopicon"];
-      log1("could not find .svg extension, providing a default icon", converted);
+      log1("svg icon is already cached", converted);
     }
   }
   else {
@@ -357,6 +366,47 @@ string Configuration::convert_svg(string icon_filename)
   return converted;
 }
 
+string Configuration::resolve_icon_image(string icon_filename, int width, int height)
+{
+  // Returns the image file kdesk will load for an icon attribute
+  if (!icon_filename.length()) {
+    return icon_filename;
+  }
+
+  string converted=convert_svg(icon_filename, width, height);
+  return (converted.length() ? converted : icon_filename);
+}
+
+bool Configuration::wait_svg_rendering(void)
+{
+  // Blocks until queued SVG icons are in the cache.
+  // Those that could not be rendered are replaced with the default icon.
+  std::vector <string> failed;
+  bool rendered = svg_renderer->wait(failed);
+
+  // Account for the new renders, and make room for them if the cache is over budget
+  long budget = settings.icon_cache_size;
+  icon_store->save(budget > 0 ? budget : ICONSTORE_DEFAULT_BUDGET);
+  if (rendered) {
+    return true;
+  }
+
+  string default_icon=configuration["defaultdesktopicon"];
+  for (unsigned int n=0; n < failed.size(); n++) {
+    log2("error converting svg, providing a default icon", failed[n], default_icon);
+    for (unsigned int i=0; i < icons.size(); i++) {
+      string *images[] = { &icons[i].icon, &icons[i].iconhover, &icons[i].iconstamp, &icons[i].iconstatus };
+      for (unsigned int k=0; k < sizeof(images) / sizeof(images[0]); k++) {
+        if (*images[k] == failed[n]) {
+          *images[k] = default_icon;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
 /*
  *  localize_icon()
  *
@@ -404,7 +454,7 @@ string Configuration::localize_icon(string icon_filename)
     return localized;
 }
 
-bool Configuration::parse_icon (const char *directory, string fname, int iconid)
+bool Configuration::parse_icon (const char *directory, string fname, ICON_SPEC &spec)
 {
   bool bsuccess=false;
   string lnk_extension = ".lnk";
@@ -428,10 +478,25 @@ bool Configuration::parse_icon (const char *directory, string fname, int iconid)
 	
     // Process line-by-line tokens
     // In the form "Parameter: some values"
-    icons[iconid]["filename"] = fname;
+    spec.filename = fname;
+    spec.directory = directory;
+    spec.placement = ICON_RELATIVE_TOP_LEFT;
+    spec.halign = ICON_HALIGN_DEFAULT;
+    spec.x = spec.y = spec.width = spec.height = 0;
+    spec.transparency = spec.hovertransparent = spec.hoverxoffset = spec.hoveryoffset = 0;
+    spec.x_auto = spec.y_auto = false;
+    spec.singleton = spec.usericon = false;
+
+    // 64 bit FNV-1a of the file contents, reloads compare it to find out which files were edited
+    spec.digest = 0xcbf29ce484222325ULL;
     std::string line;
     while (std::getline(ifile, line))
       {
+	for (unsigned int n=0; n <= line.length(); n++) {
+	  spec.digest ^= (n < line.length() ? (unsigned char) line[n] : '\n');
+	  spec.digest *= 0x100000001b3ULL;
+	}
+
 	std::istringstream iss(line);
 	std::string temp, value, token;
 	    
@@ -446,78 +511,41 @@ bool Configuration::parse_icon (const char *directory, string fname, int iconid)
 	}
 	
 	if (token == "AppID:") {
-	  icons[iconid]["appid"] = value;
+	  spec.appid = value;
 	}
 	
 	if (token == "Command:") {
-	  icons[iconid]["command"] = value;
+	  spec.command = value;
 	}
 	
+	// Image files are resolved once the whole file is parsed, their display size depends on other keys
 	if (token == "Icon:") {
-
           // find a localized icon asset
-          string localized=localize_icon(value);
-
-	  // SVG icons are converted to png and cached.
-	  string converted=convert_svg(localized);
-	  if (converted.length()) {
-	    icons[iconid]["icon"] = converted;
-	  }
-	  else {
-	    icons[iconid]["icon"] = localized;
-	  }
+          spec.icon = localize_icon(value);
 	}
 
 	if (token == "IconHover:") {
-
-          // find a localized icon asset
-          string localized=localize_icon(value);
-
-	  // SVG icons are converted to png and cached.
-	  string converted=convert_svg(localized);
-	  if (converted.length()) {
-	    icons[iconid]["iconhover"] = converted;
-	  }
-	  else {
-	    icons[iconid]["iconhover"] = localized;
-	  }
+          spec.iconhover = localize_icon(value);
 	}
 
 	if (token == "IconStamp:") {
-	  icons[iconid]["iconstamp"] = value;
-
-	  // SVG icons are converted to png and cached.
-	  string converted=convert_svg(value);
-	  if (converted.length()) {
-	    icons[iconid]["iconstamp"] = converted;
-	  }
-	  else {
-	    icons[iconid]["iconstamp"] = value;
-	  }
+	  spec.iconstamp = value;
 	}
 
 	if (token == "IconStatus:") {
-
-	  // SVG icons are converted to png and cached.
-	  string converted=convert_svg(value);
-	  if (converted.length()) {
-	    icons[iconid]["iconstatus"] = converted;
-	  }
-	  else {
-	    icons[iconid]["iconstatus"] = value;
-	  }
+	  spec.iconstatus = value;
 	}
 	
 	if (token == "HoverTransparent:") {
-	  icons[iconid]["hovertransparent"] = value;
+	  spec.hovertransparent = atoi(value.c_str());
 	}
 
 	if (token == "HoverXOffset:") {
-	  icons[iconid]["hoverxoffset"] = value;
+	  spec.hoverxoffset = atoi(value.c_str());
 	}
 
 	if (token == "HoverYOffset:") {
-	  icons[iconid]["hoveryoffset"] = value;
+	  spec.hoveryoffset = atoi(value.c_str());
 	}
 
 	if (token == "Caption:") {
@@ -527,53 +555,96 @@ bool Configuration::parse_icon (const char *directory, string fname, int iconid)
 	    value = getenv (&value[1]);
 	  }
 	  
-	  icons[iconid]["caption"] = value;
+	  spec.caption = value;
 	}
 
 	if (token == "Message:") {
-	  icons[iconid]["message"] = value;
+	  spec.message = value;
 	}
 
 	if (token == "HAlign:") {
-	  icons[iconid]["halign"] = value;
+	  spec.halign = (value == "left" ? ICON_HALIGN_LEFT :
+			 value == "right" ? ICON_HALIGN_RIGHT : ICON_HALIGN_DEFAULT);
 	}
 	
+	// Grid icons can leave their cell to be decided by kdesk
 	if (token == "X:") {
-	  icons[iconid]["x"] = value;
+	  spec.x = atoi(value.c_str());
+	  spec.x_auto = (value == "auto");
 	}
 	
 	if (token == "Y:") {
-	  icons[iconid]["y"] = value;
+	  spec.y = atoi(value.c_str());
+	  spec.y_auto = (value == "auto");
 	}
 	
 	if (token == "Width:") {
-	  icons[iconid]["width"] = value;
+	  spec.width = atoi(value.c_str());
 	}
 	
 	if (token == "Height:") {
-	  icons[iconid]["height"] = value;
+	  spec.height = atoi(value.c_str());
 	}
 	
 	if (token == "Singleton:") {
-	  icons[iconid]["singleton"] = value;
+	  spec.singleton = (value == "true");
 	}
 	
 	if (token == "Relative-To:") {
-	  icons[iconid]["relative-to"] = value;
+	  if (value == "grid") {
+	    spec.placement = ICON_RELATIVE_GRID;
+	  }
+	  else if (value == "top-right") {
+	    spec.placement = ICON_RELATIVE_TOP_RIGHT;
+	  }
+	  else if (value == "top-centre") {
+	    spec.placement = ICON_RELATIVE_TOP_CENTRE;
+	  }
+	  else if (value == "bottom-centre") {
+	    spec.placement = ICON_RELATIVE_BOTTOM_CENTRE;
+	  }
+	  else {
+	    spec.placement = ICON_RELATIVE_TOP_LEFT;
+	  }
 	}
 
         if (token == "Transparency:") {
-          icons[iconid]["transparency"] = value;
+          spec.transparency = atoi(value.c_str());
         }
       }
 
     ifile.close();
+
+    // SVG icons are rendered to png and cached, grid icons at the size they are displayed.
+    // The rest keep the size of their SVG document, like hover images which are never resized.
+    int width=0, height=0;
+    if (spec.placement == ICON_RELATIVE_GRID && settings.grid_icon_width && settings.grid_icon_height) {
+      width = settings.grid_icon_width;
+      height = settings.grid_icon_height;
+    }
+
+    spec.icon = resolve_icon_image(spec.icon, width, height);
+    spec.iconhover = resolve_icon_image(spec.iconhover, 0, 0);
+    spec.iconstamp = resolve_icon_image(spec.iconstamp, 0, 0);
+    spec.iconstatus = resolve_icon_image(spec.iconstatus, 0, 0);
     bsuccess = true;
   }
 
   return bsuccess;
 }
 
+static void release_directory (struct dirent **files, int numfiles)
+{
+  // scandir entries are allocated one by one, icon directories can hold thousands of them
+  for (int count=0; count < numfiles; count++) {
+    free (files[count]);
+  }
+
+  if (numfiles >= 0) {
+    free (files);
+  }
+}
+
 bool Configuration::load_icons(const char *directory)
 {
   struct dirent **files;
@@ -594,11 +665,12 @@ bool Configuration::load_icons(const char *directory)
     cmd_create_cache += cache_directory;
     system(cmd_create_cache.c_str());
   }
+  icon_store->load(cache_directory);
 
   // Read kano-desktop distributed icons first
   log1 ("Loading icons from directory", directory);
   numfiles = scandir (directory, &files, 0, 0);
-  for (count=0; count < numfiles && numicons <= MAX_ICONS; count++)
+  for (count=0; count < numfiles; count++)
     {
       string f = files[count]->d_name;
       if (kdesk_plus_icon_filename && !strcmp(f.c_str(), kdesk_plus_icon_filename)) {
@@ -607,18 +679,21 @@ bool Configuration::load_icons(const char *directory)
           continue;
       }
 
-      if (parse_icon (directory, f, numicons) == true) {
-	numicons++;
+      ICON_SPEC spec;
+      if (parse_icon (directory, f, spec) == true) {
+	add_icon_spec (spec);
       }
     }
 
+  release_directory (files, numfiles);
+
   // Read icons located at the user's home directory
   char *env_display = getenv ("HOME");
   string kdesk_homedir = env_display + string("/");
   kdesk_homedir += DIR_KDESKTOP_USER;
   log1 ("Loading icons from homedir", kdesk_homedir);
   numfiles = scandir (kdesk_homedir.c_str(), &files, 0, 0);
-  for (count=0; count < numfiles && numicons <= MAX_ICONS; count++)
+  for (count=0; count < numfiles; count++)
     {
       string f = files[count]->d_name;
       if (kdesk_plus_icon_filename && !strcmp(f.c_str(), kdesk_plus_icon_filename)) {
@@ -627,50 +702,176 @@ bool Configuration::load_icons(const char *directory)
           continue;
       }
 
-      if (parse_icon (kdesk_homedir.c_str(), f, numicons) == true) {
+      ICON_SPEC spec;
+      if (parse_icon (kdesk_homedir.c_str(), f, spec) == true) {
 
         // Put a mark that this is a user-defined icon
-        icons[numicons]["usericon"] = "true";
+        spec.usericon = true;
 
-	numicons++;
+	add_icon_spec (spec);
       }
     }
 
+  release_directory (files, numfiles);
+
   if (last_grid_icon_file.length()) {
       log1 ("Adding a last_grid_icon: ", last_grid_icon_file);
 
       // add the last grid icon at the end of the list
-      if (parse_icon (last_grid_icon_dir, last_grid_icon_file, numicons) == true) {
-          numicons++;
+      ICON_SPEC spec;
+      if (parse_icon (last_grid_icon_dir, last_grid_icon_file, spec) == true) {
+          add_icon_spec (spec);
       }      
   }
 
-  log2 ("Number of icons loaded, max permitted", numicons, MAX_ICONS);
+  log1 ("Number of icons loaded", numicons);
   return (bool) (count > 0);
 }
 
 string Configuration::get_config_string(string item)
 {
-  string value = configuration[item];
-  return value;
+  // A missing setting is an empty string, without adding it to the map
+  std::map<string,string>::iterator it = configuration.find(item);
+  return (it == configuration.end() ? string("") : it->second);
 }
 
 unsigned int Configuration::get_config_int(string item)
 {
-  string value = configuration[item];
-  return atoi(value.c_str());
+  std::map<string,string>::iterator it = configuration.find(item);
+  return (it == configuration.end() ? 0 : atoi(it->second.c_str()));
+}
+
+void Configuration::build_settings(void)
+{
+  // Parse the settings once, so they can be read as plain fields from then on
+  settings.font_name = get_config_string("fontname");
+  if (get_config_string("bold").size()) {
+    settings.font_name += " bold";
+  }
+
+  settings.font_size = get_config_int("fontsize");
+  settings.subtitle_font_size = get_config_int("subtitlefontsize");
+  settings.font_color = get_config_string("fontcolor");
+  settings.shadow = (get_config_string("shadow") == "true");
+  settings.shadow_color = get_config_string("shadowcolor");
+  settings.shadow_x = get_config_int("shadowx");
+  settings.shadow_y = get_config_int("shadowy");
+
+  settings.icon_title_gap = get_config_int("icontitlegap");
+  settings.icon_gap_horz = get_config_int("icongaphorz");
+  settings.icon_gap_vert = get_config_int("icongapvert");
+  settings.grid_width = get_config_int("gridwidth");
+  settings.grid_height = get_config_int("gridheight");
+  settings.grid_columns = get_config_int("gridcolumns");
+  settings.grid_icon_width = get_config_int("gridiconwidth");
+  settings.grid_icon_height = get_config_int("gridiconheight");
+  settings.transparency = get_config_int("transparency");
+  settings.mouse_hover_icon = get_config_int("mousehovericon");
+
+  settings.click_delay = get_config_int("clickdelay");
+  settings.icon_start_delay = get_config_int("iconstartdelay");
+  settings.one_click = (get_config_string("oneclick") == "true");
+  settings.maximize_singleton = (get_config_string("maximizesingleton") == "true");
+
+  settings.icon_hook = get_config_string("iconhook");
+  settings.hook_concurrency = get_config_int("hookconcurrency");
+  settings.hook_timeout = get_config_int("hooktimeout");
+  settings.hook_coprocess = (get_config_string("hookcoprocess") == "true");
+  settings.hook_batch = (get_config_string("hookbatch") == "true");
+
+  settings.image_cache_size = get_config_int("imagecachesize");
+  settings.decode_threads = get_config_int("decodethreads");
+  settings.icon_cache_size = get_config_int("iconcachesize");
+  settings.pixel_cache_size = get_config_int("pixelcachesize");
+  svg_renderer->set_concurrency(settings.decode_threads);
+  settings.composite_wallpaper = (get_config_string("compositewallpaper") == "true");
+  settings.enable_sound = (get_config_string("enablesound") == "true");
+}
+
+const ICON_SPEC *Configuration::get_icon_spec(int iconid)
+{
+  // Specs stay in place until the icons are reset or a lnk file is reloaded,
+  // Icon instances keep a pointer to theirs
+  if (iconid < 0 || iconid >= (int) icons.size()) {
+    return NULL;
+  }
+
+  return &icons[iconid];
+}
+
+int Configuration::find_icon_spec(string directory, string filename)
+{
+  // Returns the icon id loaded from the lnk filename in directory, or -1
+  std::unordered_map <string, int>::iterator it = icon_index.find (spec_key (directory, filename));
+  return (it == icon_index.end() ? -1 : it->second);
+}
+
+string Configuration::icon_key(string filename)
+{
+  // lnk file names are matched regardless of their case
+  for (unsigned int n=0; n < filename.length(); n++) {
+    filename[n] = tolower (filename[n]);
+  }
+
+  return filename;
+}
+
+string Configuration::spec_key(string directory, string filename)
+{
+  // The same lnk file name can be found in both icon directories, each is a different icon
+  return directory + "/" + icon_key (filename);
 }
 
-std::string Configuration::get_icon_string(int iconid, std::string key)
+void Configuration::add_icon_spec(ICON_SPEC &spec)
 {
-  string value = icons[iconid][key];
-  return value;
+  icons.push_back (spec);
+  icon_index.insert (std::make_pair (spec_key (spec.directory, spec.filename), (int) icons.size() - 1));
+  numicons++;
+}
+
+void Configuration::build_icon_index(void)
+{
+  icon_index.clear();
+  for (unsigned int n=0; n < icons.size(); n++) {
+    icon_index.insert (std::make_pair (spec_key (icons[n].directory, icons[n].filename), (int) n));
+  }
 }
 
-int Configuration::get_icon_int(int iconid, std::string key)
+int Configuration::reload_icon_file(const char *directory, string fname, ICON_SPEC &previous)
 {
-  string value = icons[iconid][key];
-  return atoi(value.c_str());
+  // Reads one lnk file again after it has changed on disk, and tells what happened to its icon.
+  // previous receives the spec as it was before an update or removal.
+  // Specs move around in memory, icons need to be rebound to their spec afterwards.
+  string kdesk_homedir = string(getenv ("HOME")) + "/" + DIR_KDESKTOP_USER;
+  int iconid = find_icon_spec (directory, fname);
+  ICON_SPEC spec;
+
+  if (parse_icon (directory, fname, spec) == false) {
+    if (iconid == -1) {
+      return ICON_FILE_UNCHANGED;
+    }
+
+    log2 ("Icon lnk file removed (directory, file)", directory, fname);
+    previous = icons[iconid];
+    icons.erase (icons.begin() + iconid);
+    numicons--;
+    build_icon_index();
+    return ICON_FILE_REMOVED;
+  }
+
+  // Put a mark if this is a user-defined icon
+  spec.usericon = (kdesk_homedir == directory);
+
+  if (iconid == -1) {
+    log2 ("Icon lnk file added (directory, file)", directory, fname);
+    add_icon_spec (spec);
+    return ICON_FILE_ADDED;
+  }
+
+  log2 ("Icon lnk file updated (directory, file)", directory, fname);
+  previous = icons[iconid];
+  icons[iconid] = spec;
+  return ICON_FILE_UPDATED;
 }
 
 int Configuration::get_numicons(void)
@@ -703,11 +904,14 @@ void Configuration::dump()
 
   log1 ("dumping all loaded icons:", numicons);
   for (int c=0; c < numicons; c++) {
-    log1 ("dumping icon file:", icons[c]["filename"]);
-    for (it=icons[c].begin(); it != icons[c].end(); ++it)
-      {
-	log2 ("icon key", it->first, it->second);
-      }
+    log1 ("dumping icon file:", icons[c].filename);
+    log2 ("icon key", "appid", icons[c].appid);
+    log2 ("icon key", "command", icons[c].command);
+    log2 ("icon key", "icon", icons[c].icon);
+    log2 ("icon key", "iconhover", icons[c].iconhover);
+    log2 ("icon key", "caption", icons[c].caption);
+    log2 ("icon key", "relative-to", icons[c].placement);
+    log4 ("icon key x, y, width, height", icons[c].x, icons[c].y, icons[c].width, icons[c].height);
   }
 }
 
@@ -718,17 +922,25 @@ void Configuration::reset(void)
 
   // Then clear the map list
   configuration.clear();
+  build_settings();
   reset_icons();
 }
 
 void Configuration::reset_icons(void)
 {
-  for (int c=0; c < numicons; c++) {
-      // Erase each key->value entry for all the icons
-      icons[c].erase(icons[c].begin(), icons[c].end());
-  }
-
+  // Icon instances still pointing to their specs need to be rebound after the icons are loaded again
   icons.clear();
+  icon_index.clear();
+  numicons = 0;
+}
+
+void Configuration::take_icons(std::vector <ICON_SPEC> &previous)
+{
+  // Hands over the loaded specs, so they can be compared with the ones loaded next.
+  // Icon instances keep pointing to them until they are rebound.
+  previous.clear();
+  previous.swap (icons);
+  icon_index.clear();
   numicons = 0;
 }
 
@@ -10,37 +10,154 @@
 #include <fstream>
 #include <iostream>
 #include <map>
+#include <unordered_map>
 #include <vector>
+#include <stdint.h>
 
-#define MAX_ICONS 64
 #define CACHE_DIRECTORY_ICONS ".cache/kdesk/icons"
-#define SVG_PNG_CONVERTER     "rsvg-convert"
+
+// Typed snapshot of the global settings, built each time a configuration file has been loaded.
+// Event handlers and drawing code read these fields instead of looking up configuration strings.
+typedef struct _settings {
+
+  // Icon captions
+  std::string font_name;          // FontName, with " bold" appended when Bold is set
+  int font_size;
+  int subtitle_font_size;
+  std::string font_color;
+  bool shadow;
+  std::string shadow_color;
+  int shadow_x;                   // ShadowX and ShadowY, offset of the caption shadow in pixels
+  int shadow_y;
+
+  // Icon layout
+  int icon_title_gap;
+  int icon_gap_horz;
+  int icon_gap_vert;
+  int grid_width;
+  int grid_height;
+  int grid_columns;
+  int grid_icon_width;
+  int grid_icon_height;
+  int transparency;
+  int mouse_hover_icon;
+
+  // User interaction
+  unsigned int click_delay;       // milliseconds between clicks to be a double click
+  unsigned int icon_start_delay;  // milliseconds before another app can be started
+  bool one_click;
+  bool maximize_singleton;
+
+  // Icon hooks
+  std::string icon_hook;
+  int hook_concurrency;
+  unsigned long hook_timeout;
+  bool hook_coprocess;
+  bool hook_batch;
+
+  int image_cache_size;
+  long icon_cache_size;           // bytes of rendered SVG icons kept on disk, 0 for the default
+  long pixel_cache_size;          // bytes of decoded icon images kept on disk, 0 for the default
+  int decode_threads;             // threads decoding and rendering icon images, 0 to use all processors
+  bool composite_wallpaper;
+  bool enable_sound;
+
+} SETTINGS;
+
+// Icon placement on the desktop, from the Relative-To attribute
+typedef enum {
+  ICON_RELATIVE_TOP_LEFT=0,       // absolute coordinates, the default
+  ICON_RELATIVE_TOP_RIGHT,
+  ICON_RELATIVE_TOP_CENTRE,
+  ICON_RELATIVE_BOTTOM_CENTRE,
+  ICON_RELATIVE_GRID              // X and Y are grid cells, or "auto"
+} ICON_PLACEMENT;
+
+// Which side of the icon image the message text goes to, from the HAlign attribute
+typedef enum {
+  ICON_HALIGN_DEFAULT=0,
+  ICON_HALIGN_LEFT,
+  ICON_HALIGN_RIGHT
+} ICON_HALIGN;
+
+// Attributes of an icon, parsed from its lnk file once, when it is loaded
+typedef struct _icon_spec {
+
+  std::string filename;           // lnk file name, without the directory
+  std::string directory;          // directory the lnk file was loaded from
+  std::string appid;
+  std::string command;
+  std::string icon;               // image file names, localized and converted from svg
+  std::string iconhover;
+  std::string iconstamp;
+  std::string iconstatus;
+  std::string caption;
+  std::string message;
+
+  ICON_PLACEMENT placement;
+  ICON_HALIGN halign;
+  int x, y;
+  bool x_auto, y_auto;            // grid cell left for kdesk to decide
+  int width, height;
+
+  int transparency;
+  int hovertransparent;
+  int hoverxoffset;
+  int hoveryoffset;
+  bool singleton;
+  bool usericon;                  // loaded from the user's home directory
+  uint64_t digest;                // of the lnk file contents, tells edited files apart
+
+} ICON_SPEC;
+
+// Outcome of reading a single lnk file again, see Configuration::reload_icon_file()
+#define ICON_FILE_UNCHANGED  0
+#define ICON_FILE_ADDED      1
+#define ICON_FILE_UPDATED    2
+#define ICON_FILE_REMOVED    3
+
+class SvgRenderer;
+class IconStore;
 
 class Configuration
 {
  protected:
   std::ifstream ifile;
   std::map <std::string, std::string> configuration;
-  std::map<int,std::map<std::string,std::string> > icons;
+  SETTINGS settings;
+  std::vector <ICON_SPEC> icons;
+  std::unordered_map <std::string, int> icon_index;   // directory and lowercase lnk file name -> icon id
   int numicons;
   Configuration *pconf;
+  SvgRenderer *svg_renderer;
+  IconStore *icon_store;
 
  public:
   Configuration ();
   virtual ~Configuration (void);
   bool load_conf (const char *filename);
   bool load_icons (const char *directory);
-  bool parse_icon (const char *directory, std::string fname, int iconid);
-  std::string convert_svg(std::string icon_filename);
+  bool parse_icon (const char *directory, std::string fname, ICON_SPEC &spec);
+  std::string convert_svg(std::string icon_filename, int width, int height);
+  std::string resolve_icon_image(std::string icon_filename, int width, int height);
+  bool wait_svg_rendering(void);
   std::string localize_icon(std::string icon_filename);
   void dump (void);
   void reset(void);
   void reset_icons(void);
+  void take_icons(std::vector <ICON_SPEC> &previous);
+  void add_icon_spec(ICON_SPEC &spec);
+  void build_icon_index(void);
+  static std::string icon_key(std::string filename);
+  static std::string spec_key(std::string directory, std::string filename);
   std::string get_spaced_value(void);
+  void build_settings(void);
+  const SETTINGS &get_settings(void) { return settings; }
 
   std::string get_config_string(std::string item);
   unsigned int get_config_int(std::string item);
-  std::string get_icon_string(int iconid, std::string key);
-  int get_icon_int(int iconid, std::string key);
+  const ICON_SPEC *get_icon_spec(int iconid);
+  int find_icon_spec(std::string directory, std::string filename);
+  int reload_icon_file(const char *directory, std::string fname, ICON_SPEC &previous);
   int get_numicons(void);
 };
@@ -0,0 +1,327 @@
+//
+// control.cpp  -  Unix socket control channel, to drive a running kdesk from the command line
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Each kdesk listens on a socket named after its display, in $XDG_RUNTIME_DIR.
+// Requests and replies are frames made of a 4 byte length in network order followed by text.
+// The first line of a request is the command and its arguments, i.e. "alert browser",
+// further lines carry bulk data. Replies start with "OK" or "ERROR", followed by a newline and a body.
+// Clients are served from the main loop, so commands never need locking against the desktop.
+//
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "control.h"
+#include "reactor.h"
+#include "logging.h"
+
+ControlServer::ControlServer (void)
+{
+  listenfd = -1;
+  preactor = NULL;
+  callback = NULL;
+  callback_data = NULL;
+}
+
+ControlServer::~ControlServer (void)
+{
+  finalize();
+}
+
+std::string ControlServer::socket_path (const char *display_name)
+{
+  // One socket per display and user, so several kdesk instances do not step on each other
+  char chpath[sizeof (((struct sockaddr_un *) 0)->sun_path)];
+  const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+
+  if (!display_name) {
+    return std::string("");
+  }
+
+  if (runtime_dir && strlen (runtime_dir)) {
+    snprintf (chpath, sizeof (chpath), "%s/%s%s.sock", runtime_dir, CONTROL_SOCKET_PREFIX, display_name);
+  }
+  else {
+    snprintf (chpath, sizeof (chpath), "/tmp/%s-%d%s.sock", CONTROL_SOCKET_PREFIX, (int) getuid(), display_name);
+  }
+
+  return std::string(chpath);
+}
+
+static bool fill_address (std::string path, struct sockaddr_un *addr)
+{
+  memset (addr, 0x00, sizeof (struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  if (!path.length() || path.length() >= sizeof (addr->sun_path)) {
+    return false;
+  }
+
+  strcpy (addr->sun_path, path.c_str());
+  return true;
+}
+
+static bool write_frame (int fd, std::string &payload)
+{
+  uint32_t length = htonl ((uint32_t) payload.length());
+  std::string frame = std::string ((char *) &length, sizeof (length)) + payload;
+  size_t sent=0;
+
+  while (sent < frame.length()) {
+    ssize_t nwritten = send (fd, frame.c_str() + sent, frame.length() - sent, MSG_NOSIGNAL);
+    if (nwritten == -1 && errno == EINTR) {
+      continue;
+    }
+    else if (nwritten <= 0) {
+      return false;
+    }
+    sent += nwritten;
+  }
+
+  return true;
+}
+
+static int extract_frame (std::string &input, std::string &payload)
+{
+  // Returns 1 when a complete frame is moved out of the input, 0 if more data is needed, -1 if it is invalid
+  uint32_t length=0;
+
+  if (input.length() < sizeof (length)) {
+    return 0;
+  }
+
+  memcpy (&length, input.c_str(), sizeof (length));
+  length = ntohl (length);
+  if (length > CONTROL_MAX_FRAME) {
+    return -1;
+  }
+
+  if (input.length() < sizeof (length) + length) {
+    return 0;
+  }
+
+  payload = input.substr (sizeof (length), length);
+  input.erase (0, sizeof (length) + length);
+  return 1;
+}
+
+bool ControlServer::initialize (Reactor *reactor, const char *display_name, CONTROL_CALLBACK request_callback, void *data)
+{
+  struct sockaddr_un addr;
+
+  preactor = reactor;
+  callback = request_callback;
+  callback_data = data;
+  path = socket_path (display_name);
+  if (!fill_address (path, &addr)) {
+    log1 ("Control socket path is not valid, control channel disabled", path);
+    return false;
+  }
+
+  listenfd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenfd == -1) {
+    log1 ("Could not create the control socket (errno)", errno);
+    return false;
+  }
+
+  // A socket file left behind by a kdesk that died can be reused, one that still answers cannot
+  int probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe != -1) {
+    bool alive = (connect (probe, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    close (probe);
+    if (alive) {
+      log1 ("Another kdesk is serving the control socket, control channel disabled", path);
+      close (listenfd);
+      listenfd = -1;
+      path.clear();
+      return false;
+    }
+  }
+  unlink (path.c_str());
+
+  // Only the user who runs kdesk can talk to it
+  mode_t old_umask = umask (0077);
+  int rc = bind (listenfd, (struct sockaddr *) &addr, sizeof (addr));
+  umask (old_umask);
+  if (rc == -1 || listen (listenfd, 8) == -1 || !preactor->add_fd (listenfd, EPOLLIN, accept_ready, this)) {
+    log2 ("Could not listen on the control socket (path, errno)", path, errno);
+    close (listenfd);
+    listenfd = -1;
+    return false;
+  }
+
+  log1 ("Control socket ready", path);
+  return true;
+}
+
+void ControlServer::finalize (void)
+{
+  while (clients.size()) {
+    close_client (clients.begin()->first);
+  }
+
+  if (listenfd != -1) {
+    if (preactor) {
+      preactor->remove_fd (listenfd);
+    }
+    close (listenfd);
+    listenfd = -1;
+    unlink (path.c_str());
+  }
+}
+
+void ControlServer::accept_ready (int fd, unsigned int events, void *data)
+{
+  ControlServer *server = (ControlServer *) data;
+
+  int client = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (client == -1) {
+    log1 ("Could not accept a control connection (errno)", errno);
+    return;
+  }
+
+  if (!server->preactor->add_fd (client, EPOLLIN, client_ready, server)) {
+    close (client);
+    return;
+  }
+
+  server->clients[client] = std::string("");
+}
+
+void ControlServer::close_client (int fd)
+{
+  preactor->remove_fd (fd);
+  close (fd);
+  clients.erase (fd);
+}
+
+bool ControlServer::send_reply (int fd, bool success, std::string &reply)
+{
+  std::string payload = std::string(success ? CONTROL_REPLY_OK : CONTROL_REPLY_ERROR) + "\n" + reply;
+
+  // Replies are small, give the client a chance to drain them rather than failing on EAGAIN
+  int flags = fcntl (fd, F_GETFL);
+  fcntl (fd, F_SETFL, flags & ~O_NONBLOCK);
+  struct timeval tv = { 1, 0 };
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  bool sent = write_frame (fd, payload);
+  fcntl (fd, F_SETFL, flags);
+  return sent;
+}
+
+void ControlServer::client_ready (int fd, unsigned int events, void *data)
+{
+  ControlServer *server = (ControlServer *) data;
+  char buffer[4096];
+  std::string request, reply;
+
+  ssize_t nread = recv (fd, buffer, sizeof (buffer), 0);
+  if (nread == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  else if (nread <= 0) {
+    server->close_client (fd);
+    return;
+  }
+
+  std::string &input = server->clients[fd];
+  input.append (buffer, nread);
+
+  // A client can send several requests on the same connection, they are answered in order
+  int rc;
+  while ((rc = extract_frame (input, request)) == 1) {
+    reply.clear();
+    bool success = (server->callback ? server->callback (request, reply, server->callback_data) : false);
+    log2 ("Control request served (request, success)", request.substr (0, request.find ('\n')), success);
+    if (!server->send_reply (fd, success, reply)) {
+      server->close_client (fd);
+      return;
+    }
+  }
+
+  if (rc == -1) {
+    log1 ("Control request too large, closing connection", fd);
+    server->close_client (fd);
+  }
+}
+
+bool ControlServer::send_request (const char *display_name, std::string request, std::string &reply, bool &success)
+{
+  // Client side: sends one request and waits for its reply, success tells if kdesk honored it.
+  // Returns false if kdesk could not be reached, reply then explains why. Once connected
+  // the request might be running already, so failures after that point return true and no success.
+  struct sockaddr_un addr;
+
+  success = false;
+  char buffer[4096];
+  std::string input, payload;
+
+  if (!fill_address (socket_path (display_name), &addr)) {
+    reply = "No control socket for this display";
+    return false;
+  }
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    reply = "Could not create a socket";
+    return false;
+  }
+
+  struct timeval tv;
+  tv.tv_sec = CONTROL_CLIENT_TIMEOUT / 1000;
+  tv.tv_usec = (CONTROL_CLIENT_TIMEOUT % 1000) * 1000;
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == -1) {
+    reply = "Kdesk is not listening on the control socket";
+    close (fd);
+    return false;
+  }
+
+  if (!write_frame (fd, request)) {
+    reply = "Could not send the request";
+    close (fd);
+    return true;
+  }
+
+  int rc=0;
+  while ((rc = extract_frame (input, payload)) == 0) {
+    ssize_t nread = recv (fd, buffer, sizeof (buffer), 0);
+    if (nread == -1 && errno == EINTR) {
+      continue;
+    }
+    else if (nread <= 0) {
+      break;
+    }
+    input.append (buffer, nread);
+  }
+  close (fd);
+
+  if (rc != 1) {
+    reply = "No reply from kdesk, the command might still be running";
+    return true;
+  }
+
+  // Split the status word from the reply body
+  size_t eol = payload.find ('\n');
+  std::string status = payload.substr (0, eol);
+  reply = (eol == std::string::npos ? std::string("") : payload.substr (eol + 1));
+  success = (status == CONTROL_REPLY_OK);
+  return true;
+}
@@ -0,0 +1,56 @@
+//
+// control.h  -  Unix socket control channel, to drive a running kdesk from the command line
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <map>
+#include <string>
+
+// Socket file name, followed by the display name, i.e. "kdesk-control:0.sock"
+#define CONTROL_SOCKET_PREFIX   "kdesk-control"
+
+// Largest request or reply frame accepted, in bytes
+#define CONTROL_MAX_FRAME       (64 * 1024)
+
+// Milliseconds a command line client waits for kdesk to reply
+#define CONTROL_CLIENT_TIMEOUT  10000
+
+// Replies start with one of these words, followed by a newline and an optional body
+#define CONTROL_REPLY_OK        "OK"
+#define CONTROL_REPLY_ERROR     "ERROR"
+
+class Reactor;
+
+// Called with a complete request, returns false if it could not be honored.
+// The reply body is sent back to the client after the status word.
+typedef bool (*CONTROL_CALLBACK) (std::string &request, std::string &reply, void *data);
+
+class ControlServer
+{
+ private:
+  int listenfd;
+  std::string path;
+  Reactor *preactor;
+  std::map <int, std::string> clients;  // Connected clients and their partial input
+  CONTROL_CALLBACK callback;
+  void *callback_data;
+
+  static void accept_ready (int fd, unsigned int events, void *data);
+  static void client_ready (int fd, unsigned int events, void *data);
+  void close_client (int fd);
+  bool send_reply (int fd, bool success, std::string &reply);
+
+ public:
+  ControlServer (void);
+  virtual ~ControlServer (void);
+
+  static std::string socket_path (const char *display_name);
+  static bool send_request (const char *display_name, std::string request, std::string &reply, bool &success);
+
+  bool initialize (Reactor *reactor, const char *display_name, CONTROL_CALLBACK request_callback, void *data);
+  void finalize (void);
+};
@@ -0,0 +1,228 @@
+//
+// coprocess.cpp  -  Keeps the icon hook running as a coprocess, talking a line protocol over pipes
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Starting bash for every icon hook is expensive on the RaspberryPI. When HookCoprocess is enabled,
+// the hook is started once with the "Coprocess" parameter, and then each request is written
+// to its stdin as a single line, i.e. "browser" or "ScreenSaverFinish 120". The hook answers
+// with the usual "Key: value" lines, an optional "Status: N" line, and a closing "END" line.
+// If the coprocess dies, or does not answer in time, it is killed and started again on the next request.
+//
+
+#include <sys/wait.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hookpool.h"
+#include "coprocess.h"
+#include "logging.h"
+
+static unsigned long now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Coprocess::Coprocess (std::string coprocess_cmdline)
+{
+  pthread_mutex_init (&lock, NULL);
+  cmdline = coprocess_cmdline;
+  pid = -1;
+  fdin = fdout = -1;
+  used = 0;
+}
+
+Coprocess::~Coprocess (void)
+{
+  stop();
+  pthread_mutex_destroy (&lock);
+}
+
+bool Coprocess::start (void)
+{
+  int pipein[2], pipeout[2];
+
+  if (pipe2 (pipein, O_CLOEXEC) == -1) {
+    log1 ("Could not create the coprocess input pipe (errno)", errno);
+    return false;
+  }
+
+  if (pipe2 (pipeout, O_CLOEXEC) == -1) {
+    log1 ("Could not create the coprocess output pipe (errno)", errno);
+    close (pipein[0]);
+    close (pipein[1]);
+    return false;
+  }
+
+  pid = fork();
+  if (pid == 0) {
+    // We are in the child process: it reads requests from stdin and answers on stdout,
+    // leading a process group of its own so it can be killed along with its children.
+    sigset_t empty;
+    sigemptyset (&empty);
+    sigprocmask (SIG_SETMASK, &empty, NULL);
+    setpgid (0, 0);
+    dup2 (pipein[0], STDIN_FILENO);
+    dup2 (pipeout[1], STDOUT_FILENO);
+    execl ("/bin/sh", "/bin/sh", "-c", cmdline.c_str(), (char *) NULL);
+    _exit (127);
+  }
+
+  close (pipein[0]);
+  close (pipeout[1]);
+  if (pid == -1) {
+    log1 ("fork call failed, could not start the hook coprocess (errno)", errno);
+    close (pipein[1]);
+    close (pipeout[0]);
+    return false;
+  }
+
+  setpgid (pid, pid);
+  fdin = pipein[1];
+  fdout = pipeout[0];
+  used = 0;
+  log2 ("Hook coprocess started (pid, command)", pid, cmdline);
+  return true;
+}
+
+void Coprocess::stop (void)
+{
+  if (pid == -1) {
+    return;
+  }
+
+  close (fdin);
+  close (fdout);
+  fdin = fdout = -1;
+  used = 0;
+
+  kill (-pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+  log1 ("Hook coprocess stopped (pid)", pid);
+  pid = -1;
+}
+
+int Coprocess::read_line (char *line, size_t size, unsigned long deadline_ms)
+{
+  // Returns 1 when a full line is copied, 0 if the coprocess has gone away, -1 on timeout
+  while (true)
+    {
+      char *eol = (char *) memchr (buffer, '\n', used);
+
+      // A line longer than the buffer is returned in pieces, like fgets would
+      if (eol || used == sizeof (buffer) - 1) {
+        size_t linelen = (eol ? (size_t) (eol - buffer) : used);
+        size_t consumed = (eol ? linelen + 1 : used);
+        size_t copied = (linelen < size - 1 ? linelen : size - 1);
+
+        memcpy (line, buffer, copied);
+        line[copied] = 0x00;
+        used -= consumed;
+        memmove (buffer, buffer + consumed, used);
+        return 1;
+      }
+
+      unsigned long now = now_ms();
+      if (now >= deadline_ms) {
+        return -1;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = fdout;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int rc = poll (&pfd, 1, (int) (deadline_ms - now));
+      if (rc <= 0) {
+        continue; // interrupted, or the deadline check above will catch it
+      }
+
+      ssize_t nread = read (fdout, buffer + used, sizeof (buffer) - used - 1);
+      if (nread == -1 && errno == EINTR) {
+        continue;
+      }
+      else if (nread <= 0) {
+        return 0;
+      }
+
+      used += nread;
+    }
+}
+
+bool Coprocess::request (HOOK_JOB *job, unsigned long timeout_ms)
+{
+  // Sends one request and collects its response into the job.
+  // Requests are serialized, the coprocess answers them one at a time.
+  std::string request_line = job->request + "\n";
+  char line[1024];
+  bool answered = false;
+
+  pthread_mutex_lock (&lock);
+
+  // If the coprocess died since the last request, the write fails with EPIPE: start it again once
+  for (int attempt=0; attempt < 2 && !answered; attempt++) {
+    if (pid == -1 && !start()) {
+      break;
+    }
+
+    if (write (fdin, request_line.c_str(), request_line.length()) != (ssize_t) request_line.length()) {
+      log2 ("Could not send the request to the hook coprocess (request, errno)", job->request, errno);
+      stop();
+      continue;
+    }
+    answered = true;
+  }
+
+  if (!answered) {
+    pthread_mutex_unlock (&lock);
+    return false;
+  }
+
+  log1 ("Hook request sent to the coprocess:", job->request);
+  unsigned long deadline = now_ms() + timeout_ms;
+  while (true)
+    {
+      int rc = read_line (line, sizeof (line), deadline);
+      if (rc == -1) {
+        log2 ("Hook coprocess timed out, killing it (request, ms)", job->request, timeout_ms);
+        job->timed_out = true;
+        stop();
+        break;
+      }
+      else if (rc == 0) {
+        log1 ("Hook coprocess went away while answering request", job->request);
+        stop();
+        break;
+      }
+
+      if (!strcmp (line, HOOK_COPROCESS_DELIMITER)) {
+        if (job->exit_code == -1) {
+          job->exit_code = 0;
+        }
+        break;
+      }
+
+      if (!strncmp (line, HOOK_COPROCESS_STATUS, strlen (HOOK_COPROCESS_STATUS))) {
+        job->exit_code = atoi (line + strlen (HOOK_COPROCESS_STATUS));
+        continue;
+      }
+
+      HookPool::parse_job_line (line, job);
+    }
+
+  pthread_mutex_unlock (&lock);
+  log3 ("Hook coprocess answered (request, exit code, updates)", job->request, job->exit_code, job->updates.size());
+  return (job->exit_code != -1);
+}
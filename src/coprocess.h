@@ -0,0 +1,44 @@
+//
+// coprocess.h  -  Keeps the icon hook running as a coprocess, talking a line protocol over pipes
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <string>
+
+// Parameter sent to the hook when it is started as a coprocess (kdeskrc HookCoprocess)
+#define HOOK_COPROCESS_PARAM      "Coprocess"
+
+// Line the coprocess prints after the last attribute of each response
+#define HOOK_COPROCESS_DELIMITER  "END"
+
+// Optional response line to return an exit code, i.e. "Status: 1" cancels the screen saver
+#define HOOK_COPROCESS_STATUS     "Status:"
+
+class Coprocess
+{
+ private:
+  pthread_mutex_t lock;
+  std::string cmdline;
+  pid_t pid;
+  int fdin;             // Requests are written here, the coprocess reads them from stdin
+  int fdout;            // Responses are read from here, the coprocess prints them to stdout
+  char buffer[1024];
+  size_t used;
+
+  bool start (void);
+  void stop (void);
+  int read_line (char *line, size_t size, unsigned long deadline_ms);
+
+ public:
+  Coprocess (std::string coprocess_cmdline);
+  virtual ~Coprocess (void);
+
+  bool request (HOOK_JOB *job, unsigned long timeout_ms);
+};
@@ -0,0 +1,449 @@
+//
+// decodepool.cpp  -  Decodes, resizes and blends icon images on worker threads
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Decoding and blending the images of every icon is most of the time spent creating the desktop.
+// imlib2 keeps its state in a global context which is not thread safe, so workers here use libpng
+// and plain pixel buffers instead. They produce the final icon surfaces in the same ARGB layout,
+// and the main thread only needs to hand them over to imlib2 and render them on the icon windows.
+// Surfaces with images libpng cannot read are left for the main thread to compose as before.
+//
+
+#include <png.h>
+#include <setjmp.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "decodepool.h"
+#include "imagecache.h"
+#include "logging.h"
+
+#define PIXEL_A(p)  (((p) >> 24) & 0xff)
+#define PIXEL_R(p)  (((p) >> 16) & 0xff)
+#define PIXEL_G(p)  (((p) >> 8) & 0xff)
+#define PIXEL_B(p)  ((p) & 0xff)
+#define PIXEL_ARGB(a,r,g,b)  (((uint32_t) (a) << 24) | ((uint32_t) (r) << 16) | ((uint32_t) (g) << 8) | (uint32_t) (b))
+
+DecodePool::DecodePool (int threads)
+{
+  // By default use all processors, the main thread waits for the pool anyway
+  concurrency = threads;
+  if (concurrency <= 0) {
+    concurrency = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  }
+  if (concurrency <= 0) {
+    concurrency = 1;
+  }
+
+  pjobs = NULL;
+  next_job = 0;
+  pthread_mutex_init (&lock, NULL);
+
+  ImageCache::prepare();
+}
+
+DecodePool::~DecodePool (void)
+{
+  pthread_mutex_destroy (&lock);
+}
+
+static bool is_decodable (std::string filename)
+{
+  size_t extlen = strlen (DECODE_IMAGE_EXTENSION);
+  return (filename.length() > extlen &&
+          !strcasecmp (filename.c_str() + filename.length() - extlen, DECODE_IMAGE_EXTENSION));
+}
+
+bool DecodePool::decode_png (std::string filename, PIXBUF &pixbuf)
+{
+  // The classic libpng reader, which libpng 1.2 has as well. Every format is expanded
+  // to 8 bit channels with alpha, laid out as native 32 bit ARGB values, not premultiplied.
+  FILE *fp = fopen (filename.c_str(), "rb");
+  if (!fp) {
+    log2 ("Could not open image (filename, errno)", filename, errno);
+    return false;
+  }
+
+  png_structp png = png_create_read_struct (PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info = (png ? png_create_info_struct (png) : NULL);
+  if (!png || !info) {
+    log1 ("Could not allocate the png decoder for image", filename);
+    png_destroy_read_struct (&png, &info, NULL);
+    fclose (fp);
+    return false;
+  }
+
+  std::vector <png_bytep> rows;
+  if (setjmp (png_jmpbuf (png))) {
+    log1 ("Could not decode image", filename);
+    png_destroy_read_struct (&png, &info, NULL);
+    fclose (fp);
+    return false;
+  }
+
+  png_init_io (png, fp);
+  png_read_info (png, info);
+
+  int color_type = png_get_color_type (png, info);
+  int bit_depth = png_get_bit_depth (png, info);
+  bool has_trns = png_get_valid (png, info, PNG_INFO_tRNS);
+
+  if (bit_depth == 16) {
+    png_set_strip_16 (png);
+  }
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb (png);
+  }
+  if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+    png_set_expand_gray_1_2_4_to_8 (png);
+  }
+  if (has_trns) {
+    png_set_tRNS_to_alpha (png);
+  }
+  if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+    png_set_gray_to_rgb (png);
+  }
+
+  // Images without transparency get an opaque alpha channel
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  png_set_bgr (png);
+  if (!(color_type & PNG_COLOR_MASK_ALPHA) && !has_trns) {
+    png_set_filler (png, 0xff, PNG_FILLER_AFTER);
+  }
+#else
+  png_set_swap_alpha (png);
+  if (!(color_type & PNG_COLOR_MASK_ALPHA) && !has_trns) {
+    png_set_filler (png, 0xff, PNG_FILLER_BEFORE);
+  }
+#endif
+
+  png_set_interlace_handling (png);
+  png_read_update_info (png, info);
+
+  int width = png_get_image_width (png, info);
+  int height = png_get_image_height (png, info);
+  if (png_get_rowbytes (png, info) != (png_size_t) width * sizeof (uint32_t)) {
+    log1 ("Unexpected png row layout for image", filename);
+    png_destroy_read_struct (&png, &info, NULL);
+    fclose (fp);
+    return false;
+  }
+
+  pixbuf.width = width;
+  pixbuf.height = height;
+  pixbuf.pixels.resize (width * height);
+  rows.resize (height);
+  for (int y=0; y < height; y++) {
+    rows[y] = (png_bytep) &pixbuf.pixels[y * width];
+  }
+
+  png_read_image (png, &rows[0]);
+  png_read_end (png, NULL);
+  png_destroy_read_struct (&png, &info, NULL);
+  fclose (fp);
+  return true;
+}
+
+static void resample_axis (const float *source, int source_len, int dest_len, int lines,
+                           int step, int source_line_step, int dest_line_step, float *dest)
+{
+  // Area averaging along one axis: each destination pixel takes the source pixels it covers,
+  // weighted by how much of them it covers. Channels are premultiplied, so alpha does not bleed.
+  float ratio = (float) source_len / dest_len;
+
+  for (int line=0; line < lines; line++) {
+    const float *src = source + line * source_line_step * 4;
+    float *dst = dest + line * dest_line_step * 4;
+    for (int d=0; d < dest_len; d++) {
+      float start = d * ratio, end = (d + 1) * ratio;
+      float sum[4] = { 0, 0, 0, 0 }, total = 0;
+      int last = (int) ceilf (end);
+      for (int s=(int) start; s < last && s < source_len; s++) {
+        float weight = (end < s + 1 ? end : s + 1) - (start > s ? start : s);
+        for (int c=0; c < 4; c++) {
+          sum[c] += src[s * step * 4 + c] * weight;
+        }
+        total += weight;
+      }
+      for (int c=0; c < 4; c++) {
+        dst[d * step * 4 + c] = (total > 0 ? sum[c] / total : 0);
+      }
+    }
+  }
+}
+
+bool DecodePool::scale (PIXBUF &source, int width, int height, PIXBUF &scaled)
+{
+  scaled.width = scaled.height = 0;
+  if (width <= 0 || height <= 0 || !source.width || !source.height) {
+    return false;
+  }
+
+  // Premultiply into floats, resize horizontally then vertically
+  std::vector <float> premult (source.width * source.height * 4);
+  for (size_t n=0; n < source.pixels.size(); n++) {
+    uint32_t p = source.pixels[n];
+    float a = PIXEL_A(p) / 255.0f;
+    premult[n * 4 + 0] = PIXEL_A(p);
+    premult[n * 4 + 1] = PIXEL_R(p) * a;
+    premult[n * 4 + 2] = PIXEL_G(p) * a;
+    premult[n * 4 + 3] = PIXEL_B(p) * a;
+  }
+
+  std::vector <float> rows (width * source.height * 4);
+  resample_axis (&premult[0], source.width, width, source.height, 1, source.width, width, &rows[0]);
+
+  std::vector <float> result (width * height * 4);
+  resample_axis (&rows[0], source.height, height, width, width, 1, 1, &result[0]);
+
+  scaled.width = width;
+  scaled.height = height;
+  scaled.pixels.resize (width * height);
+  for (size_t n=0; n < scaled.pixels.size(); n++) {
+    float a = result[n * 4];
+    int r=0, g=0, b=0;
+    if (a > 0) {
+      r = (int) (result[n * 4 + 1] * 255.0f / a + 0.5f);
+      g = (int) (result[n * 4 + 2] * 255.0f / a + 0.5f);
+      b = (int) (result[n * 4 + 3] * 255.0f / a + 0.5f);
+    }
+    scaled.pixels[n] = PIXEL_ARGB((int) (a + 0.5f), (r > 255 ? 255 : r), (g > 255 ? 255 : g), (b > 255 ? 255 : b));
+  }
+
+  return true;
+}
+
+bool DecodePool::load_image (std::string filename, int width, int height, PIXBUF &pixbuf)
+{
+  // Decodes an image and resizes it to width x height, unless they are zero.
+  // Results are kept in the image cache, so next time there is nothing to decode.
+  std::string key, entry;
+  bool cacheable = ImageCache::make_key (filename, width, height, key, entry);
+
+  if (cacheable && ImageCache::load (entry, key, pixbuf)) {
+    return true;
+  }
+
+  if (!decode_png (filename, pixbuf)) {
+    return false;
+  }
+
+  if ((width && height) && (pixbuf.width != width || pixbuf.height != height)) {
+    PIXBUF resized;
+    if (!scale (pixbuf, width, height, resized)) {
+      return false;
+    }
+    pixbuf.pixels.swap (resized.pixels);
+    pixbuf.width = width;
+    pixbuf.height = height;
+  }
+
+  if (cacheable) {
+    ImageCache::store (entry, key, pixbuf);
+  }
+
+  return true;
+}
+
+void DecodePool::blend (PIXBUF &source, PIXBUF &dest, int x, int y, const unsigned char *alpha_map)
+{
+  // Blends the source on top of the destination at x, y, clipped to it, and merges both alphas.
+  // The optional alpha map replaces the source alpha values, like an imlib2 color modifier would.
+  for (int sy=0; sy < source.height; sy++) {
+    int dy = y + sy;
+    if (dy < 0 || dy >= dest.height) {
+      continue;
+    }
+
+    for (int sx=0; sx < source.width; sx++) {
+      int dx = x + sx;
+      if (dx < 0 || dx >= dest.width) {
+        continue;
+      }
+
+      uint32_t s = source.pixels[sy * source.width + sx];
+      uint32_t &d = dest.pixels[dy * dest.width + dx];
+      unsigned int sa = (alpha_map ? alpha_map[PIXEL_A(s)] : PIXEL_A(s));
+      if (!sa) {
+        continue;
+      }
+
+      unsigned int da = PIXEL_A(d) * (255 - sa) / 255;
+      unsigned int outa = sa + da;
+      unsigned int r = (PIXEL_R(s) * sa + PIXEL_R(d) * da) / outa;
+      unsigned int g = (PIXEL_G(s) * sa + PIXEL_G(d) * da) / outa;
+      unsigned int b = (PIXEL_B(s) * sa + PIXEL_B(d) * da) / outa;
+      d = PIXEL_ARGB(outa, r, g, b);
+    }
+  }
+}
+
+void DecodePool::compose_normal (DECODE_JOB *job)
+{
+  // The same steps as Icon::compose_normal, on buffers owned by the job
+  PIXBUF image, stamp, status;
+  unsigned char map_transparency[256];
+
+  image.width = image.height = 0;
+  stamp.width = stamp.height = 0;
+  status.width = status.height = 0;
+
+  if (!is_decodable (job->icon) ||
+      (job->stamp.length() && !is_decodable (job->stamp)) ||
+      (job->status.length() && !is_decodable (job->status))) {
+    return;
+  }
+
+  // Icons contained in a grid are uniformly resized
+  bool resize = (job->grid && job->grid_icon_width && job->grid_icon_height);
+  if (!load_image (job->icon, (resize ? job->grid_icon_width : 0), (resize ? job->grid_icon_height : 0), image) ||
+      (job->stamp.length() && !load_image (job->stamp, 0, 0, stamp)) ||
+      (job->status.length() && !load_image (job->status, 0, 0, status))) {
+    return;
+  }
+
+  int w = image.width, h = image.height;
+
+  // Icon transparency turns every visible pixel to the same alpha value
+  for (int n=0; n < 256; n++) {
+    map_transparency[n] = (n ? job->transparency : 0);
+  }
+  const unsigned char *alpha_map = (job->transparency ? map_transparency : NULL);
+
+  int subx = (job->halign_right ? job->width - w : 0);
+
+  if (stamp.width) {
+    blend (stamp, image, (job->stamp_x ? job->stamp_x : (w - stamp.width) / 2),
+           (job->stamp_y ? job->stamp_y : (h - stamp.height) / 2), alpha_map);
+  }
+
+  // Grid icons are horizontally centered and at the bottom of the grid cell, the rest at the top-left
+  int placex = subx, placey = 0;
+  if (job->grid) {
+    placex = (job->grid_width > w ? (job->grid_width - w) / 2 : 0);
+    placey = (job->grid_height > h ? job->grid_height - h : 0);
+  }
+
+  job->normal.width = job->width;
+  job->normal.height = job->height;
+  job->normal.pixels.assign (job->width * job->height, 0);
+  blend (image, job->normal, placex, placey, alpha_map);
+
+  // The status icon is positioned on the complete icon box, and is not made transparent
+  if (status.width) {
+    blend (status, job->normal, (job->status_x ? job->status_x : (job->width - status.width) / 2),
+           (job->status_y ? job->status_y : (job->height - status.height) / 2), NULL);
+  }
+
+  job->image_w = w;
+  job->image_h = h;
+  job->image_subx = subx;
+  job->normal_ready = true;
+}
+
+void DecodePool::compose_hover (DECODE_JOB *job)
+{
+  // The same steps as Icon::compose_hover, on buffers owned by the job
+  PIXBUF hover, original;
+  unsigned char map_glow[256];
+
+  hover.width = hover.height = 0;
+  original.width = original.height = 0;
+
+  if (!is_decodable (job->hover) || !load_image (job->hover, 0, 0, hover)) {
+    return;
+  }
+
+  // Without HoverTransparent, or if the icon cannot be loaded, the hover image is shown as it is
+  if (job->hover_transparent > 0 && job->icon.length()) {
+    if (!is_decodable (job->icon)) {
+      return;
+    }
+
+    if (load_image (job->icon, 0, 0, original)) {
+      for (int n=0; n < 256; n++) {
+        map_glow[n] = (n > 127 ? job->hover_transparent : n);
+      }
+
+      blend (hover, original, 0, 0, map_glow);
+      for (size_t n=0; n < original.pixels.size(); n++) {
+        uint32_t p = original.pixels[n];
+        original.pixels[n] = (p & 0x00ffffff) | ((uint32_t) map_glow[PIXEL_A(p)] << 24);
+      }
+
+      hover.pixels.swap (original.pixels);
+      hover.width = original.width;
+      hover.height = original.height;
+    }
+  }
+
+  job->hover_surface.pixels.swap (hover.pixels);
+  job->hover_surface.width = hover.width;
+  job->hover_surface.height = hover.height;
+  job->hover_ready = true;
+}
+
+DECODE_JOB *DecodePool::take_job (void)
+{
+  DECODE_JOB *job = NULL;
+
+  pthread_mutex_lock (&lock);
+  if (pjobs && next_job < pjobs->size()) {
+    job = (*pjobs)[next_job++];
+  }
+  pthread_mutex_unlock (&lock);
+  return job;
+}
+
+void *DecodePool::worker (void *data)
+{
+  DecodePool *pool = (DecodePool *) data;
+  DECODE_JOB *job;
+
+  while ((job = pool->take_job()) != NULL) {
+    if (job->want_normal) {
+      compose_normal (job);
+    }
+    if (job->want_hover) {
+      compose_hover (job);
+    }
+  }
+
+  return NULL;
+}
+
+void DecodePool::run (std::vector <DECODE_JOB *> &jobs)
+{
+  // Returns when all jobs are done. The calling thread works along with the pool,
+  // threads only live for the duration of the batch so they cost nothing while kdesk is idle.
+  std::vector <pthread_t> threads;
+
+  pjobs = &jobs;
+  next_job = 0;
+
+  for (int n=1; n < concurrency && n < (int) jobs.size(); n++) {
+    pthread_t thread;
+    if (pthread_create (&thread, NULL, worker, this) != 0) {
+      log1 ("Could not start an image decoding thread (started)", threads.size());
+      break;
+    }
+    threads.push_back (thread);
+  }
+
+  worker (this);
+  for (size_t n=0; n < threads.size(); n++) {
+    pthread_join (threads[n], NULL);
+  }
+
+  log2 ("Icon images decoded (jobs, threads)", jobs.size(), threads.size() + 1);
+  pjobs = NULL;
+}
@@ -0,0 +1,79 @@
+//
+// decodepool.h  -  Decodes, resizes and blends icon images on worker threads
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Images are decoded by libpng, other formats are left to imlib2 on the main thread
+#define DECODE_IMAGE_EXTENSION  ".png"
+
+// A decoded image, one ARGB value per pixel in the same layout imlib2 uses.
+// Colors are not premultiplied by alpha.
+typedef struct _pixbuf {
+  int width;
+  int height;
+  std::vector <uint32_t> pixels;
+} PIXBUF;
+
+// Everything needed to compose the surfaces of one icon, without touching the Icon or imlib2
+typedef struct _decode_job {
+
+  // Filled on the main thread before the pool runs
+  std::string icon;             // Main icon image
+  std::string stamp;            // Optional images blended over it, at the given coordinates or centered
+  int stamp_x, stamp_y;
+  std::string status;
+  int status_x, status_y;
+  std::string hover;            // Optional hover image, empty if the hover surface is not needed
+  int width, height;            // Icon box, the normal surface is this size
+  bool grid;                    // Grid icons are resized and placed at the bottom of the grid cell
+  int grid_icon_width, grid_icon_height;
+  int grid_width, grid_height;
+  bool halign_right;
+  int transparency;             // Alpha of the icon image and stamp, 0 if they are blended as they are
+  int hover_transparent;        // HoverTransparent, 0 if the hover image replaces the icon
+  bool want_normal;
+  bool want_hover;
+
+  // Results, a surface which is not ready needs to be composed by imlib2 on the main thread
+  bool normal_ready;
+  PIXBUF normal;
+  int image_w, image_h, image_subx;
+  bool hover_ready;
+  PIXBUF hover_surface;
+
+} DECODE_JOB;
+
+class DecodePool
+{
+ private:
+  int concurrency;
+  std::vector <DECODE_JOB *> *pjobs;
+  size_t next_job;
+  pthread_mutex_t lock;
+
+  static void *worker (void *data);
+  DECODE_JOB *take_job (void);
+
+ public:
+  DecodePool (int threads);
+  virtual ~DecodePool (void);
+
+  static bool decode_png (std::string filename, PIXBUF &pixbuf);
+  static bool scale (PIXBUF &source, int width, int height, PIXBUF &scaled);
+  static bool load_image (std::string filename, int width, int height, PIXBUF &pixbuf);
+  static void blend (PIXBUF &source, PIXBUF &dest, int x, int y, const unsigned char *alpha_map);
+  static void compose_normal (DECODE_JOB *job);
+  static void compose_hover (DECODE_JOB *job);
+
+  void run (std::vector <DECODE_JOB *> &jobs);
+};
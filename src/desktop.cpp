@@ -17,7 +17,10 @@
 
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <time.h>
+#include <ctype.h>
 
 #include <Imlib2.h>
 
@@ -26,23 +29,61 @@
 #include "main.h"
 
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <dirent.h>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
 
 #include "icon.h"
 #include "sound.h"
 #include "background.h"
+#include "hookpool.h"
+#include "coprocess.h"
 #include "desktop.h"
 #include "logging.h"
 #include "grid.h"
+#include "resources.h"
+#include "windowindex.h"
+#include "reactor.h"
+#include "control.h"
+#include "decodepool.h"
+#include "imagecache.h"
+
+static unsigned long now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
 Desktop::Desktop(void)
 {
   atom_finish = atom_reload = atom_reload_icons = atom_icon_alert = 0L;
   wcontrol = 0L;
+  preactor = NULL;
+  hookpool = new HookPool();
+  control = new ControlServer();
+  pdisplay = NULL;
+  dispatch_status = DISPATCH_CONTINUE;
   numicons = 0;
   initialized = false;
   icon_grid = NULL;
+  current_page = 0;
+  pool = new ResourcePool();
+  windex = new WindowIndex();
   cache_size = 0;
+
+  // The desktop is created when kdesk starts, startup metrics are measured from here
+  launch_ms = now_ms();
+  startup_ms = 0;
+  first_icon_ms = interactive_ms = complete_ms = -1;
+  startup_stage = STARTUP_STAGE_DONE;
+  startup_timer = -1;
+  watch_fd = watch_timer = -1;
+  randr_event_base = relayout_timer = -1;
 }
 
 void Desktop::initialize(Background *p)
@@ -53,11 +94,11 @@ void Desktop::initialize(Background *p)
 
 Desktop::~Desktop(void)
 {
-  // Free all allocated icon handlers in the map
-  std::map <Window, Icon *>::iterator it;
-  for (it=iconHandlers.begin(); it != iconHandlers.end(); ++it)
+  // Free all allocated icons, including those on grid pages not shown
+  std::set <Icon *>::iterator it;
+  for (it=desktop_icons.begin(); it != desktop_icons.end(); ++it)
     {
-      delete it->second;
+      delete *it;
     }
 
   // FIXME: Atoms are not meant to be freed, correct me if I'm wrong.
@@ -65,16 +106,38 @@ Desktop::~Desktop(void)
   if (icon_grid) {
     delete icon_grid;
   }
+
+  if (watch_fd != -1) {
+    close (watch_fd);
+  }
+
+  delete pool;
+  delete windex;
+  delete control;
+  delete hookpool;
 }
 
 bool Desktop::create_icons (Display *display)
 {
   int nicon=0;
 
-  icon_grid = new IconGrid(display, pconf);
+  // Icons have been destroyed by now, they start over on a new grid from its first page.
+  // The grid is laid out on the primary monitor.
+  if (icon_grid) {
+    delete icon_grid;
+  }
+  MONITOR area = pbground->get_primary_monitor();
+  icon_grid = new IconGrid(area.x, area.y, area.width, area.height, pconf);
+  current_page = 0;
+
+  // SVG icons queued while the lnk files were parsed need to be in the cache by now
+  pconf->wait_svg_rendering();
+
+  // Fonts, colors and cursors survive icon reloads unless their settings changed
+  pool->validate (display, pconf);
 
   // By default we do not use imlib2 image cache.
-  cache_size = pconf->get_config_int("imagecachesize");
+  cache_size = pconf->get_settings().image_cache_size;
   if (cache_size > 0) {
     log1 ("Setting image cache-size via config ImageCacheSize to bytes", cache_size);
   }
@@ -94,93 +157,701 @@ bool Desktop::create_icons (Display *display)
       imlib_set_cache_size(cache_size);
   }
 
-  // Create and draw all icons, save a mapping of their window IDs -> handlers
+  // Startup is staged: the first pass icons are shown right away, the rest of the work
+  // is done in slices from the main loop, so the desktop is usable as early as possible.
+  cancel_startup();
+  startup_ms = (launch_ms ? launch_ms : now_ms());
+  launch_ms = 0;
+  first_icon_ms = interactive_ms = complete_ms = -1;
+  startup_stage = STARTUP_STAGE_ICONS;
+
+  // Create all icons, save a mapping of their window IDs -> handlers
   // so that we can dispatch events to each one in turn later on.
   //
   // The icons are created in two passes. The first one creates only grid
   // icons with hints, so they get a priority over the other ones.
+  // Icons of the second pass are created in the startup slices, in the same order.
+  std::vector <Icon *> created_icons;
   for (int pass = 0; pass < 2; pass++)
    {
     for (nicon=0; nicon < pconf->get_numicons(); nicon++)
       {
-        string pos, x, y;
-	pos = pconf->get_icon_string(nicon, "relative-to");
-	x = pconf->get_icon_string(nicon, "x");
-	y = pconf->get_icon_string(nicon, "y");
-
-        /* This condition is a special exception for outdated LNK files */
-        /* which defined the X and Y coordinates as "auto" in the grid, where it should be "0" */
-        if (pconf->get_icon_string(nicon, "usericon") != "true") {
-
-            if (pos == "grid" && x != "auto" && y != "auto") {
-                /* Has hints, and it's not a user defined icon, skip in the second pass */
-                if (pass == 1)
-                    continue;
-            }
-            else {
-                /* No hints, skip in the first pass */
-                if (pass == 0)
-                    continue;
-            }
-        }
-        else {
-            if (pass == 1)
-                continue;
+        if (is_first_pass (pconf->get_icon_spec(nicon)) != (pass == 0)) {
+            continue;
         }
 
-        Icon *pico = new Icon(pconf, nicon);
-        Window wicon = pico->create(display, icon_grid);
-        if (wicon) {
-	  XEvent emptyev;
-	  iconHandlers[wicon] = pico;
-	  pico->draw(display, emptyev, false);
-
-	  // Invoke the icon hook so it is refreshed immediately
-	  // right after Kdesk startup and refresh signals
-	  string hookscript = pconf->get_config_string("iconhook");
-	  if (hookscript.length() > 0) {
-	    call_icon_hook (display, emptyev, pconf->get_config_string("iconhook"), pico);
-	  }
-
-	  numicons++;
+        if (pass == 1) {
+          startup_pending.push_back (nicon);
+          continue;
         }
-        else {
-	  log1 ("Warning: error creating icon", pconf->get_icon_string(nicon, "filename"));
-	  delete pico;
+
+        Icon *pico = add_icon (display, nicon);
+        if (pico && pico->is_realized()) {
+          created_icons.push_back (pico);
         }
       }
    }
 
-  // tell the outside world how the icon creation has completed
-  dump_metrics(display);
+  // Show the first icons now, hover surfaces and hooks can wait
+  show_icons (display, created_icons);
+
+  // The first slice runs as soon as the main loop is attending events
+  startup_timer = preactor->add_timer (0, STARTUP_SLICE_INTERVAL, startup_slice, this);
+  if (startup_timer == -1) {
+    finish_startup (display);
+  }
 
   // returns true if at least one icon is available on the desktop
   log1 ("Desktop icon classes have been allocated", nicon);
   return (bool) (nicon > 0);
 }
 
-Icon *Desktop::find_icon_name (char *icon_name)
+bool Desktop::is_first_pass (const ICON_SPEC *spec)
 {
-  // Search through the icon dispatcher table for the icon filename
-  std::map <Window, Icon *>::iterator it;
-  for (it=iconHandlers.begin(); it != iconHandlers.end(); ++it)
+  /* This condition is a special exception for outdated LNK files */
+  /* which defined the X and Y coordinates as "auto" in the grid, where it should be "0" */
+  if (!spec->usericon) {
+    /* Grid icons with hints, which are not user defined, go first. Those without hints go second */
+    return (spec->placement == ICON_RELATIVE_GRID && !spec->x_auto && !spec->y_auto);
+  }
+
+  return true;
+}
+
+Icon *Desktop::add_icon (Display *display, int nicon)
+{
+  // Places the icon and registers its handler, returns NULL if it could not be created.
+  // Only icons on the grid page being shown are given a window, the others wait for their page.
+  Icon *pico = new Icon(pconf, nicon);
+  if (!pico->place(display, icon_grid)) {
+    log1 ("Warning: error placing icon", pconf->get_icon_spec(nicon)->filename);
+    delete pico;
+    return NULL;
+  }
+
+  if (pico->is_on_page (current_page) && !pico->realize(display, pbground, pool, windex)) {
+    log1 ("Warning: error creating icon", pconf->get_icon_spec(nicon)->filename);
+    pico->destroy(display);
+    delete pico;
+    return NULL;
+  }
+
+  register_icon (pico);
+  startup_hooks.push_back (pico);
+  if (pico->is_realized()) {
+    startup_hover.push_back (pico);
+  }
+  return pico;
+}
+
+void Desktop::register_icon (Icon *pico)
+{
+  // Events are dispatched by window, hooks and queries find icons by name
+  desktop_icons.insert (pico);
+  if (pico->is_realized()) {
+    iconHandlers[pico->get_window()] = pico;
+  }
+  icon_names[Configuration::icon_key (pico->get_icon_name())] = pico;
+  icon_files[Configuration::spec_key (pico->get_icon_directory(), pico->get_icon_filename())] = pico;
+  numicons++;
+}
+
+void Desktop::unregister_icon (Icon *pico)
+{
+  // The same name can be loaded from both icon directories, only forget it if it is this icon
+  std::unordered_map <std::string, Icon *>::iterator it = icon_names.find (Configuration::icon_key (pico->get_icon_name()));
+  if (it != icon_names.end() && it->second == pico) {
+    icon_names.erase (it);
+  }
+  std::unordered_map <std::string, Icon *>::iterator file = icon_files.find (Configuration::spec_key (pico->get_icon_directory(), pico->get_icon_filename()));
+  if (file != icon_files.end() && file->second == pico) {
+    icon_files.erase (file);
+  }
+
+  if (pico->is_realized()) {
+    iconHandlers.erase (pico->get_window());
+  }
+  desktop_icons.erase (pico);
+  numicons--;
+}
+
+bool Desktop::show_page (Display *display, int page)
+{
+  // Flips the icon grid to another page. Icons leaving the screen give their window back
+  // to the pool and keep only their placement, the ones coming in are realized and composed.
+  // Returns false if the page is already shown.
+  if (!icon_grid) {
+    return false;
+  }
+
+  int pages = icon_grid->get_pages();
+  if (page >= pages) {
+    page = pages - 1;
+  }
+  if (page < 0) {
+    page = 0;
+  }
+  if (page == current_page) {
+    return false;
+  }
+
+  // Startup slices hold on to realized icons, let them complete first
+  finish_startup (display);
+
+  current_page = page;
+  std::vector <Icon *> shown_icons;
+  realize_page (display, shown_icons);
+
+  XEvent emptyev;
+  memset (&emptyev, 0x00, sizeof (emptyev));
+  for (unsigned int n=0; n < shown_icons.size(); n++) {
+    shown_icons[n]->draw(display, emptyev, false);
+  }
+
+  log3 ("Icon grid page shown (page, pages, icons)", current_page, pages, shown_icons.size());
+  return true;
+}
+
+void Desktop::realize_page (Display *display, std::vector <Icon *> &shown_icons)
+{
+  // Realizes the icons on the current grid page and unrealizes the rest.
+  // Icons coming in are composed by the decode pool and returned to be drawn.
+  std::set <Icon *>::iterator it;
+  for (it=desktop_icons.begin(); it != desktop_icons.end(); ++it)
     {
-      if (it->second != NULL) {
-	if (!strcasecmp (icon_name, it->second->get_icon_name().c_str())) {
-	  log2 ("Icon name found (name, instance)", icon_name, it->second);
-	  return it->second;
-	}
+      Icon *pico = *it;
+      if (pico->is_realized() && !pico->is_on_page (current_page)) {
+        iconHandlers.erase (pico->get_window());
+        pico->unrealize (display);
+      }
+    }
+
+  for (it=desktop_icons.begin(); it != desktop_icons.end(); ++it)
+    {
+      Icon *pico = *it;
+      if (pico->is_realized() || !pico->is_on_page (current_page)) {
+        continue;
+      }
+
+      Window wicon = pico->realize (display, pbground, pool, windex);
+      if (!wicon) {
+        log1 ("Warning: error creating icon", pico->get_icon_filename());
+        continue;
+      }
+
+      iconHandlers[wicon] = pico;
+      pico->defer_hover (false);
+      shown_icons.push_back (pico);
+    }
+
+  prerender_icons (shown_icons, true, true);
+}
+
+static bool by_iconid (Icon *first, Icon *second)
+{
+  return (first->get_iconid() < second->get_iconid());
+}
+
+void Desktop::relayout_expired (int timer_id, void *data)
+{
+  Desktop *pdesktop = (Desktop *) data;
+
+  pdesktop->preactor->remove_timer (timer_id);
+  pdesktop->relayout_timer = -1;
+  pdesktop->relayout_desktop (pdesktop->pdisplay);
+}
+
+bool Desktop::relayout_desktop (Display *display)
+{
+  // Monitors have been plugged, unplugged or changed resolution. The wallpaper is scaled again
+  // for each of them, and icons are placed on a grid for the new primary monitor.
+  // Nothing is parsed or decoded again, icons keep their surfaces and only move.
+  pbground->relayout (display);
+  if (!icon_grid) {
+    return false;
+  }
+
+  // Icons are placed in the same order as on startup, they all need to exist by now
+  finish_startup (display);
+
+  MONITOR area = pbground->get_primary_monitor();
+  IconGrid *new_grid = new IconGrid(area.x, area.y, area.width, area.height, pconf);
+  std::vector <Icon *> ordered (desktop_icons.begin(), desktop_icons.end());
+  std::sort (ordered.begin(), ordered.end(), by_iconid);
+
+  int removed=0;
+  for (int pass = 0; pass < 2; pass++)
+    {
+      for (unsigned int n=0; n < ordered.size(); n++)
+        {
+          // Icons removed in the first pass are left out of the second one
+          Icon *pico = ordered[n];
+          if (!pico || is_first_pass (pconf->get_icon_spec (pico->get_iconid())) != (pass == 0)) {
+            continue;
+          }
+
+          if (!pico->relayout (display, new_grid)) {
+            log1 ("Icon does not fit on the new screen, removing it", pico->get_icon_filename());
+            unregister_icon (pico);
+            pico->destroy (display);
+            delete pico;
+            ordered[n] = NULL;
+            removed++;
+          }
+        }
+    }
+
+  delete icon_grid;
+  icon_grid = new_grid;
+
+  // The new grid might have fewer pages, icons coming in or leaving the screen are realized accordingly
+  if (current_page >= icon_grid->get_pages()) {
+    current_page = icon_grid->get_pages() - 1;
+  }
+
+  std::vector <Icon *> shown_icons;
+  realize_page (display, shown_icons);
+  redraw_icons (display, true);
+
+  dump_metrics (display);
+  log4 ("Desktop laid out for new monitors (width, height, pages, removed icons)",
+        area.width, area.height, icon_grid->get_pages(), removed);
+  return true;
+}
+
+void Desktop::show_icons (Display *display, std::vector <Icon *> &icons)
+{
+  // Composes and draws the normal surface of new icons, leaving their hover surface for later
+  XEvent emptyev;
+
+  for (unsigned int n=0; n < icons.size(); n++) {
+    icons[n]->defer_hover (true);
+  }
+
+  prerender_icons (icons, true, false);
+  for (unsigned int n=0; n < icons.size(); n++) {
+    icons[n]->draw(display, emptyev, false);
+  }
+
+  if (icons.size() && first_icon_ms == -1) {
+    XFlush (display);
+    first_icon_ms = (long) (now_ms() - startup_ms);
+    log1 ("Time to first icon (ms)", first_icon_ms);
+  }
+}
+
+void Desktop::startup_slice (int timer_id, void *data)
+{
+  Desktop *pdesktop = (Desktop *) data;
+  pdesktop->run_startup_slice (pdesktop->pdisplay);
+}
+
+bool Desktop::run_startup_slice (Display *display)
+{
+  // Does a bounded amount of the startup work, so events are attended in between.
+  // Returns true when there is nothing left to do.
+  if (interactive_ms == -1) {
+    // The main loop is running, icons shown so far respond to the user from now on
+    interactive_ms = (long) (now_ms() - startup_ms);
+    log1 ("Time to interactive (ms)", interactive_ms);
+  }
+
+  if (startup_stage == STARTUP_STAGE_ICONS) {
+    // Auto placed icons, a few at a time
+    std::vector <Icon *> created_icons;
+    unsigned int count = 0;
+    while (startup_pending.size() && count++ < STARTUP_SLICE_ICONS) {
+      Icon *pico = add_icon (display, startup_pending.front());
+      startup_pending.pop_front();
+      if (pico && pico->is_realized()) {
+        created_icons.push_back (pico);
+      }
+    }
+
+    show_icons (display, created_icons);
+    if (!startup_pending.size()) {
+      startup_stage = STARTUP_STAGE_HOOKS;
+    }
+  }
+  else if (startup_stage == STARTUP_STAGE_HOOKS) {
+    // Invoke the icon hook so icons are refreshed right after Kdesk startup and refresh signals.
+    // Hooks run in the background, each icon is redrawn when its hook has finished.
+    // With HookBatch the icon hook is called once for all icons.
+    string hookscript = pconf->get_settings().icon_hook;
+    if (hookscript.length() > 0) {
+      if (pconf->get_settings().hook_batch) {
+        call_icon_hook_batch (display, hookscript, startup_hooks);
+      }
+      else {
+        for (unsigned int n=0; n < startup_hooks.size(); n++) {
+          call_icon_hook (display, hookscript, startup_hooks[n]);
+        }
+      }
+    }
+
+    startup_hooks.clear();
+    startup_stage = STARTUP_STAGE_HOVER;
+  }
+  else if (startup_stage == STARTUP_STAGE_HOVER) {
+    // Hover surfaces, a few icons at a time
+    XEvent emptyev;
+    unsigned int count = (startup_hover.size() < STARTUP_SLICE_ICONS ? startup_hover.size() : STARTUP_SLICE_ICONS);
+    std::vector <Icon *> hover_icons (startup_hover.begin(), startup_hover.begin() + count);
+    startup_hover.erase (startup_hover.begin(), startup_hover.begin() + count);
+
+    prerender_icons (hover_icons, false, true);
+    for (unsigned int n=0; n < hover_icons.size(); n++) {
+      // Surfaces the pool could not compose are done by imlib2 on this redraw
+      hover_icons[n]->defer_hover (false);
+      hover_icons[n]->draw(display, emptyev, false);
+    }
+
+    if (!startup_hover.size()) {
+      startup_stage = STARTUP_STAGE_DONE;
+    }
+  }
+
+  if (startup_stage != STARTUP_STAGE_DONE) {
+    return false;
+  }
+
+  if (startup_timer != -1) {
+    preactor->remove_timer (startup_timer);
+    startup_timer = -1;
+  }
+
+  // tell the outside world how the icon creation has completed
+  complete_ms = (long) (now_ms() - startup_ms);
+  log3 ("Startup complete (first icon, interactive, complete ms)", first_icon_ms, interactive_ms, complete_ms);
+  dump_metrics(display);
+
+  // Decoded images of icons gone from the desktop make room for the current ones
+  long budget = pconf->get_settings().pixel_cache_size;
+  ImageCache::trim (budget > 0 ? budget : IMAGECACHE_DEFAULT_BUDGET);
+  return true;
+}
+
+void Desktop::finish_startup (Display *display)
+{
+  // Runs the remaining startup slices at once
+  while (startup_stage != STARTUP_STAGE_DONE) {
+    run_startup_slice (display);
+  }
+}
+
+void Desktop::cancel_startup (void)
+{
+  // Icons are going away, drop the startup work still pending on them
+  if (startup_timer != -1) {
+    preactor->remove_timer (startup_timer);
+    startup_timer = -1;
+  }
+
+  startup_pending.clear();
+  startup_hooks.clear();
+  startup_hover.clear();
+  startup_stage = STARTUP_STAGE_DONE;
+}
+
+bool Desktop::watch_icons (void)
+{
+  // lnk files added, edited or removed in either icon directory are applied from the main loop
+  watch_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (watch_fd == -1 || !preactor->add_fd (watch_fd, EPOLLIN, watch_ready, this)) {
+    log1 ("Could not watch the icon directories (errno)", errno);
+    if (watch_fd != -1) {
+      close (watch_fd);
+      watch_fd = -1;
+    }
+    return false;
+  }
+
+  char *home = getenv ("HOME");
+  string directories[2] = { DIR_KDESKTOP, string(home ? home : "") + "/" + DIR_KDESKTOP_USER };
+  bool watched = false;
+  for (int n=0; n < 2; n++) {
+    if (watch_directory (directories[n])) {
+      watched = true;
+    }
+  }
+
+  return watched;
+}
+
+static bool is_lnk_file (const char *fname)
+{
+  size_t length = strlen (fname);
+  return (length >= 4 && !strcasecmp (fname + length - 4, ".lnk"));
+}
+
+bool Desktop::watch_directory (std::string directory)
+{
+  // Watches an icon directory for lnk file changes. A directory that does not exist yet,
+  // like a new user's ~/.kdesktop, is waited for by watching its parent until it is created.
+  int wd = inotify_add_watch (watch_fd, directory.c_str(),
+			      IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+  if (wd != -1) {
+    watch_dirs[wd] = directory;
+    return true;
+  }
+
+  size_t slash = directory.find_last_of ('/');
+  if (errno != ENOENT || slash == string::npos) {
+    log2 ("Icon directory is not watched (directory, errno)", directory, errno);
+    return false;
+  }
+
+  string parent = (slash ? directory.substr (0, slash) : string("/"));
+  wd = inotify_add_watch (watch_fd, parent.c_str(), IN_CREATE | IN_MOVED_TO | IN_ONLYDIR);
+  if (wd == -1) {
+    log2 ("Icon directory is not watched, nor its parent (directory, errno)", directory, errno);
+    return false;
+  }
+
+  watch_parents.insert (std::make_pair (wd, directory));
+  log1 ("Icon directory does not exist yet, waiting for it to be created", directory);
+  return true;
+}
+
+bool Desktop::queue_directory (std::string directory)
+{
+  // lnk files might be in a new directory before its watch is added, they are all taken as changed.
+  // Returns true if there was any.
+  DIR *dir = opendir (directory.c_str());
+  bool queued = false;
+  if (!dir) {
+    return false;
+  }
+
+  struct dirent *dent;
+  while ((dent = readdir (dir)) != NULL) {
+    if (is_lnk_file (dent->d_name)) {
+      watch_changes.insert (std::make_pair (directory, string (dent->d_name)));
+      queued = true;
+    }
+  }
+
+  closedir (dir);
+  return queued;
+}
+
+void Desktop::watch_ready (int fd, unsigned int events, void *data)
+{
+  // Collects the names of changed lnk files, they are reloaded when the burst is over
+  Desktop *pdesktop = (Desktop *) data;
+  char buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t length;
+  bool changed = false;
+
+  while ((length = read (fd, buffer, sizeof (buffer))) > 0) {
+    for (char *ptr = buffer; ptr < buffer + length; ) {
+      struct inotify_event *event = (struct inotify_event *) ptr;
+      ptr += sizeof (struct inotify_event) + event->len;
+
+      // A watched directory has been removed, wait for it to come back
+      std::map <int, std::string>::iterator it = pdesktop->watch_dirs.find (event->wd);
+      if ((event->mask & IN_IGNORED) && it != pdesktop->watch_dirs.end()) {
+        string directory = it->second;
+        pdesktop->watch_dirs.erase (it);
+        pdesktop->watch_directory (directory);
+        continue;
+      }
+
+      // A missing icon directory has been created, lnk files already in it are applied too
+      std::multimap <int, std::string>::iterator parent = pdesktop->watch_parents.lower_bound (event->wd);
+      while (event->len && (event->mask & IN_ISDIR) && parent != pdesktop->watch_parents.end() && parent->first == event->wd) {
+        string directory = parent->second;
+        if (directory.substr (directory.find_last_of ('/') + 1) != event->name) {
+          ++parent;
+          continue;
+        }
+
+        pdesktop->watch_parents.erase (parent++);
+        if (pdesktop->watch_parents.find (event->wd) == pdesktop->watch_parents.end()) {
+          inotify_rm_watch (fd, event->wd);
+        }
+
+        log1 ("Icon directory has been created, watching it", directory);
+        if (pdesktop->watch_directory (directory) && pdesktop->queue_directory (directory)) {
+          changed = true;
+        }
+      }
+
+      // Editors and installers leave all sorts of temporary files around, only lnk files matter
+      if (!event->len || it == pdesktop->watch_dirs.end() || !is_lnk_file (event->name)) {
+        continue;
+      }
+
+      pdesktop->watch_changes.insert (std::make_pair (it->second, string (event->name)));
+      changed = true;
+    }
+  }
+
+  if (changed) {
+    // Every new change restarts the wait, so a burst is applied at once
+    if (pdesktop->watch_timer != -1) {
+      pdesktop->preactor->remove_timer (pdesktop->watch_timer);
+    }
+
+    pdesktop->watch_timer = pdesktop->preactor->add_timer (ICON_WATCH_DEBOUNCE, 0, watch_expired, pdesktop);
+  }
+}
+
+void Desktop::watch_expired (int timer_id, void *data)
+{
+  Desktop *pdesktop = (Desktop *) data;
+
+  pdesktop->preactor->remove_timer (timer_id);
+  pdesktop->watch_timer = -1;
+  pdesktop->apply_icon_changes (pdesktop->pdisplay);
+}
+
+bool Desktop::apply_icon_changes (Display *display)
+{
+  // Only the lnk files that changed are parsed again, and only their icons
+  // are created, destroyed, or updated in place. Other icons stay as they are.
+  std::set <std::pair <std::string, std::string> > changes;
+  changes.swap (watch_changes);
+  if (!icon_grid || !changes.size()) {
+    return false;
+  }
+
+  // Icons are rebound to their specs below, they all need to exist by now
+  finish_startup (display);
+
+  std::vector <std::pair <std::string, std::string> > added, updated;
+  std::vector <ICON_SPEC> previous_specs;
+  std::set <std::pair <std::string, std::string> >::iterator ch;
+  for (ch=changes.begin(); ch != changes.end(); ++ch)
+    {
+      ICON_SPEC previous;
+      int result = pconf->reload_icon_file (ch->first.c_str(), ch->second, previous);
+      if (result == ICON_FILE_REMOVED) {
+        if (remove_icon_file (display, previous.directory, previous.filename)) {
+          log1 ("Icon has been removed from desktop (lnk is gone)", previous.filename);
+        }
+      }
+      else if (result == ICON_FILE_ADDED) {
+        added.push_back (*ch);
+      }
+      else if (result == ICON_FILE_UPDATED) {
+        updated.push_back (*ch);
+        previous_specs.push_back (previous);
+      }
+    }
+
+  pconf->wait_svg_rendering();
+
+  // Specs have moved around, rebind the icons that are left
+  std::set <Icon *>::iterator it;
+  for (it=desktop_icons.begin(); it != desktop_icons.end(); ++it)
+    {
+      (*it)->set_iconid (pconf->find_icon_spec ((*it)->get_icon_directory(), (*it)->get_icon_filename()));
+    }
+
+  XEvent emptyev;
+  memset (&emptyev, 0x00, sizeof (emptyev));
+  for (unsigned int n=0; n < updated.size(); n++)
+    {
+      Icon *pico = find_icon_file (updated[n].first, updated[n].second);
+      int nicon = pconf->find_icon_spec (updated[n].first, updated[n].second);
+      if (pico && pico->refresh_spec (nicon, previous_specs[n])) {
+        log1 ("Icon has been updated in place", updated[n].second);
+        pico->clear (display, emptyev);
+        pico->draw (display, emptyev, false);
+        continue;
+      }
+
+      // Moved or resized, the icon is created again
+      remove_icon_file (display, updated[n].first, updated[n].second);
+      added.push_back (updated[n]);
+    }
+
+  // Startup is over, icons are shown and given their first hook call right here
+  std::vector <Icon *> created_icons, shown_icons;
+  for (unsigned int n=0; n < added.size(); n++)
+    {
+      int nicon = pconf->find_icon_spec (added[n].first, added[n].second);
+      Icon *pico = add_icon (display, nicon);
+      if (!pico) {
+        continue;
+      }
+
+      log2 ("adding new icon to desktop (name, id)", added[n].second, nicon);
+      created_icons.push_back (pico);
+      if (pico->is_realized()) {
+        shown_icons.push_back (pico);
+      }
+    }
+
+  startup_hooks.clear();
+  startup_hover.clear();
+  prerender_icons (shown_icons, true, true);
+  for (unsigned int n=0; n < shown_icons.size(); n++) {
+    shown_icons[n]->draw(display, emptyev, false);
+  }
+
+  // New and recreated icons are given their first hook call
+  string hookscript = pconf->get_settings().icon_hook;
+  if (hookscript.length() > 0 && created_icons.size()) {
+    if (pconf->get_settings().hook_batch) {
+      call_icon_hook_batch (display, hookscript, created_icons);
+    }
+    else {
+      for (unsigned int n=0; n < created_icons.size(); n++) {
+        call_icon_hook (display, hookscript, created_icons[n]);
       }
     }
+  }
+
+  // Removed icons may have emptied the last grid page
+  if (current_page >= icon_grid->get_pages()) {
+    show_page (display, icon_grid->get_pages() - 1);
+  }
 
-  return NULL;
+  dump_metrics(display);
+  log3 ("Icon lnk file changes applied (files, created, num icons)", changes.size(), created_icons.size(), numicons);
+  return true;
+}
+
+Icon *Desktop::find_icon_file (std::string directory, std::string filename)
+{
+  // Returns the icon loaded from the lnk filename in directory, or NULL
+  std::unordered_map <std::string, Icon *>::iterator it = icon_files.find (Configuration::spec_key (directory, filename));
+  return (it == icon_files.end() ? NULL : it->second);
+}
+
+bool Desktop::remove_icon_file (Display *display, std::string directory, std::string filename)
+{
+  // Takes the icon of a lnk file off the desktop, returns false if there was none
+  Icon *pico = find_icon_file (directory, filename);
+  if (!pico) {
+    return false;
+  }
+
+  unregister_icon (pico);
+  pico->destroy(display);
+  delete pico;
+  return true;
+}
+
+Icon *Desktop::find_icon_name (char *icon_name)
+{
+  // Icon names are hashed, hooks and queries find their icon in constant time
+  std::unordered_map <std::string, Icon *>::iterator it = icon_names.find (Configuration::icon_key (icon_name));
+  if (it == icon_names.end()) {
+    return NULL;
+  }
+
+  log2 ("Icon name found (name, instance)", icon_name, it->second);
+  return it->second;
 }
 
 bool Desktop::redraw_icons (Display *display, bool forceClear)
 {
-  // Search through the icon dispatcher table for the icon filename
+  // Only realized icons are in the dispatcher table, icons on other grid pages have nothing to draw
   XEvent ev;
-  std::map <Window, Icon *>::iterator it;
+  std::unordered_map <Window, Icon *>::iterator it;
   int redraws=0;
 
   memset (&ev, 0x00, sizeof (ev));
@@ -198,24 +869,23 @@ bool Desktop::redraw_icons (Display *display, bool forceClear)
 
 bool Desktop::destroy_icons (Display *display)
 {
-  std::map <Window, Icon *>::iterator it;
+  std::set <Icon *>::iterator it;
+
+  cancel_startup();
 
   // Ask every icon to close, deallocate, and disappear from the desktop
-  for (it=iconHandlers.begin(); it != iconHandlers.end(); ++it)
+  for (it=desktop_icons.begin(); it != desktop_icons.end(); ++it)
     {
-      // The reason we check for icon handler validity here is because
-      // during close time, the previous icons can still get notification
-      // events which we are not dealing with anymore, they are defunct.
-      // This is the case with hover effects when the mouse is over them during refresh.
-      if (it->second) {
-	it->second->destroy(display);
-	delete it->second;
-      }
+      (*it)->destroy(display);
+      delete *it;
     }
 
   // Then erase each window->handler mapping entry, and empty the map list
   iconHandlers.erase(iconHandlers.begin(), iconHandlers.end());
   iconHandlers.clear();
+  desktop_icons.clear();
+  icon_names.clear();
+  icon_files.clear();
   numicons = 0;
 
   // Reset imlib2 image cache memory, only if a cache is specified.
@@ -229,264 +899,368 @@ bool Desktop::destroy_icons (Display *display)
 
 bool Desktop::reload_icons (Display *display)
 {
-  pconf->reset_icons();
+  // Icons are matched against the new lnk files, they all need to exist by now
+  finish_startup (display);
+
+  // Every lnk file is read again, pending changes from the directory watch are included
+  watch_changes.clear();
+
+  // Keep the records of the icons on the desktop to tell which lnk files have changed
+  std::vector <ICON_SPEC> previous_specs;
+  pconf->take_icons (previous_specs);
   pconf->load_icons(DIR_KDESKTOP);
+  pconf->wait_svg_rendering();
 
   log ("Reloading desktop icons only");
 
-  // delete desktop icons for which lnk files have been removed
-  std::map <Window, Icon *>::iterator it;
-  for (it=iconHandlers.begin(); it != iconHandlers.end(); ++it)
+  // Each icon is looked up once by its directory and lnk file name, then its new record is compared by digest
+  std::unordered_map <std::string, Icon *> on_desktop;
+  std::set <Icon *>::iterator it;
+  int removed=0, updated=0;
+  XEvent emptyev;
+
+  memset (&emptyev, 0x00, sizeof (emptyev));
+  for (it=desktop_icons.begin(); it != desktop_icons.end(); )
     {
-      if (it->second != NULL)
-        {
-          bool found = false;
-          string iconname = it->second->get_icon_filename().c_str();
-          for (int nicon=0; nicon < pconf->get_numicons(); nicon++)
-            {
-              string icon_filename = pconf->get_icon_string(nicon, "filename");
-              if (!strcasecmp (icon_filename.c_str(), it->second->get_icon_filename().c_str())) {
-                found=true;
-              }
-            }
+      Icon *pico = *it;
+
+      int oldid = pico->get_iconid();
+      string key = Configuration::spec_key (pico->get_icon_directory(), pico->get_icon_filename());
+      int nicon = pconf->find_icon_spec (pico->get_icon_directory(), pico->get_icon_filename());
+      if (nicon != -1 && oldid >= 0 && oldid < (int) previous_specs.size()) {
+        const ICON_SPEC *spec = pconf->get_icon_spec (nicon);
+        const ICON_SPEC &previous = previous_specs[oldid];
+        if (spec->digest == previous.digest) {
+          // Not edited, it only needs to point to its new record
+          pico->set_iconid (nicon);
+          on_desktop[key] = pico;
+          ++it;
+          continue;
+        }
 
-          if (!found) {
-            // the desktop icon is missing the lnk file, remove it from the desktop
-            log1 ("Icon has been removed from desktop (lnk is gone)", it->second->get_icon_filename().c_str());
-            it->second->destroy(display);
-            delete it->second;
-            it->second = NULL;
-            numicons--;
-          }
+        if (pico->refresh_spec (nicon, previous)) {
+          log1 ("Icon has been updated in place", pico->get_icon_filename());
+          pico->clear (display, emptyev);
+          pico->draw (display, emptyev, false);
+          on_desktop[key] = pico;
+          updated++;
+          ++it;
+          continue;
         }
+      }
+
+      // The lnk file is gone, or its icon moved or resized and is created again
+      ++it;
+      log1 ("Icon has been removed from desktop", pico->get_icon_filename());
+      unregister_icon (pico);
+      pico->destroy(display);
+      delete pico;
+      removed++;
     }
-  
-  // search for newly added lnk files and create their desktop icons.
+
+  // New lnk files, and the ones of icons removed above, are created from the main loop in slices.
+  // The desktop keeps attending events while a large icon directory is being added.
+  cancel_startup();
   for (int nicon=0; nicon < pconf->get_numicons(); nicon++)
     {
-      string icon_filename = pconf->get_icon_string(nicon, "filename");
-      bool found=false;
-      for (it=iconHandlers.begin(); it != iconHandlers.end(); ++it)
-        {
-          if (it->second != NULL) {
-            if (!strcasecmp (icon_filename.c_str(), it->second->get_icon_filename().c_str())) {
-              found=true;
-
-              // update the iconid as reported from the configurator,
-              // as they have most probably been rearranged in the preceding "remove" loop
-              it->second->set_iconid(nicon);
-            }
-          }
-        }
-      
-      if (!found) {
-        // create a new icon handler and add it to the desktop
-        log2 ("adding new icon to desktop (name, id)", icon_filename, nicon);
-
-        Icon *pico = new Icon(pconf, nicon);
-        Window wicon = pico->create(display, icon_grid);
-        if (wicon) {
-	  XEvent emptyev;
-	  iconHandlers[wicon] = pico;
-	  pico->draw(display, emptyev, false);
-        }
-        numicons++;
-        log1 ("Nem icon has been added to desktop", icon_filename);
+      const ICON_SPEC *spec = pconf->get_icon_spec (nicon);
+      string key = Configuration::spec_key (spec->directory, spec->filename);
+      if (on_desktop.find (key) == on_desktop.end()) {
+        startup_pending.push_back (nicon);
+        on_desktop[key] = NULL;
       }
     }
 
-  // tell the outside world how the icon creation has completed
-  dump_metrics(display);
+  // Removed icons may have emptied the last grid page
+  if (current_page >= icon_grid->get_pages()) {
+    show_page (display, icon_grid->get_pages() - 1);
+  }
+
+  log3 ("Icon lnk files compared (removed, updated, to create)", removed, updated, startup_pending.size());
+  if (startup_pending.size()) {
+    startup_ms = now_ms();
+    first_icon_ms = interactive_ms = complete_ms = -1;
+    startup_stage = STARTUP_STAGE_ICONS;
+    startup_timer = preactor->add_timer (0, STARTUP_SLICE_INTERVAL, startup_slice, this);
+    if (startup_timer == -1) {
+      finish_startup (display);
+    }
+  }
+  else {
+    // tell the outside world how the icon reload has completed
+    dump_metrics(display);
+  }
+
   log1 ("Finished reloading desktop icons only (num icons)", pconf->get_numicons());
   return true;
 }
 
+void Desktop::prerender_icons (std::vector <Icon *> &icons, bool normal, bool hover)
+{
+  // Image decoding, resizing and blending are done by a pool of threads for all icons at once.
+  // imlib2 is only used on this thread, to take over the finished surfaces.
+  std::vector <DECODE_JOB *> jobs;
+  std::vector <Icon *> owners;
+
+  for (unsigned int n=0; n < icons.size(); n++) {
+    DECODE_JOB *job = new DECODE_JOB();
+    icons[n]->prepare_decode (job);
+    job->want_normal = (job->want_normal && normal);
+    job->want_hover = (job->want_hover && hover);
+    if (job->want_normal || job->want_hover) {
+      jobs.push_back (job);
+      owners.push_back (icons[n]);
+    }
+    else {
+      delete job;
+    }
+  }
+
+  if (!jobs.size()) {
+    return;
+  }
+
+  DecodePool decoder (pconf->get_settings().decode_threads);
+  decoder.run (jobs);
+
+  int adopted=0;
+  for (unsigned int n=0; n < jobs.size(); n++) {
+    if (owners[n]->adopt_decoded (jobs[n])) {
+      adopted++;
+    }
+    delete jobs[n];
+  }
+
+  log2 ("Icon surfaces composed by the decode pool (icons, adopted)", jobs.size(), adopted);
+}
+
 bool Desktop::process_and_dispatch(Display *display)
 {
-  // Process X11 events and dispatch them to each icon handler for processing
+  // This is the main processing loop. X11 events are dispatched to each icon handler,
+  // signals, timers and child processes are attended by the reactor in between.
+  // Returns true if kdesk settings need to be reloaded.
+  XEvent ev;
+
+  dispatch_status = DISPATCH_CONTINUE;
+  do
+    {
+      // Xlib may have queued events while waiting for a reply to some request,
+      // those will not show up again as activity on the connection descriptor.
+      while (dispatch_status == DISPATCH_CONTINUE && XPending (display)) {
+	XNextEvent(display, &ev);
+	dispatch_status = dispatch_event (display, ev);
+      }
+
+      if (dispatch_status == DISPATCH_CONTINUE) {
+	preactor->dispatch (-1);
+      }
+
+    } while (dispatch_status == DISPATCH_CONTINUE && !finish);
+
+  return (dispatch_status != DISPATCH_DONE);
+}
+
+int Desktop::dispatch_event(Display *display, XEvent &ev)
+{
+  // Process a single X11 event, returns DISPATCH_CONTINUE unless the main loop needs to stop
   static unsigned long last_click=0, last_dblclick=0;
   bool doubleclicked, oneclick;
   static bool bstarted = false;
-  int iGrace = 500;
-  XEvent ev;
-  Window wtarget = 0;
+  Window wtarget = ev.xany.window;
 
-  do
+  // Monitors plugged, unplugged or resized. Every new notification restarts the wait,
+  // so the desktop is laid out once the new configuration has settled.
+  if (Monitors::is_change_event (display, randr_event_base, &ev)) {
+    if (relayout_timer != -1) {
+      preactor->remove_timer (relayout_timer);
+    }
+    relayout_timer = preactor->add_timer (MONITOR_CHANGE_DEBOUNCE, 0, relayout_expired, this);
+    return DISPATCH_CONTINUE;
+  }
+
+  // Root and application window changes keep the running apps index up to date
+  if (windex->process_event (&ev)) {
+    return DISPATCH_CONTINUE;
+  }
+
+  // If the event is sent to Kdesk's object control window,
+  // this means it's a special signal sent from external processes via kill SIG or an XSendEvent.
+  // It will allow us to give UIX visual feedback on-the-fly, reload configuration, or other useful async use cases.
+  if (wtarget == wcontrol)
     {
-      // This is the main X11 event processing loop
-      XNextEvent(display, &ev);
-      wtarget = ev.xany.window;
-
-      // If the event is sent to Kdesk's object control window,
-      // this means it's a special signal sent from external processes via kill SIG or an XSendEvent.
-      // It will allow us to give UIX visual feedback on-the-fly, reload configuration, or other useful async use cases.
-      if (wtarget == wcontrol)
-	{
-	  if (ev.type == ClientMessage) {
-	    log2 ("Kdesk client message arriving to control window with atom", ev.type, ev.xclient.data.l[0]);
-	    if ((Atom) ev.xclient.data.l[0] == atom_reload) {
-	      log ("Kdesk object control window receives a RELOAD event");
-	      return true; // true means do whatever you need to, and come back to process_and_dispatch, we are ready.
-	    }
-            if ((Atom) ev.xclient.data.l[0] == atom_reload_icons) {
-              log ("Kdesk object control window receives a ICON RELOAD event");
-              reload_icons (display);
-              return false; // false means do not reload kdesk settings
-	    }
-	    else if ((Atom) ev.xclient.data.l[0] == atom_finish) {
-              log ("Kdesk object control window receives a FINISH event");
-              return false; // false means do not reload kdesk settings
-	    }
-	    else if ((Atom) ev.xclient.data.l[0] == atom_icon_alert) {
-
-	      // Kdesk Icon Hooks alert is managed here.
-	      // This event comes with a message string (the icon name)
-	      // The icon name can be 16 bytes maximum. This comes from 20 bytes for X11 CientMessage data buffer minus 4 bytes
-	      // the actual Atom message ID.
-	      // An Icon hook is fired so the icon look&feel can be dynamically changed.
-
-	      // Is there a Kdesk Icon hook defined?
-	      string iconhook_script = pconf->get_config_string("iconhook");
-	      if (iconhook_script.length() == 0) {
-		log ("No kdesk icon hook defined - ignoring alert");
-	      }
-	      else {
-		// Collect the icon name from the X11 event to which the hook alert needs to be sent
-		char alert_iconname[17];
-		memset (alert_iconname, 0x00, sizeof (alert_iconname));
-		memcpy (alert_iconname, &ev.xclient.data.l[1], 16);
-		alert_iconname[16] = 0x00; // Truncate it - this is not a nullified string
-		log1 ("Icon Hook signal received for icon", alert_iconname);
-
-		// Is the icon name on the desktop? Can we send him a signal?
-		Icon *pico_hook = find_icon_name (alert_iconname);
-		if (!pico_hook) {
-		  log ("Could not find this icon on the desktop, ignoring");
-		}
-		else {
-		  log2 ("Calling icon hook script (script, icon name)", iconhook_script, alert_iconname);
-		  call_icon_hook (display, ev, iconhook_script, pico_hook);
-		}
-	      }
-	    }
-	  }
-
-	  XFlush (display);
-	  continue;
-	}
+      // These atoms are the compatibility path for clients that do not use the control socket.
+      // They are translated into the same commands, see run_command.
+      int status = DISPATCH_CONTINUE;
+      if (ev.type == ClientMessage) {
+        string reply;
+        log2 ("Kdesk client message arriving to control window with atom", ev.type, ev.xclient.data.l[0]);
+        if ((Atom) ev.xclient.data.l[0] == atom_reload) {
+          log ("Kdesk object control window receives a RELOAD event");
+          run_command ("reload", reply, &status);
+        }
+        else if ((Atom) ev.xclient.data.l[0] == atom_reload_icons) {
+          log ("Kdesk object control window receives a ICON RELOAD event");
+          run_command ("reload-icons", reply, &status);
+        }
+        else if ((Atom) ev.xclient.data.l[0] == atom_finish) {
+          log ("Kdesk object control window receives a FINISH event");
+          run_command ("finish", reply, &status);
+        }
+        else if ((Atom) ev.xclient.data.l[0] == atom_icon_alert) {
+
+          // Kdesk Icon Hooks alert is managed here.
+          // This event comes with a message string (the icon name)
+          // The icon name can be 16 bytes maximum. This comes from 20 bytes for X11 CientMessage data buffer minus 4 bytes
+          // the actual Atom message ID. The control socket does not have this limit.
+          char alert_iconname[17];
+          memset (alert_iconname, 0x00, sizeof (alert_iconname));
+          memcpy (alert_iconname, &ev.xclient.data.l[1], 16);
+          alert_iconname[16] = 0x00; // Truncate it - this is not a nullified string
+          log1 ("Icon Hook signal received for icon", alert_iconname);
+          run_command (string("alert ") + alert_iconname, reply, &status);
+        }
+      }
 
-      // During Kdesk configuration refresh we might get events for now defunct icon windows
-      if (iconHandlers[wtarget] == NULL) {
-	XFlush (display);
-	continue;
-      }
-
-      // All events directed to the desktop icons we have created are processed here.
-      switch (ev.type)
-	{
-	case ButtonPress:
-
-	  // Stop processing a.s.a.p. if the mouse button being pressed is not left or right.
-	  // Button1=Left, Button2=Middle, Button3=Right, higher than those are mapped to mouse scroll wheel
-	  //
-	  //  http://tronche.com/gui/x/xlib/events/keyboard-pointer/keyboard-pointer.html
-	  //
-	  if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3) {
-	    log1 ("ButtonPress for unsupported button number - ignoring", ev.xbutton.button);
-	    break;
-	  }
-
-          doubleclicked=((ev.xbutton.time - last_click) < pconf->get_config_int("clickdelay")) ? true : false;
-          oneclick=(pconf->get_config_string("oneclick") == "true") ? true : false;
-
-	  // A double click event is defined by the time elapsed between 2 clicks: "clickdelay"
-	  // And a grace time period to protect nested double clicks: "clickgrace"
-	  // Note we are listening for both left and right mouse click events.
-	  log3 ("ButtonPress event: window, time, last click", wtarget, ev.xbutton.time, last_click);
-          if ((doubleclicked == true && oneclick == false) || (doubleclicked == false and oneclick == true))
-	    {
-	      // Protect the UI experience by disallowing a new app startup if one is in progress
-	      if (bstarted == true && (ev.xbutton.time - last_dblclick < pconf->get_config_int("iconstartdelay"))) {
-		log1 ("icon start request too fast (iconstartdelay)", pconf->get_config_int("iconstartdelay"));
-		psound->play_sound("sounddisabledicon");
-	      }
-	      else {
-		log ("Processing mouse click startup event");
-		last_dblclick = ev.xbutton.time;
-		bstarted = false;
-
-		// Save to request an app startup: tell the icon a mouse double click needs processing
-		Window winapp = iconHandlers[wtarget]->find_icon_window (display, iconHandlers[wtarget]->get_appid());
-		if (!winapp) {
-		  // Notify system we are about to load a new app (hourglass)
-		  psound->play_sound("soundlaunchapp");
-
-                  // Show the hourglass mouse
-                  string command_line=iconHandlers[wtarget]->get_commandline();
-                  kdesk_hourglass_start_appcmd((char *) command_line.c_str());
-
-		  bstarted = iconHandlers[wtarget]->double_click (display, ev);
-                  if (!bstarted) {
-                      // Remove the hourglass, we could not start the app
-                      kdesk_hourglass_end();
-                  }
-		}
-		else {
-		  // The app is already running, icon is disabled, unless MaximizeSingleton flag is set
-		  if (pconf->get_config_string("maximizesingleton") == "true") {
-		    log1 ("Maximizing AppID which is a running singleton", iconHandlers[wtarget]->get_appid());
-		    iconHandlers[wtarget]->maximize (display, winapp);
-		  }
-		  else {
-		    log1 ("AppID running, disabling icon with alert sound", iconHandlers[wtarget]->get_appid());
-		    psound->play_sound("sounddisabledicon");
-		  }
-		}
-	      }
-	    }
-	  break;
+      XFlush (display);
+      return status;
+    }
 
-	case ButtonRelease:
-	  if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3) {
-	    log1 ("ButtonRelease for unsupported button number - ignoring", ev.xbutton.button);
-	  }
-	  else {
-	    log2 ("ButtonRelease event to window and time ms", wtarget, ev.xbutton.time);
-	    last_click = ev.xbutton.time;
-	  }
-	  break;
+  // During Kdesk configuration refresh we might get events for now defunct icon windows
+  std::unordered_map <Window, Icon *>::iterator target = iconHandlers.find (wtarget);
+  if (target == iconHandlers.end() || target->second == NULL) {
+    XFlush (display);
+    return DISPATCH_CONTINUE;
+  }
 
-	case MotionNotify:
-	  iconHandlers[wtarget]->motion(display, ev);
-	  break;
+  // All events directed to the desktop icons we have created are processed here.
+  switch (ev.type)
+    {
+    case ButtonPress:
+
+      // Stop processing a.s.a.p. if the mouse button being pressed is not left or right.
+      // Button1=Left, Button2=Middle, Button3=Right, higher than those are mapped to mouse scroll wheel
+      //
+      //  http://tronche.com/gui/x/xlib/events/keyboard-pointer/keyboard-pointer.html
+      //
+      if (ev.xbutton.button == Button4 || ev.xbutton.button == Button5) {
+        // The scroll wheel over an icon flips the icon grid pages
+        show_page (display, current_page + (ev.xbutton.button == Button4 ? -1 : 1));
+        break;
+      }
 
-	case EnterNotify:
-	  log1 ("EnterNotify event to window", wtarget);
-	  iconHandlers[wtarget]->blink_icon(display, ev);
-	  break;
+      if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3) {
+        log1 ("ButtonPress for unsupported button number - ignoring", ev.xbutton.button);
+        break;
+      }
 
-	case LeaveNotify:
-	  log1 ("LeaveNotify event to window", wtarget);
-	  iconHandlers[wtarget]->unblink_icon(display, ev);
-	  break;
+      doubleclicked=((ev.xbutton.time - last_click) < pconf->get_settings().click_delay) ? true : false;
+      oneclick=pconf->get_settings().one_click;
 
-	case Expose:
-	  iconHandlers[wtarget]->draw(display, ev, false);
-	  break;
-	  
-	default:
-	  break;
-	}
+      // A double click event is defined by the time elapsed between 2 clicks: "clickdelay"
+      // And a grace time period to protect nested double clicks: "clickgrace"
+      // Note we are listening for both left and right mouse click events.
+      log3 ("ButtonPress event: window, time, last click", wtarget, ev.xbutton.time, last_click);
+      if ((doubleclicked == true && oneclick == false) || (doubleclicked == false and oneclick == true))
+        {
+          // Protect the UI experience by disallowing a new app startup if one is in progress
+          if (bstarted == true && (ev.xbutton.time - last_dblclick < pconf->get_settings().icon_start_delay)) {
+            log1 ("icon start request too fast (iconstartdelay)", pconf->get_settings().icon_start_delay);
+            psound->play_sound("sounddisabledicon");
+          }
+          else {
+            log ("Processing mouse click startup event");
+            last_dblclick = ev.xbutton.time;
+            bstarted = false;
+
+            // Save to request an app startup: tell the icon a mouse double click needs processing
+            Window winapp = target->second->find_icon_window (display, target->second->get_appid());
+            if (!winapp) {
+              // Notify system we are about to load a new app (hourglass)
+              psound->play_sound("soundlaunchapp");
+
+              // Show the hourglass mouse
+              string command_line=target->second->get_commandline();
+              kdesk_hourglass_start_appcmd((char *) command_line.c_str());
+
+              bstarted = target->second->double_click (display, ev, preactor);
+              if (!bstarted) {
+                  // Remove the hourglass, we could not start the app
+                  kdesk_hourglass_end();
+              }
+            }
+            else {
+              // The app is already running, icon is disabled, unless MaximizeSingleton flag is set
+              if (pconf->get_settings().maximize_singleton) {
+                log1 ("Maximizing AppID which is a running singleton", target->second->get_appid());
+                target->second->maximize (display, winapp);
+              }
+              else {
+                log1 ("AppID running, disabling icon with alert sound", target->second->get_appid());
+                psound->play_sound("sounddisabledicon");
+              }
+            }
+          }
+        }
+      break;
 
-    } while (!finish);
+    case ButtonRelease:
+      if (ev.xbutton.button != Button1 && ev.xbutton.button != Button3) {
+        log1 ("ButtonRelease for unsupported button number - ignoring", ev.xbutton.button);
+      }
+      else {
+        log2 ("ButtonRelease event to window and time ms", wtarget, ev.xbutton.time);
+        last_click = ev.xbutton.time;
+      }
+      break;
 
-  return true;
+    case MotionNotify:
+      target->second->motion(display, ev);
+      break;
+
+    case EnterNotify:
+      log1 ("EnterNotify event to window", wtarget);
+      target->second->blink_icon(display, ev);
+      break;
+
+    case LeaveNotify:
+      log1 ("LeaveNotify event to window", wtarget);
+      target->second->unblink_icon(display, ev);
+      break;
+
+    case Expose:
+      target->second->draw(display, ev, false);
+      break;
+
+    default:
+      break;
+    }
+
+  return DISPATCH_CONTINUE;
+}
+
+void Desktop::signal_callback (int signum, void *data)
+{
+  // Signals are delivered by the reactor on the main thread, no second XServer connection is needed
+  Desktop *pdesktop = (Desktop *) data;
+
+  if (signum == SIGHUP) {
+    log ("Received signal to reload configuration");
+    pdesktop->dispatch_status = DISPATCH_RELOAD;
+  }
+  else if (signum == SIGUSR1) {
+    log ("Received graceful kdesk quit signal");
+    pdesktop->dispatch_status = DISPATCH_DONE;
+  }
+  else {
+    log1 ("Ignoring signal", signum);
+  }
 }
 
-bool Desktop::initialize(Display *display, Configuration *loaded_conf, Sound *ksound)
+bool Desktop::initialize(Display *display, Configuration *loaded_conf, Sound *ksound, Reactor *reactor)
 {
   pconf = loaded_conf;
   psound = ksound;
+  preactor = reactor;
   finish = false;
 
 #ifdef DEBUG
@@ -517,6 +1291,14 @@ bool Desktop::initialize(Display *display, Configuration *loaded_conf, Sound *ks
   // We'll give this window a meaningful name
   XStoreName(display, wcontrol, KDESK_CONTROL_WINDOW_NAME);
 
+  // Advertise the control window on the root, so it can be found without walking the window tree.
+  // The selection is released by the XServer when the window goes away, which tells if the property is stale.
+  Atom atom_control_property = XInternAtom(display, KDESK_CONTROL_WINDOW_PROPERTY, False);
+  Atom atom_control_selection = XInternAtom(display, KDESK_CONTROL_SELECTION, False);
+  XSetSelectionOwner (display, atom_control_selection, wcontrol, CurrentTime);
+  XChangeProperty (display, DefaultRootWindow(display), atom_control_property, XA_WINDOW, 32,
+		   PropModeReplace, (unsigned char *) &wcontrol, 1);
+
 #ifdef DEBUG
   // Show kdesk control window on the bottom right corner of the screen
   XMapWindow (display, wcontrol);
@@ -525,6 +1307,37 @@ bool Desktop::initialize(Display *display, Configuration *loaded_conf, Sound *ks
   XMoveWindow (display, wcontrol, deskw - cw - width, deskh - ch - width);
 #endif
 
+  // Start following application windows so that icon clicks can find them without a tree walk
+  windex->initialize (display);
+
+  // Monitor changes are followed to lay out the wallpaper and icons again
+  Monitors::select_changes (display, &randr_event_base);
+
+  // The XServer connection, and the signals used for external wake-ups, are attended by the reactor.
+  // XServer events are read from the main loop, the descriptor only needs to wake it up.
+  preactor->add_fd (ConnectionNumber(display), EPOLLIN, NULL, NULL);
+  preactor->add_signal (SIGHUP, signal_callback, this);
+  preactor->add_signal (SIGUSR1, signal_callback, this);
+  preactor->add_signal (SIGUSR2, signal_callback, this);
+
+  // Icon hooks run on a pool of workers, each one with a deadline.
+  // Optionally the hook is started only once, as a coprocess that answers every request.
+  pdisplay = display;
+  string hookscript = pconf->get_settings().icon_hook;
+  string coprocess_cmdline;
+  if (hookscript.length() && pconf->get_settings().hook_coprocess) {
+    coprocess_cmdline = "/bin/bash -c \"export KDESK_NO_RECURSE=1; " + hookscript + " " + HOOK_COPROCESS_PARAM + "\"";
+  }
+
+  hookpool->initialize (preactor, pconf->get_settings().hook_concurrency,
+			pconf->get_settings().hook_timeout, coprocess_cmdline, hooks_completed, this);
+
+  // External commands arrive on a Unix socket, the control window atoms are kept for older clients
+  control->initialize (preactor, XDisplayString(display), control_request, this);
+
+  // Icons follow their lnk files as they are added, edited or removed
+  watch_icons();
+
   log1 ("Creating Kdesk control window, handle", wcontrol);
   return (wcontrol ? true : false);
 }
@@ -534,30 +1347,82 @@ bool Desktop::finalize(void)
   finish = true;
 }
 
+Window Desktop::find_advertised_control_window (Display *display, bool *advertised)
+{
+  // Reads the control window ID published on the root window by a running kdesk.
+  // advertised is false if no kdesk has ever published it on this display.
+  Window kdesk_control_window=0L;
+  unsigned long nitems=0L, leftover=0L;
+  Atom actual_type;
+  int actual_format;
+  unsigned char *p = NULL;
+
+  *advertised = false;
+
+  // Do not create the atoms, if they are not there kdesk has not been running
+  Atom atom_control_property = XInternAtom(display, KDESK_CONTROL_WINDOW_PROPERTY, True);
+  Atom atom_control_selection = XInternAtom(display, KDESK_CONTROL_SELECTION, True);
+  if (!atom_control_property || !atom_control_selection) {
+    return 0L;
+  }
+
+  if (XGetWindowProperty (display, DefaultRootWindow(display), atom_control_property, 0L, 1L, False, XA_WINDOW,
+			  &actual_type, &actual_format, &nitems, &leftover, &p) != Success) {
+    return 0L;
+  }
+
+  if (actual_type == XA_WINDOW && nitems == 1 && p) {
+    *advertised = true;
+    kdesk_control_window = *((Window *) p);
+  }
+
+  if (p) {
+    XFree (p);
+  }
+
+  // The property outlives a kdesk that crashed, the selection does not
+  if (kdesk_control_window && XGetSelectionOwner (display, atom_control_selection) != kdesk_control_window) {
+    log1 ("Kdesk control window property is stale", kdesk_control_window);
+    kdesk_control_window = 0L;
+  }
+
+  return kdesk_control_window;
+}
+
 Window Desktop::find_kdesk_control_window (Display *display)
 {
   Window kdesk_control_window=0L;
   Window returnedroot, returnedparent, root = DefaultRootWindow(display);
   char *windowname=NULL;
   Window *children=NULL, *subchildren=NULL;
-  unsigned int numchildren, numsubchildren;
-  
-  // Enumarate top-level windows in search for Kdesk control window
+  unsigned int numchildren=0, numsubchildren=0;
+  bool advertised=false;
+
+  kdesk_control_window = find_advertised_control_window (display, &advertised);
+  if (advertised) {
+    log1 ("Kdesk control window found from the root property", kdesk_control_window);
+    return kdesk_control_window;
+  }
+
+  // Kdesk versions which do not advertise the control window are searched for
+  // by enumerating top-level windows in search for Kdesk control window
   XQueryTree (display, root, &returnedroot, &returnedparent, &children, &numchildren);
-  XWindowAttributes w;
-  int i;
   for (int i=numchildren-1; i>=0 && !kdesk_control_window; i--) {
     
     if (XFetchName (display, children[i], &windowname)) {
       if (!strncmp (windowname, KDESK_CONTROL_WINDOW_NAME, strlen (KDESK_CONTROL_WINDOW_NAME))) {
 	kdesk_control_window = children[i];
 	log1 ("Kdesk control window found", kdesk_control_window);
-	XFree (windowname);
+      }
+      XFree (windowname);
+      if (kdesk_control_window) {
 	break;
       }
     }
     
     // Kdesk might sit a little deeper in the tree hierarchy, let's step in
+    subchildren = NULL;
+    numsubchildren = 0;
     XQueryTree (display, children[i], &returnedroot, &returnedparent, &subchildren, &numsubchildren);
     
     for (int k=numsubchildren-1; k>=0; k--) {
@@ -565,20 +1430,23 @@ Window Desktop::find_kdesk_control_window (Display *display)
 	if (!strncmp (windowname, KDESK_CONTROL_WINDOW_NAME, strlen (KDESK_CONTROL_WINDOW_NAME))) {
 	  kdesk_control_window = subchildren[k];
 	  log1 ("Kdesk control window found", kdesk_control_window);
-	  XFree (windowname);
+	}
+	XFree (windowname);
+	if (kdesk_control_window) {
 	  break;
 	}
       }
     }
+
+    // Each top-level window gets its own list of children
+    if(subchildren) {
+      XFree(subchildren);
+    }
   }
   
   if(children) {
     XFree(children);
   }
-  
-  if(subchildren) {
-    XFree(subchildren);
-  }
 
   return kdesk_control_window;
 }
@@ -629,80 +1497,265 @@ bool Desktop::send_signal (Display *display, const char *signalName, char *messa
   return (rc == Success ? true : false);
 }
 
-bool Desktop::call_icon_hook (Display *display, XEvent ev, string hookscript, Icon *pico_hook)
+bool Desktop::control_request (std::string &request, std::string &reply, void *data)
+{
+  // Called from the reactor for each request arriving on the control socket.
+  // The reply is sent right away, a reload happens once the main loop gets control back.
+  Desktop *pdesktop = (Desktop *) data;
+  int status = DISPATCH_CONTINUE;
+
+  bool success = pdesktop->run_command (request, reply, &status);
+  if (status != DISPATCH_CONTINUE) {
+    pdesktop->dispatch_status = status;
+  }
+
+  return success;
+}
+
+bool Desktop::run_command (std::string request, std::string &reply, int *status)
+{
+  // Runs a command sent from the control socket or the control window atoms.
+  // The first request line is the command and its argument, the rest is bulk data.
+  // The main loop status is updated if kdesk needs to reload or stop dispatching.
+  size_t eol = request.find ('\n');
+  string line = request.substr (0, eol);
+  string payload = (eol == string::npos ? string("") : request.substr (eol + 1));
+  size_t space = line.find (' ');
+  string command = line.substr (0, space);
+  string argument = (space == string::npos ? string("") : line.substr (space + 1));
+
+  if (command == "reload") {
+    *status = DISPATCH_RELOAD; // reload settings, and come back to process_and_dispatch, we are ready.
+  }
+  else if (command == "reload-icons") {
+    reload_icons (pdisplay);
+    *status = DISPATCH_DONE; // do not reload kdesk settings
+  }
+  else if (command == "page") {
+    // Flips the icon grid: "page next", "page previous", or a page number counting from 0
+    int page = current_page;
+    if (argument == "next") {
+      page++;
+    }
+    else if (argument == "previous") {
+      page--;
+    }
+    else if (argument.length() && isdigit (argument[0])) {
+      page = atoi (argument.c_str());
+    }
+    else {
+      reply = "Unknown page: " + argument;
+      return false;
+    }
+
+    show_page (pdisplay, page);
+    char chpage[64];
+    snprintf (chpage, sizeof (chpage), "page %d of %d\n", current_page, (icon_grid ? icon_grid->get_pages() : 1));
+    reply = chpage;
+  }
+  else if (command == "finish") {
+    *status = DISPATCH_DONE; // do not reload kdesk settings
+  }
+  else if (command == "alert") {
+    // An Icon hook is fired so the icon look&feel can be dynamically changed.
+    string iconhook_script = pconf->get_settings().icon_hook;
+    if (iconhook_script.length() == 0) {
+      log ("No kdesk icon hook defined - ignoring alert");
+      reply = "No icon hook defined";
+      return false;
+    }
+
+    // Is the icon name on the desktop? Can we send him a signal?
+    Icon *pico_hook = find_icon_name ((char *) argument.c_str());
+    if (!pico_hook) {
+      log ("Could not find this icon on the desktop, ignoring");
+      reply = "Icon not found: " + argument;
+      return false;
+    }
+
+    log2 ("Calling icon hook script (script, icon name)", iconhook_script, argument);
+    call_icon_hook (pdisplay, iconhook_script, pico_hook);
+  }
+  else if (command == "update") {
+    // Bulk icon updates, in the same format icon hooks answer with:
+    // "Key: value" lines for the icon named in the argument, or after a "[iconname]" line.
+    HOOK_JOB job;
+    job.request = argument;
+    job.exit_code = 0;
+    job.timed_out = false;
+    job.timeout_ms = 0;
+    job.job_callback = NULL;
+    job.job_data = NULL;
+
+    size_t start=0;
+    while (start < payload.length()) {
+      size_t end = payload.find ('\n', start);
+      string update_line = payload.substr (start, (end == string::npos ? string::npos : end - start));
+      HookPool::parse_job_line ((char *) update_line.c_str(), &job);
+      start = (end == string::npos ? payload.length() : end + 1);
+    }
+
+    std::vector <HOOK_JOB *> jobs (1, &job);
+    hooks_completed (jobs, this);
+    char chcount[32];
+    snprintf (chcount, sizeof (chcount), "%d", (int) job.updates.size());
+    reply = string(chcount) + " updates\n";
+  }
+  else if (command == "query") {
+    if (argument == "running") {
+      reply = "kdesk is running\n";
+    }
+    else if (argument == "icons") {
+      std::set <Icon *>::iterator it;
+      for (it=desktop_icons.begin(); it != desktop_icons.end(); ++it) {
+        reply += (*it)->get_icon_name() + "\n";
+      }
+    }
+    else if (!argument.compare (0, 5, "icon ")) {
+      // Same json placement details as "kdesk -j", without walking the window tree.
+      // Icons on grid pages not shown have no window, their placement on the page is given instead.
+      string icon_name = argument.substr (5);
+      Icon *pico = find_icon_name ((char *) icon_name.c_str());
+      if (pico) {
+        XWindowAttributes xwa;
+        memset (&xwa, 0x00, sizeof (xwa));
+        if (!pico->is_realized()) {
+          pico->get_placement (&xwa.x, &xwa.y, &xwa.width, &xwa.height);
+        }
+        if (!pico->is_realized() || XGetWindowAttributes (pdisplay, pico->get_window(), &xwa)) {
+          char chjson[256];
+          snprintf (chjson, sizeof (chjson), "{ \"icon_name\": \"%s\", \"x\": %d, \"y\": %d, "
+                    "\"width\": %d, \"height\": %d, \"page\": %d }\n",
+                    icon_name.c_str(), xwa.x, xwa.y, xwa.width, xwa.height, pico->get_page());
+          reply = chjson;
+          return true;
+        }
+      }
+
+      reply = "Icon not found: " + icon_name;
+      return false;
+    }
+    else {
+      reply = "Unknown query: " + argument;
+      return false;
+    }
+  }
+  else {
+    log1 ("Unknown kdesk control command", command);
+    reply = "Unknown command: " + command;
+    return false;
+  }
+
+  return true;
+}
+
+bool Desktop::call_icon_hook (Display *display, string hookscript, Icon *pico_hook)
 {
-  FILE *fp_iconhooks=NULL;
   char chcmdline[1024];
-  char chline[1024], key[64], value[900], word[256];
-  int updates=0;
 
-  // Given a hook script name and an icon instance, call the script
-  // to update its attributes, then ask the icon instance to refresh them
+  // Given a hook script name and an icon instance, queue the script to run on a hook worker.
+  // Its output is parsed there, and the icon attributes are updated in hooks_completed.
   if (!pico_hook) {
     log ("Icon handler is empty");
     return false;
   }
-  // Execute the Icon Hook, parse the stdout, and communicate with the icon to refresh attributes
 
   // Set environment variable so other programs called from script
   // cannot accidentally create an infinite loop.
   const char *norec = "export KDESK_NO_RECURSE=1";
 
-  sprintf (chcmdline, "/bin/bash -c \"%s; %s %s\"",
-	   norec,
-	   hookscript.c_str(),
-	   pico_hook->get_icon_name().c_str());
-  log1 ("Executing hook script:", chcmdline);
-  fp_iconhooks = popen (chcmdline, "r");
-  while (fgets (chline, sizeof (chline), fp_iconhooks) != NULL)
-    {
-      char *toks=chline;
-      memset (key, 0x00, sizeof(key));
-      memset (value, 0x00, sizeof(value));
-      int n=0;
-      while (sscanf (toks, "%s%n", word, &n) == 1 ) {
-	if (word[strlen(word)-1] == ':') {
-	  strcpy (key, word);
-	}
-	else {
-	  strcat (value, word);
-	  strcat (value, " ");
-	}
-	toks += n;
+  snprintf (chcmdline, sizeof (chcmdline), "/bin/bash -c \"%s; %s %s\"",
+	    norec,
+	    hookscript.c_str(),
+	    pico_hook->get_icon_name().c_str());
+  log1 ("Queueing hook script:", chcmdline);
+  return hookpool->submit (pico_hook->get_icon_name(), chcmdline);
+}
+
+bool Desktop::call_icon_hook_batch (Display *display, string hookscript, std::vector <Icon *> &icons)
+{
+  // Refresh many icons with a single hook call: "hook IconBatch icon1 icon2 ...".
+  // The hook prints a "[iconname]" line before the attributes of each icon,
+  // so that hooks_completed can route them, and all icons are redrawn in one pass.
+  string request = HOOK_BATCH_PARAM;
+  for (size_t n=0; n < icons.size(); n++) {
+    request += " " + icons[n]->get_icon_name();
+  }
+
+  // Set environment variable so other programs called from script
+  // cannot accidentally create an infinite loop.
+  string cmdline = "/bin/bash -c \"export KDESK_NO_RECURSE=1; " + hookscript + " " + request + "\"";
+  // The batch is given more time the more icons it refreshes
+  unsigned long timeout = hookpool->get_timeout() + icons.size() * HOOK_BATCH_ICON_TIMEOUT;
+  log2 ("Queueing batched hook script for icons (icons, timeout ms)", icons.size(), timeout);
+  return hookpool->submit (request, cmdline, NULL, NULL, timeout);
+}
+
+HookPool *Desktop::get_hookpool (void)
+{
+  return hookpool;
+}
+
+void Desktop::hooks_completed (std::vector <HOOK_JOB *> &completed, void *data)
+{
+  // Called from the reactor with all the hooks that finished since the last time.
+  // Attributes are applied first, then each modified icon is redrawn only once.
+  Desktop *pdesktop = (Desktop *) data;
+  std::set <Icon *> modified;
+  XEvent ev;
+
+  memset (&ev, 0x00, sizeof (ev));
+  for (size_t n=0; n < completed.size(); n++) {
+    HOOK_JOB *job = completed[n];
+    if (!job->updates.size()) {
+      continue;
+    }
+
+    // Lines printed before a hook was killed are complete, a batch keeps the sections it got through
+    if (job->timed_out) {
+      log2 ("Hook timed out, applying the updates printed so far (request, updates)", job->request, job->updates.size());
+    }
+
+    for (size_t u=0; u < job->updates.size(); u++) {
+      // Batched hooks name the icon of each attribute, single icon hooks are named by the request.
+      // The icon might have gone away while its hook was running.
+      string icon_name = job->updates[u].icon_name.length() ? job->updates[u].icon_name : job->request;
+      Icon *pico_hook = pdesktop->find_icon_name ((char *) icon_name.c_str());
+      if (!pico_hook) {
+        log1 ("Hook finished for an icon no longer on the desktop", icon_name);
+        continue;
       }
-	
-      // Parse the keys (attributes) that can be applied to the icon, pass them to the icon instance
-      value[strlen(value)-1]=0x00;
-      if (!strcmp (key, "Message:")) {
+
+      char *value = (char *) job->updates[u].value.c_str();
+      string key = job->updates[u].key;
+      if (key == "Message:") {
         pico_hook->set_message (value);
-	updates++;
       }
-      else if (!strcmp (key, "Caption:")) {
-	pico_hook->set_caption (value);
-	updates++;
+      else if (key == "Caption:") {
+        pico_hook->set_caption (value);
       }
-      else if (!strcmp (key, "Icon:")) {
-	pico_hook->set_icon (value);
-	updates++;
+      else if (key == "Icon:") {
+        pico_hook->set_icon (value);
       }
-      else if (!strcmp (key, "IconStamp:")) {
-	pico_hook->set_icon_stamp (value);
-	updates++;
+      else if (key == "IconStamp:") {
+        pico_hook->set_icon_stamp (value);
       }
-      else if (!strcmp (key, "IconStatus:")) {
+      else if (key == "IconStatus:") {
         pico_hook->set_icon_status (value);
-	updates++;
       }
+
+      modified.insert (pico_hook);
     }
-    
-  // Redraw the icon if attributes have been modified
-  pclose (fp_iconhooks);
-  if (updates) {
-    log1 ("Populating hook updates to icon (#updates)", updates);
-    pico_hook->clear(display, ev);
-    pico_hook->draw(display, ev, false);
   }
-  return true;
+
+  // Redraw the icons whose attributes have been modified
+  std::set <Icon *>::iterator it;
+  for (it=modified.begin(); it != modified.end(); ++it) {
+    (*it)->clear (pdesktop->pdisplay, ev);
+    (*it)->draw (pdesktop->pdisplay, ev, false);
+  }
+
+  log2 ("Populated hook updates to icons (#hooks, #icons)", completed.size(), modified.size());
 }
 
 bool Desktop::get_metrics_filename(Display *display, char *chfilename, int size)
@@ -733,7 +1786,11 @@ bool Desktop::dump_metrics (Display *display)
   if (fp) {
     fprintf (fp, "{\n \"icons-found\": %d,\n", pconf->get_numicons());
     fprintf (fp, " \"icons-rendered\": %d,\n", numicons);
-    fprintf (fp, " \"grid-full\": %s\n}\n", icon_grid->grid_full == true ? "true" : "false");
+    fprintf (fp, " \"time-to-first-icon\": %ld,\n", first_icon_ms);
+    fprintf (fp, " \"time-to-interactive\": %ld,\n", interactive_ms);
+    fprintf (fp, " \"time-to-complete\": %ld,\n", complete_ms);
+    fprintf (fp, " \"grid-pages\": %d,\n", icon_grid->get_pages());
+    fprintf (fp, " \"grid-full\": %s\n}\n", icon_grid->get_pages() > 1 ? "true" : "false");
     log1 ("Metrics file saved", chmetrics_filename);
     fclose (fp);
 
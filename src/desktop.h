@@ -14,12 +14,43 @@
 //
 
 #define KDESK_CONTROL_WINDOW_NAME "KdeskControlWindow"
+
+// Root window property with the control window ID, valid while the control window owns the selection
+#define KDESK_CONTROL_WINDOW_PROPERTY  "_KDESK_CONTROL_WINDOW"
+#define KDESK_CONTROL_SELECTION        "_KDESK_CONTROL_OWNER"
 #define KDESK_SIGNAL_FINISH       "KSIG_FINISH"
 #define KDESK_SIGNAL_RELOAD       "KSIG_RELOAD"
 #define KDESK_SIGNAL_RELOAD_ICONS "KSIG_RELOAD_ICONS"
 #define KDESK_SIGNAL_ICON_ALERT   "KSIG_ICON_ALERT"
 
+// What the main loop needs to do after an event has been dispatched
+#define DISPATCH_CONTINUE 0   // keep processing events
+#define DISPATCH_RELOAD   1   // stop, kdesk settings need to be reloaded
+#define DISPATCH_DONE     2   // stop, without reloading settings
+
+// Startup work done in slices from the main loop, after the first icons are shown
+#define STARTUP_STAGE_ICONS  0    // create auto placed icons
+#define STARTUP_STAGE_HOOKS  1    // run the icon hooks
+#define STARTUP_STAGE_HOVER  2    // compose hover surfaces
+#define STARTUP_STAGE_DONE   3
+
+// Icons created or given a hover surface on each slice, and milliseconds between slices
+#define STARTUP_SLICE_ICONS     8
+#define STARTUP_SLICE_INTERVAL  1
+
+// Both lnk directories are watched, changes are applied once no more arrive for these milliseconds
+#define ICON_WATCH_DEBOUNCE  250
+
+// Monitor changes come in bursts of RandR notifications, the desktop is laid out again
+// once no more arrive for these milliseconds
+#define MONITOR_CHANGE_DEBOUNCE  200
+
 class IconGrid;
+class ResourcePool;
+class WindowIndex;
+class Reactor;
+class HookPool;
+class ControlServer;
 
 class Desktop
 {
@@ -27,14 +58,37 @@ class Desktop
   Window wcontrol;
   Background *pbground;
   bool initialized;
-  std::map <Window, Icon *> iconHandlers;
+  std::unordered_map <Window, Icon *> iconHandlers;       // realized icons only, by window
+  std::set <Icon *> desktop_icons;                      // every icon, on any grid page
+  std::unordered_map <std::string, Icon *> icon_names;  // lowercase icon name -> icon, for hooks and queries
+  std::unordered_map <std::string, Icon *> icon_files;  // directory and lowercase lnk file name -> icon
   IconGrid *icon_grid;
+  int current_page;                                     // grid page on screen
+  ResourcePool *pool;
+  WindowIndex *windex;
+  Reactor *preactor;
+  HookPool *hookpool;
+  ControlServer *control;
+  Display *pdisplay;
+  int dispatch_status;
   Configuration *pconf;
   Sound *psound;
   bool finish;
   static int error_trap_depth;
   int numicons;
   int cache_size;
+  unsigned long launch_ms, startup_ms;
+  long first_icon_ms, interactive_ms, complete_ms;  // startup metrics, -1 until reached
+  int startup_stage;
+  int startup_timer;
+  std::deque <int> startup_pending;                 // second pass icons not created yet
+  std::vector <Icon *> startup_hooks;               // icons waiting for their first hook call
+  std::deque <Icon *> startup_hover;                // icons waiting for their hover surface
+  int watch_fd, watch_timer;
+  std::map <int, std::string> watch_dirs;           // inotify watch descriptor -> lnk directory
+  std::multimap <int, std::string> watch_parents;   // parent watch descriptor -> lnk directory not created yet
+  std::set <std::pair <std::string, std::string> > watch_changes; // directory and lnk file changed since the last reload
+  int randr_event_base, relayout_timer;
   Atom atom_finish, atom_reload, atom_reload_icons, atom_icon_alert;
 
  public:
@@ -47,17 +101,47 @@ class Desktop
   bool redraw_icons (Display *display, bool forceClear);
   bool destroy_icons (Display *display);
   bool reload_icons (Display *display);
+  void prerender_icons (std::vector <Icon *> &icons, bool normal, bool hover);
+  Icon *add_icon (Display *display, int nicon);
+  void show_icons (Display *display, std::vector <Icon *> &icons);
+  static void startup_slice (int timer_id, void *data);
+  bool run_startup_slice (Display *display);
+  void finish_startup (Display *display);
+  void cancel_startup (void);
+  bool watch_icons (void);
+  bool watch_directory (std::string directory);
+  bool queue_directory (std::string directory);
+  static void watch_ready (int fd, unsigned int events, void *data);
+  static void watch_expired (int timer_id, void *data);
+  bool apply_icon_changes (Display *display);
+  Icon *find_icon_file (std::string directory, std::string filename);
+  void register_icon (Icon *pico);
+  void unregister_icon (Icon *pico);
+  bool remove_icon_file (Display *display, std::string directory, std::string filename);
+  bool show_page (Display *display, int page);
+  void realize_page (Display *display, std::vector <Icon *> &shown_icons);
+  static bool is_first_pass (const ICON_SPEC *spec);
+  static void relayout_expired (int timer_id, void *data);
+  bool relayout_desktop (Display *display);
 
   bool notify_startup_load (Display *display, int iconid, Time time);
   bool notify_startup_ready (Display *display);
   void notify_startup_event (Display *display, XEvent *pev);
 
-  bool initialize(Display *display, Configuration *loaded_conf, Sound *psound);
+  bool initialize(Display *display, Configuration *loaded_conf, Sound *psound, Reactor *reactor);
   bool is_kdesk_running (Display *display);
+  Window find_advertised_control_window (Display *display, bool *advertised);
   Window find_kdesk_control_window (Display *display);
   bool process_and_dispatch(Display *display);
+  int dispatch_event(Display *display, XEvent &ev);
+  static void signal_callback(int signum, void *data);
   bool send_signal (Display *display, const char *signalName, char *message);
-  bool call_icon_hook (Display *display, XEvent ev, std::string hookscript, Icon *pico_hook);
+  bool run_command (std::string request, std::string &reply, int *status);
+  static bool control_request (std::string &request, std::string &reply, void *data);
+  bool call_icon_hook (Display *display, std::string hookscript, Icon *pico_hook);
+  bool call_icon_hook_batch (Display *display, std::string hookscript, std::vector <Icon *> &icons);
+  static void hooks_completed (std::vector <HOOK_JOB *> &completed, void *data);
+  HookPool *get_hookpool (void);
   bool finalize(void);
   bool get_metrics_filename(Display *display, char *chfilename, int size);
   bool dump_metrics (Display *display);
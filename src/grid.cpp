@@ -18,33 +18,43 @@ int IconGrid::ICON_H;
 IconGrid::IconGrid(Display *display, Configuration *pconf)
 {
   int screen_num = DefaultScreen(display);
-  int w = DisplayWidth(display, screen_num);
-  int h = DisplayHeight(display, screen_num);
+  setup(0, 0, DisplayWidth(display, screen_num), DisplayHeight(display, screen_num), pconf);
+}
+
+IconGrid::IconGrid(int screen_width, int screen_height, Configuration *pconf)
+{
+  setup(0, 0, screen_width, screen_height, pconf);
+}
+
+IconGrid::IconGrid(int screen_x, int screen_y, int screen_width, int screen_height, Configuration *pconf)
+{
+  setup(screen_x, screen_y, screen_width, screen_height, pconf);
+}
 
-  grid_full = false;
+void IconGrid::setup(int x, int y, int w, int h, Configuration *pconf)
+{
+  int columns = 0;
+  HORZ_SPC = DEFAULT_ICON_HORZ_SPACE;
+  VERT_SPC = DEFAULT_ICON_VERT_SPACE;
+  ICON_W = ICON_H = 0;
 
   // Get the grid dimensions from kdeskrc file
   if (pconf) {
 
       // this is the blank, unsensitive empty space beween icons, horizontally and vertically.
-      int horz_gap=pconf->get_config_int("icongaphorz");
+      int horz_gap=pconf->get_settings().icon_gap_horz;
       if (horz_gap) {
           HORZ_SPC=horz_gap;
       }
-      else {
-          HORZ_SPC=DEFAULT_ICON_HORZ_SPACE;
-      }
 
-      int vert_gap=pconf->get_config_int("icongapvert");
+      int vert_gap=pconf->get_settings().icon_gap_vert;
       if (vert_gap) {
           VERT_SPC=vert_gap;
       }
-      else {
-          VERT_SPC=DEFAULT_ICON_VERT_SPACE;
-      }
       
-      ICON_W = pconf->get_config_int("gridwidth");
-      ICON_H = pconf->get_config_int("gridheight");
+      ICON_W = pconf->get_settings().grid_width;
+      ICON_H = pconf->get_settings().grid_height;
+      columns = pconf->get_settings().grid_columns;
   }
 
   // Or set default values if they're not defined
@@ -56,20 +66,43 @@ IconGrid::IconGrid(Display *display, Configuration *pconf)
     ICON_H = DEFAULT_GRID_HEIGHT;
   }
 
+  if (columns <= 0) {
+    columns = DEFAULT_GRID_COLUMNS;
+  }
+
   log2 ("Icon grid width and height", ICON_W, ICON_H);
 
   // Take into account the space needed for the icon and the empty margin
   width = w / (ICON_W + HORZ_SPC);
-  if (width > MAX_FIELDS_X)
-    width = MAX_FIELDS_X;
+  if (width > columns)
+    width = columns;
 
   height = (h - MARGIN_TOP - MARGIN_BOTTOM) / ICON_H;
 
   // FIXME: + ((HORZ_SPC/2) - 2, this is needed to avoid overall displacement to the left
   // I believe the gap applies to all the icons except one, but needs clarification.
-  start_x = w/2 - ((width * (ICON_W + HORZ_SPC)) / 2) + ((HORZ_SPC/2) - 2);
+  start_x = x + w/2 - ((width * (ICON_W + HORZ_SPC)) / 2) + ((HORZ_SPC/2) - 2);
+
+  start_y = y + h - MARGIN_BOTTOM;
+
+  // Because the grid grows from bottom to top (0,0 being top left corner of screen)
+  // rows which would fall beyond the top margin are not part of the grid
+  while (height > 0 && start_y - height * (ICON_H + VERT_SPC) <= y + MARGIN_TOP) {
+    height--;
+  }
+
+  area_x = x;
+  area_y = y;
+  area_width = w;
+  area_height = h;
+
+  if (width < 0) width = 0;
+  if (height < 0) height = 0;
 
-  start_y = h - MARGIN_BOTTOM;
+  // Pages are added as icons need them, the grid starts with one
+  words_per_page = (width * height + 63) / 64;
+  next_free = 0;
+  add_page();
 }
 
 IconGrid::~IconGrid()
@@ -77,70 +110,137 @@ IconGrid::~IconGrid()
   /* Nothing here yet */
 }
 
+void IconGrid::add_page(void)
+{
+  // Each page starts on its own occupancy word,
+  // bits past its last cell are marked as taken so they are never handed out
+  int cells = width * height;
+  int first_word = occupancy.size();
+  occupancy.resize (first_word + words_per_page, 0);
+  if (cells % 64) {
+    occupancy.back() = ~(uint64_t) 0 << (cells % 64);
+  }
+
+  free_words.resize ((occupancy.size() + 63) / 64, 0);
+  for (int word = first_word; word < (int) occupancy.size(); word++) {
+    free_words[word / 64] |= (uint64_t) 1 << (word % 64);
+  }
+
+  if (first_word / 64 < next_free) {
+    next_free = first_word / 64;
+  }
 
-bool IconGrid::is_place_used(int x, int y)
+  page_used.push_back (0);
+  log1 ("Icon grid page added (pages)", page_used.size());
+}
+
+int IconGrid::get_pages(void)
 {
-  for (coord_list_t::iterator it = used_fields.begin();
-      it != used_fields.end(); it++) {
-    if (it->first == x && it->second == y) {
-      return true;
-    }
+  // Pages past the last one with icons are not shown
+  int pages = page_used.size();
+  while (pages > 1 && !page_used[pages - 1]) {
+    pages--;
+  }
+
+  return pages;
+}
+
+void IconGrid::get_area(int *x, int *y, int *w, int *h)
+{
+  *x = area_x;
+  *y = area_y;
+  *w = area_width;
+  *h = area_height;
+}
+
+bool IconGrid::is_place_used(int x, int y, int page)
+{
+  int bit = page * words_per_page * 64 + y * width + x;
+  return (occupancy[bit / 64] >> (bit % 64)) & 1;
+}
+
+void IconGrid::use_place(int x, int y, int page)
+{
+  int bit = page * words_per_page * 64 + y * width + x;
+  int word = bit / 64;
+  occupancy[word] |= (uint64_t) 1 << (bit % 64);
+  if (occupancy[word] == ~(uint64_t) 0) {
+    free_words[word / 64] &= ~((uint64_t) 1 << (word % 64));
   }
-  return false;
+
+  page_used[page]++;
 }
 
-bool IconGrid::free_space_used(int x, int y)
+bool IconGrid::free_space_used(int x, int y, int page)
 {
-  for (coord_list_t::iterator it = used_fields.begin();
-      it != used_fields.end(); it++) {
+  if (x < 0 || x >= width || y < 0 || y >= height || page < 0 || page >= (int) page_used.size() ||
+      !is_place_used(x, y, page)) {
+    return false;
+  }
+
+  int bit = page * words_per_page * 64 + y * width + x;
+  int word = bit / 64;
+  occupancy[word] &= ~((uint64_t) 1 << (bit % 64));
+  free_words[word / 64] |= (uint64_t) 1 << (word % 64);
+  page_used[page]--;
+  if (word / 64 < next_free) {
+    next_free = word / 64;
+  }
+
+  return true;
+}
 
-    if (it->first == x && it->second == y) {
-      used_fields.erase(it);
-      return true;
+int IconGrid::find_free_cell(void)
+{
+  // Returns the first free cell in page and row order, as a bit number, or -1 if all pages are full.
+  // The summary finds the first word with a free cell, then the cell within it, 4096 cells at a time.
+  for (; next_free < (int) free_words.size(); next_free++) {
+    if (free_words[next_free]) {
+      int word = next_free * 64 + __builtin_ctzll (free_words[next_free]);
+      return word * 64 + __builtin_ctzll (~occupancy[word]);
     }
   }
-  return false;
+
+  return -1;
 }
 
-bool IconGrid::get_real_position(int field_x, int field_y,
-                                 int *real_x, int *real_y, int *gridx, int *gridy)
+bool IconGrid::get_real_position(int field_x, int field_y, int page,
+                                 int *real_x, int *real_y, int *gridx, int *gridy, int *gridpage)
 {
+  // Every page uses the same screen positions, only the visible page is shown
   *real_x = start_x + field_x * (ICON_W + HORZ_SPC);
   *real_y = start_y - (1 + field_y) * (ICON_H + VERT_SPC);
 
-  // Because the grid grows from bottom to top (0,0 being top left corner of screen)
-  // if the real icon position represented on the screen falls beyond limits, reject the icon
-  if (*real_y <= MARGIN_TOP) {
-    grid_full = true;
-    return false;
-  }
-  else {
-    if (gridx) *gridx = field_x;
-    if (gridy) *gridy = field_y;
-    used_fields.push_back(std::pair<int, int>(field_x, field_y));
-    return true;
-  }
+  if (gridx) *gridx = field_x;
+  if (gridy) *gridy = field_y;
+  if (gridpage) *gridpage = page;
+  use_place(field_x, field_y, page);
+  return true;
 }
 
 bool IconGrid::request_position(int field_hint_x, int field_hint_y,
-                                int *x, int *y, int *gridx, int *gridy)
+                                int *x, int *y, int *gridx, int *gridy, int *gridpage)
 {
+  if (!width || !height) {
+    return false;
+  }
+
+  // Hints refer to the first page
   if (field_hint_x >= 0 && field_hint_x < width &&
       field_hint_y >= 0 && field_hint_y < height) {
-    if (!is_place_used(field_hint_x, field_hint_y)) {
-      return (get_real_position(field_hint_x, field_hint_y, x, y, gridx, gridy));
+    if (!is_place_used(field_hint_x, field_hint_y, 0)) {
+      return (get_real_position(field_hint_x, field_hint_y, 0, x, y, gridx, gridy, gridpage));
     }
   }
 
-  /* find a free spot */
-  for (int iy = 0; iy < height; iy++) {
-    for (int ix = 0; ix < width; ix++) {
-      if (!is_place_used(ix, iy)) {
-        return (get_real_position(ix, iy, x, y, gridx, gridy));
-      }
-    }
+  /* find a free spot, on a new page if the grid is full */
+  int bit = find_free_cell();
+  if (bit == -1) {
+    add_page();
+    bit = find_free_cell();
   }
 
-  grid_full = true;
-  return false;
+  int page = bit / (words_per_page * 64);
+  int cell = bit % (words_per_page * 64);
+  return (get_real_position(cell % width, cell / width, page, x, y, gridx, gridy, gridpage));
 }
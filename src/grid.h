@@ -8,6 +8,7 @@
 
 #include <vector>
 #include <string>
+#include <stdint.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
@@ -18,6 +19,9 @@
 #define DEFAULT_ICON_HORZ_SPACE   50
 #define DEFAULT_ICON_VERT_SPACE   25
 
+// Most columns of the grid, unless the GridColumns setting says otherwise
+#define DEFAULT_GRID_COLUMNS  7
+
 class IconGrid
 {
   private:
@@ -27,29 +31,46 @@ class IconGrid
     static const int MARGIN_BOTTOM = 84;
     static const int MARGIN_TOP = 50;
 
-    static const int MAX_FIELDS_X = 7;
-
-    typedef std::vector<std::pair<int, int> > coord_list_t;
-
     int width;
     int height;
-    coord_list_t used_fields;
+
+    // One bit per cell, set when taken, cells are numbered y * width + x within each page.
+    // free_words has one bit per occupancy word, set while it has a free cell,
+    // and every free_words entry below next_free is zero.
+    std::vector<uint64_t> occupancy;
+    std::vector<uint64_t> free_words;
+    std::vector<int> page_used;            // cells taken on each page
+    int words_per_page;
+    int next_free;
 
     int start_x;
     int start_y;
 
-    bool is_place_used(int x, int y);
-    bool get_real_position(int field_x, int field_y, int *real_x, int *real_y, int *gridx, int *gridy);
+    // Screen area the grid is laid out on, the primary monitor
+    int area_x, area_y, area_width, area_height;
+
+    void setup(int screen_x, int screen_y, int screen_width, int screen_height, Configuration *pconf);
+    void add_page(void);
+    bool is_place_used(int x, int y, int page);
+    void use_place(int x, int y, int page);
+    int find_free_cell(void);
+    bool get_real_position(int field_x, int field_y, int page,
+                           int *real_x, int *real_y, int *gridx, int *gridy, int *gridpage);
 
   public:
     IconGrid(Display *display, Configuration *pconf);
+    IconGrid(int screen_width, int screen_height, Configuration *pconf);
+    IconGrid(int screen_x, int screen_y, int screen_width, int screen_height, Configuration *pconf);
     ~IconGrid(void);
 
     static int ICON_W;
     static int ICON_H;
 
-    bool grid_full;
+    int get_width(void) { return width; }
+    int get_height(void) { return height; }
+    int get_pages(void);
+    void get_area(int *x, int *y, int *w, int *h);
 
-    bool request_position(int field_hint_x, int field_hint_y, int *x, int *y, int *gridx, int *gridy);
-    bool free_space_used(int x, int y);
+    bool request_position(int field_hint_x, int field_hint_y, int *x, int *y, int *gridx, int *gridy, int *gridpage);
+    bool free_space_used(int x, int y, int page);
 };
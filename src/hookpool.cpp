@@ -0,0 +1,409 @@
+//
+// hookpool.cpp  -  Runs icon hook scripts on worker threads, away from the X event loop
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// A hook script can take as long as it wants, or hang. Workers run them with a deadline,
+// parse what they print, and queue the results. The reactor is woken up through an eventfd
+// and hands all finished hooks to the desktop at once, which applies and redraws them in a batch.
+//
+
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hookpool.h"
+#include "coprocess.h"
+#include "reactor.h"
+#include "logging.h"
+
+HookPool::HookPool (void)
+{
+  pthread_mutex_init (&lock, NULL);
+  pthread_cond_init (&wakeup, NULL);
+  stopping = false;
+  efd = -1;
+  timeout_ms = DEFAULT_HOOK_TIMEOUT;
+  preactor = NULL;
+  callback = NULL;
+  callback_data = NULL;
+  coprocess = NULL;
+}
+
+HookPool::~HookPool (void)
+{
+  finalize();
+  pthread_cond_destroy (&wakeup);
+  pthread_mutex_destroy (&lock);
+}
+
+bool HookPool::initialize (Reactor *reactor, int concurrency, unsigned long timeout,
+                           std::string coprocess_cmdline, HOOKPOOL_CALLBACK completed_callback, void *data)
+{
+  preactor = reactor;
+  callback = completed_callback;
+  callback_data = data;
+  timeout_ms = (timeout ? timeout : DEFAULT_HOOK_TIMEOUT);
+  if (concurrency <= 0) {
+    concurrency = DEFAULT_HOOK_CONCURRENCY;
+  }
+
+  // In coprocess mode the hook is started once, and requests are sent to it one at a time
+  if (coprocess_cmdline.length()) {
+    coprocess = new Coprocess (coprocess_cmdline);
+    concurrency = 1;
+  }
+
+  // Workers signal finished hooks through this descriptor, attended by the main loop
+  efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (efd == -1 || !preactor->add_fd (efd, EPOLLIN, completion_ready, this)) {
+    log1 ("Could not create the hook completion descriptor (errno)", errno);
+    return false;
+  }
+
+  for (int n=0; n < concurrency; n++) {
+    pthread_t t;
+    if (pthread_create (&t, NULL, worker_entry, this) == 0) {
+      workers.push_back (t);
+    }
+  }
+
+  log2 ("Hook workers started (workers, timeout ms)", workers.size(), timeout_ms);
+  return (workers.size() > 0);
+}
+
+void HookPool::finalize (void)
+{
+  // Wait for running hooks to finish, pending ones are discarded
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_broadcast (&wakeup);
+  pthread_mutex_unlock (&lock);
+
+  for (size_t n=0; n < workers.size(); n++) {
+    pthread_join (workers[n], NULL);
+  }
+  workers.clear();
+
+  while (!pending.empty()) {
+    delete pending.front();
+    pending.pop_front();
+  }
+
+  for (size_t n=0; n < completed.size(); n++) {
+    delete completed[n];
+  }
+  completed.clear();
+
+  if (efd != -1) {
+    preactor->remove_fd (efd);
+    close (efd);
+    efd = -1;
+  }
+
+  if (coprocess) {
+    delete coprocess;
+    coprocess = NULL;
+  }
+}
+
+bool HookPool::submit (std::string request, std::string cmdline,
+                       HOOKPOOL_JOB_CALLBACK job_callback, void *job_data, unsigned long timeout)
+{
+  if (!workers.size()) {
+    log1 ("No hook workers available, ignoring hook request", request);
+    return false;
+  }
+
+  HOOK_JOB *job = new HOOK_JOB;
+  job->request = request;
+  job->cmdline = cmdline;
+  job->exit_code = -1;
+  job->timed_out = false;
+  job->timeout_ms = timeout;
+  job->job_callback = job_callback;
+  job->job_data = job_data;
+
+  pthread_mutex_lock (&lock);
+  pending.push_back (job);
+  pthread_cond_signal (&wakeup);
+  pthread_mutex_unlock (&lock);
+  return true;
+}
+
+unsigned long HookPool::get_timeout (void)
+{
+  return timeout_ms;
+}
+
+void *HookPool::worker_entry (void *This)
+{
+  ((HookPool *) This)->worker();
+  return NULL;
+}
+
+void HookPool::worker (void)
+{
+  // Writing to a coprocess that has died must fail with EPIPE rather than kill kdesk
+  sigset_t sigpipe;
+  sigemptyset (&sigpipe);
+  sigaddset (&sigpipe, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &sigpipe, NULL);
+
+  while (true)
+    {
+      pthread_mutex_lock (&lock);
+      while (pending.empty() && !stopping) {
+        pthread_cond_wait (&wakeup, &lock);
+      }
+
+      if (stopping) {
+        pthread_mutex_unlock (&lock);
+        break;
+      }
+
+      HOOK_JOB *job = pending.front();
+      pending.pop_front();
+      pthread_mutex_unlock (&lock);
+
+      if (coprocess) {
+        coprocess->request (job, (job->timeout_ms ? job->timeout_ms : timeout_ms));
+      }
+      else {
+        run_hook (job);
+      }
+
+      // Queue the results and wake up the main loop
+      uint64_t one=1;
+      pthread_mutex_lock (&lock);
+      completed.push_back (job);
+      pthread_mutex_unlock (&lock);
+      if (write (efd, &one, sizeof (one)) != sizeof (one)) {
+        log1 ("Could not notify hook completion (errno)", errno);
+      }
+    }
+}
+
+void HookPool::run_hook (HOOK_JOB *job)
+{
+  int fds[2];
+  char buffer[1024];
+  size_t used=0;
+  unsigned long deadline_ms = (job->timeout_ms ? job->timeout_ms : timeout_ms);
+
+  log1 ("Executing hook script:", job->cmdline);
+  if (pipe2 (fds, O_CLOEXEC) == -1) {
+    log1 ("Could not create the hook pipe (errno)", errno);
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // We are in the child process: stdout goes to the pipe, and it leads
+    // a process group of its own, so it can be killed along with its children.
+    sigset_t empty;
+    sigemptyset (&empty);
+    sigprocmask (SIG_SETMASK, &empty, NULL);
+    setpgid (0, 0);
+    dup2 (fds[1], STDOUT_FILENO);
+    execl ("/bin/sh", "/bin/sh", "-c", job->cmdline.c_str(), (char *) NULL);
+    _exit (127);
+  }
+
+  close (fds[1]);
+  if (pid == -1) {
+    log1 ("fork call failed, could not run hook (errno)", errno);
+    close (fds[0]);
+    return;
+  }
+
+  // Also set from the parent, the child might not have run yet if we need to kill it
+  setpgid (pid, pid);
+
+  struct timeval start, now;
+  gettimeofday (&start, NULL);
+
+  while (true)
+    {
+      gettimeofday (&now, NULL);
+      long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+      if (elapsed >= (long) deadline_ms) {
+        log2 ("Hook timed out, killing it (request, ms)", job->request, deadline_ms);
+        job->timed_out = true;
+        kill (-pid, SIGKILL);
+        break;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = fds[0];
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      int rc = poll (&pfd, 1, (int) (deadline_ms - elapsed));
+      if (rc == -1 && errno == EINTR) {
+        continue;
+      }
+      else if (rc <= 0) {
+        continue; // the deadline check above will catch it
+      }
+
+      ssize_t nread = read (fds[0], buffer + used, sizeof (buffer) - used - 1);
+      if (nread <= 0) {
+        break; // end of output
+      }
+      used += nread;
+      buffer[used] = 0x00;
+
+      // Parse all complete lines, keep the remainder for the next read
+      char *line = buffer, *eol = NULL;
+      while ((eol = strchr (line, '\n')) != NULL) {
+        *eol = 0x00;
+        parse_job_line (line, job);
+        line = eol + 1;
+      }
+
+      used = strlen (line);
+      memmove (buffer, line, used + 1);
+
+      // A line longer than the buffer is parsed in pieces, like fgets would
+      if (used == sizeof (buffer) - 1) {
+        parse_job_line (buffer, job);
+        used = 0;
+      }
+    }
+
+  if (used > 0 && job->timed_out == false) {
+    buffer[used] = 0x00;
+    parse_job_line (buffer, job);
+  }
+
+  // The deadline covers the exit too, a hook can close its output or background it and keep running
+  int status=0;
+  pid_t reaped;
+  close (fds[0]);
+  while ((reaped = waitpid (pid, &status, (job->timed_out ? 0 : WNOHANG))) != pid)
+    {
+      if (reaped == -1 && errno != EINTR) {
+        log2 ("Could not reap hook (request, errno)", job->request, errno);
+        break;
+      }
+
+      gettimeofday (&now, NULL);
+      long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+      if (elapsed >= (long) deadline_ms && job->timed_out == false) {
+        log2 ("Hook did not exit in time, killing it (request, ms)", job->request, deadline_ms);
+        job->timed_out = true;
+        kill (-pid, SIGKILL);
+      }
+      else if (reaped == 0) {
+        usleep (HOOK_REAP_INTERVAL * 1000);
+      }
+    }
+
+  if (reaped == pid && WIFEXITED(status)) {
+    job->exit_code = WEXITSTATUS(status);
+  }
+  log3 ("Hook finished (request, exit code, updates)", job->request, job->exit_code, job->updates.size());
+}
+
+bool HookPool::parse_line (char *chline, std::vector <HOOK_UPDATE> &updates)
+{
+  // Hooks print icon attributes in the form "Key: value words".
+  // Returns true if the line carried an attribute that can be applied to an icon.
+  char key[64], value[1024], word[1024];
+  char *toks=chline;
+  int n=0;
+
+  memset (key, 0x00, sizeof(key));
+  memset (value, 0x00, sizeof(value));
+  while (sscanf (toks, "%1023s%n", word, &n) == 1) {
+    if (word[strlen(word)-1] == ':') {
+      strncpy (key, word, sizeof(key) - 1);
+    }
+    else if (strlen(value) + strlen(word) + 1 < sizeof(value)) {
+      strcat (value, word);
+      strcat (value, " ");
+    }
+    toks += n;
+  }
+
+  if (strlen(value)) {
+    value[strlen(value)-1]=0x00;
+  }
+
+  // Only the keys that can be applied to an icon are kept
+  if (!strcmp (key, "Message:") || !strcmp (key, "Caption:") || !strcmp (key, "Icon:") ||
+      !strcmp (key, "IconStamp:") || !strcmp (key, "IconStatus:")) {
+    HOOK_UPDATE update;
+    update.key = key;
+    update.value = value;
+    updates.push_back (update);
+    return true;
+  }
+
+  return false;
+}
+
+bool HookPool::parse_job_line (char *chline, HOOK_JOB *job)
+{
+  // Batched hooks open a section for each icon with a "[iconname]" line
+  size_t length = strlen (chline);
+  if (length > 2 && chline[0] == '[' && chline[length-1] == ']') {
+    job->section = std::string (chline + 1, length - 2);
+    return false;
+  }
+
+  if (!parse_line (chline, job->updates)) {
+    return false;
+  }
+
+  job->updates.back().icon_name = job->section;
+  return true;
+}
+
+void HookPool::completion_ready (int fd, unsigned int events, void *data)
+{
+  // Called from the reactor on the main thread: collect all finished hooks at once
+  HookPool *pool = (HookPool *) data;
+  uint64_t count=0;
+  std::vector <HOOK_JOB *> finished;
+
+  if (read (fd, &count, sizeof (count)) != sizeof (count)) {
+    return;
+  }
+
+  pthread_mutex_lock (&pool->lock);
+  finished.swap (pool->completed);
+  pthread_mutex_unlock (&pool->lock);
+
+  // Jobs submitted with a callback of their own are attended individually
+  std::vector <HOOK_JOB *> batch;
+  for (size_t n=0; n < finished.size(); n++) {
+    if (finished[n]->job_callback) {
+      finished[n]->job_callback (finished[n], finished[n]->job_data);
+    }
+    else {
+      batch.push_back (finished[n]);
+    }
+  }
+
+  if (pool->callback && batch.size()) {
+    pool->callback (batch, pool->callback_data);
+  }
+
+  for (size_t n=0; n < finished.size(); n++) {
+    delete finished[n];
+  }
+}
@@ -0,0 +1,93 @@
+//
+// hookpool.h  -  Runs icon hook scripts on worker threads, away from the X event loop
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+
+// Default number of hooks that can run at the same time (kdeskrc HookConcurrency)
+#define DEFAULT_HOOK_CONCURRENCY  4
+
+// Default milliseconds a hook can run before it is killed (kdeskrc HookTimeout)
+#define DEFAULT_HOOK_TIMEOUT      5000
+
+// Milliseconds between checks for the exit of a hook which has closed its output
+#define HOOK_REAP_INTERVAL        10
+
+// First hook parameter to refresh many icons at once (kdeskrc HookBatch), followed by their names.
+// The hook answers with a "[iconname]" line before the attributes of each icon.
+#define HOOK_BATCH_PARAM          "IconBatch"
+
+// Milliseconds a batched hook is given for each icon, on top of HookTimeout
+#define HOOK_BATCH_ICON_TIMEOUT   100
+
+class Reactor;
+class Coprocess;
+
+typedef struct _hook_update {
+  std::string icon_name;  // Batch section the attribute was printed in, empty for single icon hooks
+  std::string key;        // Icon attribute, i.e. "Message:"
+  std::string value;      // The new attribute value
+} HOOK_UPDATE;
+
+typedef struct _hook_job HOOK_JOB;
+
+typedef void (*HOOKPOOL_CALLBACK) (std::vector <HOOK_JOB *> &completed, void *data);
+typedef void (*HOOKPOOL_JOB_CALLBACK) (HOOK_JOB *job, void *data);
+
+struct _hook_job {
+  std::string request;                // Hook parameters: the icon name, or a screen saver transition
+  std::string cmdline;                // Shell command line to run the hook on its own
+  std::vector <HOOK_UPDATE> updates;  // Attributes printed by the hook, parsed by the worker
+  std::string section;                // Icon name of the batch section being parsed
+  int exit_code;                      // Hook exit code, -1 if the hook could not run
+  bool timed_out;                     // The hook was killed after its timeout
+  unsigned long timeout_ms;           // Milliseconds the hook can run, 0 for HookTimeout
+  HOOKPOOL_JOB_CALLBACK job_callback; // If set, called for this job alone instead of the batch callback
+  void *job_data;
+};
+
+class HookPool
+{
+ private:
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  std::vector <pthread_t> workers;
+  std::deque <HOOK_JOB *> pending;
+  std::vector <HOOK_JOB *> completed;
+  bool stopping;
+  int efd;
+  unsigned long timeout_ms;
+  Reactor *preactor;
+  HOOKPOOL_CALLBACK callback;
+  void *callback_data;
+  Coprocess *coprocess;
+
+  static void *worker_entry (void *This);
+  void worker (void);
+  void run_hook (HOOK_JOB *job);
+  static void completion_ready (int fd, unsigned int events, void *data);
+
+ public:
+  HookPool (void);
+  virtual ~HookPool (void);
+
+  bool initialize (Reactor *reactor, int concurrency, unsigned long timeout,
+                   std::string coprocess_cmdline, HOOKPOOL_CALLBACK completed_callback, void *data);
+  void finalize (void);
+  bool submit (std::string request, std::string cmdline,
+               HOOKPOOL_JOB_CALLBACK job_callback=NULL, void *job_data=NULL, unsigned long timeout=0);
+  unsigned long get_timeout (void);
+
+  static bool parse_line (char *chline, std::vector <HOOK_UPDATE> &updates);
+  static bool parse_job_line (char *chline, HOOK_JOB *job);
+};
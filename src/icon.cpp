@@ -10,6 +10,7 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrender.h>
 
 #include <Imlib2.h>
 
@@ -25,39 +26,64 @@
 #include "icon.h"
 #include "logging.h"
 #include "grid.h"
+#include "background.h"
+#include "resources.h"
+#include "windowindex.h"
+#include "reactor.h"
+#include "decodepool.h"
 
 Icon::Icon (Configuration *loaded_conf, int iconidx)
 {
   win = 0L;
   configuration = loaded_conf;
   iconid = iconidx;
+  spec = configuration->get_icon_spec (iconid);
   iconx=icony=iconw=iconh=0;
   pgrid = NULL;
   shadowx=shadowy=0;
   iconMapNone = iconMapGlow = iconMapTransparency = (unsigned char *) NULL;
   transparency_value=0;
   backsafe = NULL;
-  font = fontsmaller = NULL;
-  image = image_stamp = image_status = NULL;
-  xftdraw1 = NULL;
+  font = fontsmaller = fontmessage = NULL;
+  xftcolor = xftcolor_shadow = NULL;
+  pool = NULL;
+  pwindex = NULL;
+  text_dirty = true;
+  caption_x = caption_y = 0;
+  message1_x = message1_y = message2_x = message2_y = 0;
+  textpix = None;
+  textpic = winpic = None;
+  image_w = image_h = image_subx = 0;
+  visual_state = ICON_STATE_NORMAL;
+  hover_deferred = false;
+  for (int state=0; state < ICON_STATE_MAX; state++) {
+    surface[state] = NULL;
+    surface_x[state] = surface_y[state] = 0;
+    frame[state] = None;
+  }
+  pbackground = NULL;
+  compositing = false;
+  winw = winh = 0;
   is_grid = false;
   gridx = gridy = 0;
+  page = 0;
   stamp_x=stamp_y=0;
   message_x=message_y=0;
 
   // save the lnk filename, icon, icon hover image files
-  filename = configuration->get_icon_string (iconid, "filename");
-  ficon = configuration->get_icon_string (iconid, "icon");
-  ficon_hover = configuration->get_icon_string (iconid, "iconhover");
+  filename = spec->filename;
+  directory = spec->directory;
+  ficon = spec->icon;
+  ficon_hover = spec->iconhover;
 
-  set_icon_stamp((char *)configuration->get_icon_string (iconid, "iconstamp").c_str());
+  set_icon_stamp((char *)spec->iconstamp.c_str());
 
   // save the icon caption and message literals to be rendered around it
-  caption = configuration->get_icon_string (iconid, "caption");
-  set_message((char *)configuration->get_icon_string (iconid, "message").c_str());
+  caption = spec->caption;
+  set_message((char *)spec->message.c_str());
 
   // the status icon works similar to the stamp icon with absolute coordinates indication
-  set_icon_status((char *)configuration->get_icon_string (iconid, "iconstatus").c_str());
+  set_icon_status((char *)spec->iconstatus.c_str());
 
   // Initially we don't know yet which display we are bound to until create()
   icon_display = NULL;
@@ -66,40 +92,17 @@ Icon::Icon (Configuration *loaded_conf, int iconidx)
   memset (&fontInfoCaption, 0x00, sizeof (XGlyphInfo));
   memset (&fontInfoMessage, 0x00, sizeof (XGlyphInfo));
 
-  iconMapNone = (unsigned char *) calloc (sizeof(unsigned char), 256);
-  if (iconMapNone) {
-    for (int c=0; c < 256; c++) {
-      iconMapNone[c] = (unsigned char) c;
-    }
-  }
-  else {
-    log ("Error allocating memory for iconMapNone");
-  }
-
-  iconMapGlow = (unsigned char *) calloc (sizeof(unsigned char), 256);
-  if (!iconMapGlow) {
-    log ("Error allocating memory for iconMapGlow");
-  }
-
   // Icon transparency can be specified for each icon,
   // or globally for all icons in the kdeskrc file.
   // 0 means full transparent, 255 is opaque.
-  transparency_value = configuration->get_icon_int(iconid, "transparency");
+  transparency_value = spec->transparency;
   if (!transparency_value) {
-      transparency_value = configuration->get_config_int("transparency");
-  }
-
-  if (transparency_value > 0) {
-    log1 ("Found icon transparency setting", transparency_value);
-    iconMapTransparency = (unsigned char *) calloc (sizeof(unsigned char), 256);
-    if (!iconMapTransparency) {
-      log ("Error allocating memory for iconMapTransparency");
-    }
+      transparency_value = configuration->get_settings().transparency;
   }
 
   // Define the default cursor for the mouse pointer
   // Or change to a custom one specified in the config file
-  cursor_id = configuration->get_config_int("mousehovericon");
+  cursor_id = configuration->get_settings().mouse_hover_icon;
   if (cursor_id == 0) {
     cursor_id = DEFAULT_ICON_CURSOR;
   }
@@ -116,21 +119,74 @@ int Icon::get_iconid(void)
   return iconid;
 }
 
+Window Icon::get_window(void)
+{
+  return win;
+}
+
 int Icon::set_iconid(int iconidx)
 {
+  // Icons are reloaded into new specs, rebind to the one this icon is now at
   iconid = iconidx;
+  spec = configuration->get_icon_spec (iconid);
+}
+
+bool Icon::refresh_spec(int iconidx, const ICON_SPEC &previous)
+{
+  // The lnk file of this icon has been edited, previous is how it was before.
+  // Images and texts are updated in place, returns false if the icon
+  // needs to be created again because it would move, resize or change its layout.
+  const ICON_SPEC *updated = configuration->get_icon_spec (iconidx);
+  if (!updated ||
+      updated->placement != previous.placement || updated->halign != previous.halign ||
+      updated->x != previous.x || updated->y != previous.y ||
+      updated->x_auto != previous.x_auto || updated->y_auto != previous.y_auto ||
+      updated->width != previous.width || updated->height != previous.height ||
+      updated->transparency != previous.transparency || updated->iconhover != previous.iconhover ||
+      updated->hovertransparent != previous.hovertransparent ||
+      updated->hoverxoffset != previous.hoverxoffset || updated->hoveryoffset != previous.hoveryoffset ||
+      updated->iconstamp.empty() != previous.iconstamp.empty() ||
+      updated->iconstatus.empty() != previous.iconstatus.empty() ||
+      updated->caption.empty() != previous.caption.empty() ||
+      updated->message.empty() != previous.message.empty()) {
+    return false;
+  }
+
+  set_iconid (iconidx);
+
+  // Only attributes changed in the lnk file are applied, so values set by the icon hook are kept
+  if (spec->icon != previous.icon) {
+    set_icon ((char *) spec->icon.c_str());
+  }
+
+  if (spec->iconstamp != previous.iconstamp) {
+    set_icon_stamp ((char *) spec->iconstamp.c_str());
+  }
+
+  if (spec->iconstatus != previous.iconstatus) {
+    set_icon_status ((char *) spec->iconstatus.c_str());
+  }
+
+  if (spec->caption != previous.caption) {
+    set_caption ((char *) spec->caption.c_str());
+  }
+
+  if (spec->message != previous.message) {
+    message_line1 = message_line2 = "";
+    set_message ((char *) spec->message.c_str());
+  }
+
+  return true;
 }
 
 string Icon::get_appid(void)
 {
-  string appid = configuration->get_icon_string (iconid, "appid");
-  return appid;
+  return spec->appid;
 }
 
 string Icon::get_commandline(void)
 {
-  string commandline = configuration->get_icon_string (iconid, "command");
-  return commandline;
+  return spec->command;
 }
 
 std::string Icon::get_icon_filename(void)
@@ -138,6 +194,11 @@ std::string Icon::get_icon_filename(void)
   return filename;
 }
 
+std::string Icon::get_icon_directory(void)
+{
+  return directory;
+}
+
 std::string Icon::get_icon_name(void)
 {
   // returns icon name without the LNK extension
@@ -149,7 +210,11 @@ std::string Icon::get_icon_name(void)
 
 void Icon::set_caption (char *new_caption)
 {
-  caption = new_caption;
+  if (caption != new_caption) {
+    caption = new_caption;
+    text_dirty = true;
+    invalidate_text();
+  }
 }
 
 void Icon::set_message (char *new_message)
@@ -180,11 +245,22 @@ void Icon::set_message (char *new_message)
     if (strlen(second_line)) {
         message_line2 = second_line;
     }
+
+    // Text needs to be laid out and rendered again
+    text_dirty = true;
+    invalidate_text();
 }
 
 void Icon::set_icon (char *new_icon)
 {
+  if (ficon == new_icon) {
+    return;
+  }
+
+  // The hover surface is blended on top of the main icon, so both need recomposing
   ficon = new_icon;
+  invalidate_surface (ICON_STATE_NORMAL);
+  invalidate_surface (ICON_STATE_HOVER);
 }
 
 void Icon::set_icon_stamp (char *new_icon)
@@ -196,17 +272,26 @@ void Icon::set_icon_stamp (char *new_icon)
 
     log1("parsing Stamp Icon(text)", new_icon);
 
+    int new_x=0, new_y=0;
+    string new_ficon;
     char *open_braces=strstr (new_icon, "{");
     char *close_braces=strstr (new_icon, "}");
     if (open_braces && close_braces) {
-        char icon_pathname[128];
-        sscanf (new_icon, "{%d,%d} %s", &stamp_x, &stamp_y, icon_pathname);
-        ficon_stamp = strlen(icon_pathname) ? icon_pathname : new_icon;
-        log3("Stamp Icon has absolute coords (x,y,icon)", stamp_x, stamp_y, ficon_stamp);
+        char icon_pathname[128]="";
+        sscanf (new_icon, "{%d,%d} %s", &new_x, &new_y, icon_pathname);
+        new_ficon = strlen(icon_pathname) ? icon_pathname : new_icon;
+        log3("Stamp Icon has absolute coords (x,y,icon)", new_x, new_y, new_ficon);
     }
     else {
-        stamp_x = stamp_y = 0;
-        ficon_stamp = new_icon;
+        new_ficon = new_icon;
+    }
+
+    // Recompose the icon surface only if the stamp has actually changed
+    if (new_ficon != ficon_stamp || new_x != stamp_x || new_y != stamp_y) {
+        stamp_x = new_x;
+        stamp_y = new_y;
+        ficon_stamp = new_ficon;
+        invalidate_surface (ICON_STATE_NORMAL);
     }
 }
 
@@ -219,121 +304,81 @@ void Icon::set_icon_status (char *new_icon)
 
     log1("parsing Status Icon(text)", new_icon);
 
+    int new_x=0, new_y=0;
+    string new_ficon;
     char *open_braces=strstr (new_icon, "{");
     char *close_braces=strstr (new_icon, "}");
     if (open_braces && close_braces) {
-        char icon_pathname[128];
-        sscanf (new_icon, "{%d,%d} %s", &status_x, &status_y, icon_pathname);
-        ficon_status = strlen(icon_pathname) ? icon_pathname : new_icon;
-        log3("Status Icon has absolute coords (x,y,icon)", status_x, status_y, ficon_status);
+        char icon_pathname[128]="";
+        sscanf (new_icon, "{%d,%d} %s", &new_x, &new_y, icon_pathname);
+        new_ficon = strlen(icon_pathname) ? icon_pathname : new_icon;
+        log3("Status Icon has absolute coords (x,y,icon)", new_x, new_y, new_ficon);
     }
     else {
-        status_x = status_y = 0;
-        ficon_status = new_icon;
+        new_ficon = new_icon;
+    }
+
+    // Recompose the icon surface only if the status has actually changed
+    if (new_ficon != ficon_status || new_x != status_x || new_y != status_y) {
+        status_x = new_x;
+        status_y = new_y;
+        ficon_status = new_ficon;
+        invalidate_surface (ICON_STATE_NORMAL);
     }
 }
 
 bool Icon::is_singleton_running (Display *display)
 {
   bool bAppRunning=false;
-  string appid = configuration->get_icon_string (iconid, "appid");
-  string singleton = configuration->get_icon_string (iconid, "singleton");
-
-  if (singleton == "true" && appid.size())
+  if (spec->singleton && spec->appid.size())
     {
       // Return wether we can find the icon app window on the desktop
-      bAppRunning = (find_icon_window (display, appid) ? true : false);
+      bAppRunning = (find_icon_window (display, spec->appid) ? true : false);
     }
 
-  log2 ("Is kdesk icon application running? (AppID, bool)", appid, bAppRunning);
+  log2 ("Is kdesk icon application running? (AppID, bool)", spec->appid, bAppRunning);
   return bAppRunning;
 }
 
-Window Icon::create (Display *display, IconGrid *icon_grid)
+void Icon::allocate_maps (void)
 {
-  unsigned int rc=0;
-  int border;
-
-  // save the display variable and grid for later cleanup
-  icon_display = display;
-  pgrid = icon_grid;
-  vis = DefaultVisual(display, DefaultScreen(display));
-  cmap = DefaultColormap(display, DefaultScreen(display));
-
-  // If there is an icon caption or message defined, allocate a font for it
-  if (caption.length() > 0 || message_line1.length() > 0) {
-    log ("allocating font resources for icon title");
-
-    // Collect font details: shadow offsets and caption screen space occupied, used for centering
-    string fontname = get_font_name();
-    int fontsize = configuration->get_config_int ("fontsize");
-    int shadowx = configuration->get_icon_int (iconid, "shadowx");
-    int shadowy = configuration->get_icon_int (iconid, "shadowy");
-
-    log2 ("opening font name and point size", fontname, fontsize);
-    font = XftFontOpen (display, DefaultScreen(display),
-			XFT_FAMILY, XftTypeString, fontname.c_str(),
-			XFT_SIZE, XftTypeDouble, (float) fontsize,
-			NULL);
-    if (!font) {
-      log("Could not create font!");
+  // Color modifier tables used to blend the icon images, only needed while the icon is realized
+  iconMapNone = (unsigned char *) calloc (sizeof(unsigned char), 256);
+  if (iconMapNone) {
+    for (int c=0; c < 256; c++) {
+      iconMapNone[c] = (unsigned char) c;
     }
-    else {
-        // Message string horizontal space check: calculate if it is too long to fit horizontally,
-        // If so choose a smaller size font to accomodate.
-        XGlyphInfo font_extents;
-        memset (&font_extents, 0x00, sizeof(XGlyphInfo));
-        XftTextExtents8 (display,
-                         font,
-                         (const FcChar8*) message_line1.c_str(),
-                         message_line1.length(),
-                         &font_extents);
-
-        log2("Message extents (width, height)", font_extents.width, font_extents.height);
-        rc = XftColorAllocName(display, DefaultVisual(display,0), DefaultColormap(display,0),
-                               (const char *) configuration->get_config_string("fontcolor").c_str(), &xftcolor);
-
-        rc = XftColorAllocName(display, DefaultVisual(display,0), DefaultColormap(display,0),
-                               (const char *) configuration->get_config_string("shadowcolor").c_str(), &xftcolor_shadow);
-        log1 ("XftColorAllocName bool", rc);
-
-        int subtitle_fontsize = configuration->get_config_int ("subtitlefontsize");
-        if (!subtitle_fontsize) {
-            // Assign a smaller font size
-            subtitle_fontsize = fontsize - DEFAULT_SUBTITLE_FONT_POINT_DECREASE;
-        }
+  }
+  else {
+    log ("Error allocating memory for iconMapNone");
+  }
 
-        fontsmaller = XftFontOpen (display, DefaultScreen(display),
-                                   XFT_FAMILY, XftTypeString, fontname.c_str(),
-                                   XFT_SIZE, XftTypeDouble, (float) subtitle_fontsize,
-                                   NULL);
-        log1 ("creating a smaller font for messages", fontsmaller);
+  iconMapGlow = (unsigned char *) calloc (sizeof(unsigned char), 256);
+  if (!iconMapGlow) {
+    log ("Error allocating memory for iconMapGlow");
+  }
 
-        // Find out the extent of icon caption and message on the rendering surface
-        // The window containing the icon will be enlarged vertically to accomodate this space
-        if (caption.length() > 0) {
-            XftTextExtentsUtf8 (display, font, (XftChar8*) caption.c_str(), caption.length(), &fontInfoCaption);
-        }
+  if (transparency_value > 0) {
+    log1 ("Found icon transparency setting", transparency_value);
+    iconMapTransparency = (unsigned char *) calloc (sizeof(unsigned char), 256);
+    if (!iconMapTransparency) {
+      log ("Error allocating memory for iconMapTransparency");
     }
   }
+}
 
-  XSetWindowAttributes attr;
-  attr.background_pixmap = ParentRelative;
-  attr.backing_store = Always;
-  attr.event_mask = ExposureMask | EnterWindowMask | LeaveWindowMask;
-  attr.override_redirect = True;
-
-  int screen_num = DefaultScreen(display);
-  int w = DisplayWidth(display, screen_num);
-  int h = DisplayHeight(display, screen_num);
+bool Icon::place (Display *display, IconGrid *icon_grid)
+{
+  // Decides where the icon goes, grid icons take their grid cell and page.
+  // Other icons are placed relative to the monitor the grid is on.
+  // Nothing is allocated on the XServer until the icon is realized.
+  int x, y, w, h;
+  icon_grid->get_area (&x, &y, &w, &h);
 
-  // Using this parameter we can control the space
-  // between the icon and name rendered just below
-  icontitlegap = configuration->get_config_int("icontitlegap");
-  log1 ("Icon gap for font title rendering", icontitlegap);
+  pgrid = icon_grid;
+  page = 0;
 
-  string icon_placement = configuration->get_icon_string(iconid, "relative-to");
-  if (icon_placement == "grid") {
+  if (spec->placement == ICON_RELATIVE_GRID) {
     // save grid icon mode
     is_grid = true;
 
@@ -341,73 +386,166 @@ Window Icon::create (Display *display, IconGrid *icon_grid)
     iconw = icon_grid->ICON_W;
     iconh = icon_grid->ICON_H;
 
-    string iconx_tmp, icony_tmp;
-
-    iconx_tmp = configuration->get_icon_string (iconid, "x");
-    if (iconx_tmp == "auto") {
-      iconx = -1;
-    } else {
-      iconx = configuration->get_icon_int (iconid, "x");
-    }
-
-    icony_tmp = configuration->get_icon_string (iconid, "y");
-    if (icony_tmp == "auto") {
-      icony = -1;
-    } else {
-      icony = configuration->get_icon_int (iconid, "y");
-    }
+    iconx = (spec->x_auto ? -1 : spec->x);
+    icony = (spec->y_auto ? -1 : spec->y);
 
-    if (!icon_grid->request_position(iconx, icony, &iconx, &icony, &gridx, &gridy)) {
+    if (!icon_grid->request_position(iconx, icony, &iconx, &icony, &gridx, &gridy, &page)) {
       /* Error! No more space available! */
       log("No spaces available in the grid!");
-      return None;
+      is_grid = false;
+      return false;
     }
 
   } else {
-    iconx = configuration->get_icon_int (iconid, "x");
-    icony = configuration->get_icon_int (iconid, "y");
-    iconw = configuration->get_icon_int (iconid, "width");
-    iconh = configuration->get_icon_int (iconid, "height");
+    iconx = spec->x;
+    icony = spec->y;
+    iconw = spec->width;
+    iconh = spec->height;
 
     // Decide which icon positioning to use on the desktop
-    if (icon_placement == "bottom-centre") {
+    if (spec->placement == ICON_RELATIVE_BOTTOM_CENTRE) {
       iconx = w / 2 + iconx;
       icony = h + icony;
     }
-    else if (icon_placement == "top-centre") {
+    else if (spec->placement == ICON_RELATIVE_TOP_CENTRE) {
       iconx = w / 2 + iconx;
     }
-    else if (icon_placement == "top-left") {
+    else if (spec->placement == ICON_RELATIVE_TOP_LEFT) {
       // no coordinate transformation necessary. 0,0 is already top-left
       ;
     }
-    else if (icon_placement == "top-right") {
+    else if (spec->placement == ICON_RELATIVE_TOP_RIGHT) {
       // icon horizontal position decreases from the right to the left
       iconx = w - (iconx + iconw);
     }
+
+    iconx += x;
+    icony += y;
+  }
+
+  return true;
+}
+
+bool Icon::relayout (Display *display, IconGrid *icon_grid)
+{
+  // Places the icon again on a new grid after the monitors have changed.
+  // Its window follows, and frames are composed again against the new wallpaper,
+  // surfaces and text are kept as they are. Returns false if it no longer fits.
+  int oldx = iconx, oldy = icony;
+  if (!place (display, icon_grid)) {
+    return false;
+  }
+
+  if (win != None) {
+    if (iconx != oldx || icony != oldy) {
+      XMoveWindow (display, win, iconx, icony);
+    }
+
+    invalidate_frames();
+  }
+
+  return true;
+}
+
+int Icon::get_page (void)
+{
+  return page;
+}
+
+bool Icon::is_on_page (int grid_page)
+{
+  // Icons outside the grid are shown on every page
+  return (!is_grid || page == grid_page);
+}
+
+void Icon::get_placement (int *x, int *y, int *w, int *h)
+{
+  // Where the icon goes on its page, known before it is realized
+  *x = iconx;
+  *y = icony;
+  *w = iconw;
+  *h = iconh;
+}
+
+bool Icon::is_realized (void)
+{
+  return (win != None);
+}
+
+Window Icon::realize (Display *display, Background *background,
+                      ResourcePool *resource_pool, WindowIndex *window_index)
+{
+  // Gives a placed icon its window, fonts and cursor. Icons on other grid pages are not realized.
+  if (win != None) {
+    return win;
+  }
+
+  // save the display variable for later cleanup
+  icon_display = display;
+  pbackground = background;
+  pool = resource_pool;
+  pwindex = window_index;
+
+  // Icons are blended against kdesk's own wallpaper if it has been kept in memory,
+  // otherwise they are blended on top of the window's parent relative background.
+  compositing = (pbackground && pbackground->has_wallpaper());
+  vis = DefaultVisual(display, DefaultScreen(display));
+  cmap = DefaultColormap(display, DefaultScreen(display));
+  allocate_maps();
+
+  // If there is an icon caption or message defined, allocate a font for it
+  if (caption.length() > 0 || message_line1.length() > 0) {
+    log ("allocating font resources for icon title");
+
+    // Collect font details: shadow offsets and caption screen space occupied, used for centering
+    string fontname = get_font_name();
+    int fontsize = configuration->get_settings().font_size;
+    shadowx = configuration->get_settings().shadow_x;
+    shadowy = configuration->get_settings().shadow_y;
+
+    // Fonts and colors are borrowed from the desktop-wide pool
+    font = pool->acquire_font (fontname, fontsize);
+    if (!font) {
+      log("Could not create font!");
+    }
+    else {
+        xftcolor = pool->acquire_color (configuration->get_settings().font_color);
+        xftcolor_shadow = pool->acquire_color (configuration->get_settings().shadow_color);
+
+        int subtitle_fontsize = configuration->get_settings().subtitle_font_size;
+        if (!subtitle_fontsize) {
+            // Assign a smaller font size
+            subtitle_fontsize = fontsize - DEFAULT_SUBTITLE_FONT_POINT_DECREASE;
+        }
+
+        fontsmaller = pool->acquire_font (fontname, subtitle_fontsize);
+        log1 ("creating a smaller font for messages", fontsmaller);
+
+        // Find out the extent of icon caption and message on the rendering surface
+        // The window containing the icon will be enlarged vertically to accomodate this space
+        if (caption.length() > 0) {
+            XftTextExtentsUtf8 (display, font, (XftChar8*) caption.c_str(), caption.length(), &fontInfoCaption);
+        }
+    }
   }
 
-  // In debug version, icons are drawn with a black frame
-  #ifdef DEBUG
-  border = 1;
-  #else
-  border = 0;
-  #endif
+  // Using this parameter we can control the space
+  // between the icon and name rendered just below
+  icontitlegap = configuration->get_settings().icon_title_gap;
+  log1 ("Icon gap for font title rendering", icontitlegap);
 
+  // Windows come from the pool, which keeps those of icons on other pages for reuse
+  winw = iconw;
+  winh = iconh + fontInfoCaption.height + icontitlegap;
   log4 ("icon placement (x,y,w,h): @", iconx, icony, iconw, iconh);
-  win = XCreateWindow (display, DefaultRootWindow(display), iconx, icony, 
-		       iconw, iconh + fontInfoCaption.height + icontitlegap, border,
-		       CopyFromParent, CopyFromParent, CopyFromParent,
-		       CWBackPixmap|CWBackingStore|CWOverrideRedirect|CWEventMask,
-		       &attr );
-
-  xftdraw1 = XftDrawCreate(display, win, DefaultVisual(display,0),DefaultColormap(display,0));
-  log1("xftdraw1 is", xftdraw1);
+  win = pool->acquire_window (iconx, icony, winw, winh, &winpic);
+
   if( win == None ) {
     log1 ("error creating window for icon", get_icon_filename());
+    unrealize (display);
+    return None;
   }
   else {
-    XSelectInput(display, win, ButtonPressMask | ButtonReleaseMask | PointerMotionMask | ExposureMask | EnterWindowMask | LeaveWindowMask);
     XMapWindow(display, win);
     XLowerWindow(display, win);
 
@@ -424,17 +562,22 @@ Window Icon::create (Display *display, IconGrid *icon_grid)
   // which can be replaced by system "themes".
 
   // Cursor ID comes from kdeskrc key name "mousehovericon"
-  cursor = XCreateFontCursor (display, cursor_id);
+  cursor = pool->acquire_cursor (cursor_id);
   XDefineCursor(display, win, cursor);
 
-  // this will hold a copy of the current icon rendered space
-  backsafe = imlib_create_image (iconw, iconh);
+  // this will hold a copy of the current icon rendered space,
+  // needless when compositing because frames for all states are already on the server.
+  if (compositing == false) {
+    backsafe = imlib_create_image (iconw, iconh);
+  }
+
+  // Surfaces are composed later, by the desktop decode pool or on the first draw
   return win;
 }
 
-void Icon::destroy(Display *display)
+void Icon::unrealize(Display *display)
 {
-  // Deallocate resources to terminate the icon
+  // Gives back everything the icon holds on the XServer, it keeps its place on the grid
   if (iconMapNone) {
     free (iconMapNone);
     iconMapNone = NULL;
@@ -450,80 +593,76 @@ void Icon::destroy(Display *display)
     iconMapTransparency = NULL;
   }
 
+  // Shared resources go back to the pool, which outlives the icons
   if (cursor) {
-    XFreeCursor (icon_display, cursor);
+    pool->release_cursor (cursor);
     cursor = 0L;
   }
 
-  if (xftdraw1) {
-    XftDrawDestroy (xftdraw1);
-    xftdraw1 = NULL;
-  }
-
   if (font) {
-    XftFontClose(display, font);
+    pool->release_font (font);
     font = NULL;
   }
 
   if (fontsmaller) {
-    XftFontClose(display, fontsmaller);
+    pool->release_font (fontsmaller);
     fontsmaller = NULL;
   }
 
-  if (image != NULL) {
-    imlib_context_set_image(image);
-    // FIXME: Freeing the images causes a segfault after a few iterations
-    // setting imlibi's cache to 1 makes the memory usage become stable
-    //imlib_free_image_and_decache();
-    //imlib_free_image();
-    image=NULL;
+  if (fontmessage) {
+    pool->release_font (fontmessage);
+    fontmessage = NULL;
   }
 
-  if (image_stamp != NULL) {
-    imlib_context_set_image(image_stamp);
-    // FIXME: Freeing the images causes a segfault after a few iterations
-    // setting imlibi's cache to 1 makes the memory usage become stable
-    //imlib_free_image_and_decache();
-    //imlib_free_image();
-    image_stamp=NULL;
+  if (xftcolor) {
+    pool->release_color (xftcolor);
+    xftcolor = NULL;
   }
 
-  if (image_status != NULL) {
-    imlib_context_set_image(image_status);
-    // FIXME: Freeing the images causes a segfault after a few iterations
-    // setting imlibi's cache to 1 makes the memory usage become stable
-    //imlib_free_image_and_decache();
-    //imlib_free_image();
-    image_status=NULL;
+  if (xftcolor_shadow) {
+    pool->release_color (xftcolor_shadow);
+    xftcolor_shadow = NULL;
+  }
+
+  // Composed surfaces are private copies, they can be safely released
+  for (int state=0; state < ICON_STATE_MAX; state++) {
+    invalidate_surface (state);
   }
 
+  // Created uncached for this window, it goes away with it
   if (backsafe != NULL) {
     imlib_context_set_image(backsafe);
-    // FIXME: Freeing the images causes a segfault after a few iterations
-    // setting imlibi's cache to 1 makes the memory usage become stable
-    //imlib_free_image_and_decache();
-    //imlib_free_image();
+    imlib_free_image();
     backsafe=NULL;
   }
 
-  XDestroyWindow (display, win);
+  invalidate_text();
+  if (win != None) {
+    pool->release_window (win, winpic);
+  }
+
+  win = None;
+  winpic = None;
+  visual_state = ICON_STATE_NORMAL;
+  text_dirty = true;
+}
+
+void Icon::destroy(Display *display)
+{
+  // Deallocate resources to terminate the icon
+  unrealize (display);
 
   // free the grid position just occupied if necessary
   if (is_grid == true) {
-    pgrid->free_space_used (gridx, gridy);
+    pgrid->free_space_used (gridx, gridy, page);
+    is_grid = false;
   }
 }
 
 string Icon::get_font_name (void)
 {
-    string fontname = configuration->get_config_string ("fontname");
-    string fontbold = configuration->get_config_string ("bold");
-
-    if (fontbold.size()) {
-        fontname += " bold";
-    }
-
-    return fontname;
+    // Bold is already appended to the font name when the settings are loaded
+    return configuration->get_settings().font_name;
 }
 
 int Icon::get_icon_horizontal_placement (int image_width)
@@ -533,7 +672,7 @@ int Icon::get_icon_horizontal_placement (int image_width)
   // This is useful so the "message" attribute is rendered to the left of the icon
   //
   int subx=0;
-  if (configuration->get_icon_string (iconid, "halign") == "right") {
+  if (spec->halign == ICON_HALIGN_RIGHT) {
     subx = iconw - image_width;
   }
 
@@ -542,37 +681,49 @@ int Icon::get_icon_horizontal_placement (int image_width)
 
 void Icon::clear(Display *display, XEvent ev)
 {
-  XClearWindow (display, win);
+  if (win != None) {
+    XClearWindow (display, win);
+  }
 }
 
-void Icon::draw(Display *display, XEvent ev, bool fClear)
+void Icon::invalidate_surface (int state)
+{
+  // Discard a composed surface, it will be built again next time it needs rendering
+  invalidate_frames();
+  if (surface[state] != NULL) {
+    imlib_context_set_image(surface[state]);
+    imlib_free_image();
+    surface[state] = NULL;
+  }
+}
+
+bool Icon::compose_normal (void)
 {
   Imlib_Color_Modifier colorTrans=NULL;   // used if general icon transparency is requested
-  Imlib_Image resized = NULL;
-  int h=0, w=0, subx=0;
+  Imlib_Image image=NULL, image_stamp=NULL, image_status=NULL, canvas=NULL;
+  int w=0, h=0;
   int stamp_w=0, stamp_h=0;
-  int status_w=0, status_h=0;
-  int iconxmove=0, iconymove=0;
+  int old_w=image_w, old_h=image_h, old_subx=image_subx;
 
-  imlib_context_set_display(display);
-  imlib_context_set_visual(vis);
-  imlib_context_set_colormap(cmap);
-  imlib_context_set_drawable(win);
-
-  log5 ("drawing icon (name @coords)", ficon, iconx, icony, iconw, iconh);
-
-  // Reinforcing the window to stay at the bottom of all windows. From the docs on XLowerWindow...
-  // "Lowering a mapped window will generate Expose events on any windows it formerly obscured."
-  //
-  XMapWindow(display, win);
-  XLowerWindow(display, win);
+  invalidate_surface (ICON_STATE_NORMAL);
+  image_w = image_h = image_subx = 0;
 
-  if (fClear == true) {
-    // Clear the icon area completely
-    // This is needed when for example the transparent background has changed due to blur effect
-    XClearWindow (display, win);
+  // The canvas holds the icon, stamp and status images blended together,
+  // sized to the icon box and fully transparent where nothing is drawn.
+  canvas = imlib_create_image (iconw, iconh);
+  if (!canvas) {
+    log1 ("Error allocating the composed surface for icon", ficon);
+    return false;
   }
 
+  imlib_context_set_image(canvas);
+  imlib_image_set_has_alpha(1);
+  imlib_context_set_blend(0);
+  imlib_context_set_color(0, 0, 0, 0);
+  imlib_image_fill_rectangle(0, 0, iconw, iconh);
+  imlib_context_set_anti_alias(1);
+  imlib_context_set_blend(1);
+
   // Is there a s Stamp icon? If so, load it now
   if (ficon_stamp.length() > 0) {
     image_stamp = imlib_load_image (ficon_stamp.c_str());
@@ -588,10 +739,7 @@ void Icon::draw(Display *display, XEvent ev, bool fClear)
   if (ficon_status.length() > 0) {
     image_status = imlib_load_image (ficon_status.c_str());
     if (image_status) {
-      imlib_context_set_image(image_status);
-      status_w = imlib_image_get_width();
-      status_h = imlib_image_get_height();
-      log3 ("loaded status icon (icon, width, height)", ficon_status, status_w, status_h);
+      log1 ("loaded status icon", ficon_status);
     }
   }
 
@@ -608,41 +756,38 @@ void Icon::draw(Display *display, XEvent ev, bool fClear)
     log4 ("Image filename, width, height, and RGBA buffer size",
           ficon.c_str(), w, h, (w * h * 32) / 8);
 
-    subx = get_icon_horizontal_placement(w);
-
-    // Icons contained in a grid are uniformly resized
-    int neww = configuration->get_config_int ("gridiconwidth");
-    int newh = configuration->get_config_int ("gridiconheight");
-    if ((neww && newh) && (w != neww || h != newh) && configuration->get_icon_string(iconid, "relative-to") == "grid")
+    // Icons contained in a grid are uniformly resized,
+    // the rest are cloned so that the stamp is not blended into imlib2's cached copy.
+    Imlib_Image working = NULL;
+    int neww = configuration->get_settings().grid_icon_width;
+    int newh = configuration->get_settings().grid_icon_height;
+    if ((neww && newh) && (w != neww || h != newh) && is_grid == true)
       {
 	// Create a new image with the new uniformed size
 	log5 ("Resizing grid icon (name, original-size, new-size", ficon.c_str(), w, h, neww, newh);
-	imlib_context_set_anti_alias(1);
-	resized = imlib_create_cropped_scaled_image (0, 0, w, h, neww, newh);
-	imlib_context_set_image(resized);
-
-	// swap the original image with the resized one, discard the original one.
+	working = imlib_create_cropped_scaled_image (0, 0, w, h, neww, newh);
 	w = neww;
 	h = newh;
-	imlib_context_set_image(image);
-	imlib_free_image_and_decache();
-	image = resized;
-	imlib_context_set_image(image);
       }
+    else {
+      working = imlib_clone_image();
+    }
 
-    // Prepare the icon image for rendering
-    imlib_context_set_drawable(win);
-    Imlib_Color_Modifier cmHighlight;
-    cmHighlight = imlib_create_color_modifier();
-    imlib_context_set_color_modifier(cmHighlight);
-    imlib_modify_color_modifier_brightness(0);
-    imlib_context_set_anti_alias(1);
-    imlib_context_set_blend(1);
+    // discard the original image, the composed surface is all we keep.
+    imlib_free_image_and_decache();
+    image = working;
+  }
+
+  if (image != NULL) {
+    imlib_context_set_image(image);
+    image_subx = get_icon_horizontal_placement(w);
+    image_w = w;
+    image_h = h;
 
-    // If Icon transparency is provided, apply the mapping now, before rendering the image
+    // If Icon transparency is provided, apply the mapping now, before blending the image
     if (iconMapTransparency && transparency_value) {
       colorTrans = imlib_create_color_modifier();
-      imlib_context_set_color_modifier(colorTrans);    
+      imlib_context_set_color_modifier(colorTrans);
       imlib_get_color_modifier_tables(iconMapNone, iconMapNone, iconMapNone, iconMapTransparency);
       imlib_reset_color_modifier();
 
@@ -665,278 +810,711 @@ void Icon::draw(Display *display, XEvent ev, bool fClear)
                                       stamp_w, stamp_h);
     }
 
-    // Draw the icon on the surface window, default is top-left.
-    if (configuration->get_icon_string(iconid, "relative-to") == "grid") {
+    // Place the icon on the surface, default is top-left.
+    int placex = image_subx, placey = 0;
+    if (is_grid == true) {
       // If it's inside a grid we will position it horizontally centered, and to the bottom.
-        int gridx = (configuration->get_config_int ("gridwidth") > w ? 
-                     (configuration->get_config_int ("gridwidth") - w) / 2 : 0);
-
-        int gridy = (configuration->get_config_int ("gridheight") > h ?
-                     configuration->get_config_int ("gridheight") - h : 0);
-
-      imlib_render_image_on_drawable (gridx, gridy);
-    } 
-    else {   
-      imlib_render_image_on_drawable (subx + iconxmove, iconymove);
+      int gridwidth = configuration->get_settings().grid_width;
+      int gridheight = configuration->get_settings().grid_height;
+      placex = (gridwidth > w ? (gridwidth - w) / 2 : 0);
+      placey = (gridheight > h ? gridheight - h : 0);
     }
 
-    // Set context to stamped image so we can free it.
-    if (image_stamp != NULL) {
-      imlib_context_set_image(image_stamp);
-      imlib_free_image_and_decache();
-    }
+    imlib_context_set_image(canvas);
+    imlib_blend_image_onto_image (image, 1, 0, 0, w, h, placex, placey, w, h);
 
     // Free the color transformation if used
     if (colorTrans) {
       imlib_free_color_modifier();
     }
 
-  } // if icon image could be loaded
+    imlib_context_set_image(image);
+    imlib_free_image();
+  }
 
-  // Render the icon name below it, twice to create a shadow effect
-  if (caption.length() > 0) {
-    log1 ("Drawing icon caption", caption);
-    int fx = (iconw - fontInfoCaption.width) / 2;
-    int fy = iconh;
-    if (configuration->get_config_string("shadow") == "true")
-      {
-	XftDrawStringUtf8( xftdraw1, &xftcolor_shadow, font, 
-			   fx + shadowx, fy + shadowy + icontitlegap, 
-			   (XftChar8 *) caption.c_str(), caption.size());
+  if (image_stamp != NULL) {
+    imlib_context_set_image(image_stamp);
+    imlib_free_image_and_decache();
+  }
+
+  // If we have a status icon, draw it centered on top of the icon
+  // Or at given coordinates if specifed in the form "IconStatus: {x,y} /my/path/file.png"
+  // The status icon uses the coordinates of the complete icon space (width and height keys)
+  // not those of the image. This allows to put the status icon anywhere in the icon box.
+  if (image_status != NULL) {
+    imlib_context_set_image(image_status);
+    int status_w = imlib_image_get_width();
+    int status_h = imlib_image_get_height();
+
+    // Center the icon if coordinates are set to zero
+    int statusx = (status_x ? status_x : (iconw - status_w) / 2);
+    int statusy = (status_y ? status_y : (iconh - status_h) / 2);
+
+    log3 ("Composing status icon(icon,x,y)", ficon_status, statusx, statusy);
+    imlib_context_set_image(canvas);
+    imlib_blend_image_onto_image (image_status, 1, 0, 0, status_w, status_h,
+                                  statusx, statusy, status_w, status_h);
+    imlib_context_set_image(image_status);
+    imlib_free_image_and_decache();
+  }
+
+  surface[ICON_STATE_NORMAL] = canvas;
+  surface_x[ICON_STATE_NORMAL] = surface_y[ICON_STATE_NORMAL] = 0;
+
+  // Messages are laid out around the image, follow it if its size has changed
+  if (image_w != old_w || image_h != old_h || image_subx != old_subx) {
+    text_dirty = true;
+    invalidate_text();
+  }
+
+  return true;
+}
+
+bool Icon::compose_hover (void)
+{
+  Imlib_Image original=NULL, imghover=NULL, composed=NULL;
+  Imlib_Color_Modifier colorMod=NULL;
+
+  invalidate_surface (ICON_STATE_HOVER);
+  if (!ficon_hover.length()) {
+    return false;
+  }
+
+  // start by laoding the second texture icon
+  log1 ("composing second texture icon", ficon_hover);
+  imghover = imlib_load_image (ficon_hover.c_str());
+  if (!imghover) {
+    log1 ("could not load hover icon", ficon_hover);
+    return false;
+  }
+
+  imlib_context_set_anti_alias(1);
+  imlib_context_set_blend(1);
+
+  // if blending is also requested (HoverTransparent) mix original icon with the second texture
+  // with a transparency percentage specified by this same flag (0 will blend with desktop, 255 full opaque blend)
+  int hovertransparent = spec->hovertransparent;
+  if (hovertransparent > 0 && (original = imlib_load_image(ficon.c_str()))) {
+
+    // Work on a private copy of the original icon, imlib2 might be caching it
+    imlib_context_set_image(original);
+    composed = imlib_clone_image();
+    imlib_free_image_and_decache();
+    imlib_context_set_image(composed);
+
+    // Create a color modifier which we'll use to blend both images
+    colorMod = imlib_create_color_modifier();
+    imlib_context_set_color_modifier(colorMod);
+
+    if (iconMapNone && iconMapGlow) {
+      imlib_get_color_modifier_tables(iconMapNone, iconMapNone, iconMapNone, iconMapGlow);
+      imlib_reset_color_modifier();
+
+      for (int n=0; n < 256; n++) {
+	if (iconMapGlow[n] > 127) {
+	  // The value 127 shows me it smoothly blends both images without distorting their alphas
+	  // The higher the value (hovertransparent), the more the textures blend.
+	  iconMapGlow[n] = hovertransparent;
+	}
       }
-    
-    XftDrawStringUtf8 (xftdraw1, &xftcolor, font, 
-		       fx, fy + icontitlegap,
-		       (XftChar8 *) caption.c_str(), caption.size());
+    }
+    else {
+      log ("iconMapNone / iconMapGlow have not been allocated, no blending possible");
+    }
+
+    // Use the new modified color mapping, and blend the second texture on top of the original icon
+    imlib_set_color_modifier_tables (iconMapNone, iconMapNone, iconMapNone, iconMapGlow);
+    imlib_blend_image_onto_image (imghover, 1, 0, 0, iconw, iconh, 0, 0, iconw, iconh);
+
+    // The same mapping used to apply when rendering the blended icon, bake it into the surface
+    imlib_apply_color_modifier();
+    imlib_free_color_modifier();
+  }
+  else {
+    // If there is no blending requested, the second texture is the icon representation
+    imlib_context_set_image(imghover);
+    composed = imlib_clone_image();
+  }
+
+  imlib_context_set_image(imghover);
+  imlib_free_image_and_decache();
+
+  if (!composed) {
+    log1 ("Error allocating the hover surface for icon", ficon_hover);
+    return false;
+  }
+
+  imlib_context_set_image(composed);
+  place_hover_surface (imlib_image_get_width());
+
+  surface[ICON_STATE_HOVER] = composed;
+  return true;
+}
+
+void Icon::place_hover_surface (int image_width)
+{
+  int xoffset = spec->hoverxoffset;
+  int yoffset = spec->hoveryoffset;
+
+  // Account for icons with HAlign=right
+  int subx = get_icon_horizontal_placement(image_width);
+
+  // If the icon is in a grid, the hover icon will be on top, horizontally centered
+  if (is_grid == true) {
+    int horzx = (configuration->get_settings().grid_width - image_width) / 2;
+    if (horzx > configuration->get_settings().grid_width) {
+      horzx = 0; // rectify possible wrong hover icons that are wider than the grid
+    }
+    surface_x[ICON_STATE_HOVER] = horzx;
+    surface_y[ICON_STATE_HOVER] = 0;
+  }
+  else {
+    surface_x[ICON_STATE_HOVER] = xoffset + subx;
+    surface_y[ICON_STATE_HOVER] = yoffset;
+  }
+}
+
+void Icon::defer_hover (bool deferred)
+{
+  hover_deferred = (deferred && ficon_hover.length() > 0);
+}
+
+bool Icon::prepare_decode (DECODE_JOB *job)
+{
+  // Describe the surfaces this icon is missing, so the decode pool can compose them off the main thread.
+  // Returns false if there is nothing left to compose.
+  job->icon = ficon;
+  job->stamp = ficon_stamp;
+  job->stamp_x = stamp_x;
+  job->stamp_y = stamp_y;
+  job->status = ficon_status;
+  job->status_x = status_x;
+  job->status_y = status_y;
+  job->hover = ficon_hover;
+  job->width = iconw;
+  job->height = iconh;
+  job->grid = is_grid;
+  job->grid_icon_width = configuration->get_settings().grid_icon_width;
+  job->grid_icon_height = configuration->get_settings().grid_icon_height;
+  job->grid_width = configuration->get_settings().grid_width;
+  job->grid_height = configuration->get_settings().grid_height;
+  job->halign_right = (spec->halign == ICON_HALIGN_RIGHT);
+  job->transparency = (iconMapTransparency ? transparency_value : 0);
+  job->hover_transparent = spec->hovertransparent;
+
+  job->want_normal = (surface[ICON_STATE_NORMAL] == NULL);
+  job->want_hover = (ficon_hover.length() > 0 && surface[ICON_STATE_HOVER] == NULL);
+  return (job->want_normal || job->want_hover);
+}
+
+bool Icon::adopt_decoded (DECODE_JOB *job)
+{
+  // Hand the buffers composed by the decode pool over to imlib2.
+  // Surfaces the pool could not compose are left empty, draw() composes them with imlib2.
+  int old_w=image_w, old_h=image_h, old_subx=image_subx;
+  bool adopted=false;
+
+  if (job->normal_ready) {
+    invalidate_surface (ICON_STATE_NORMAL);
+    Imlib_Image canvas = imlib_create_image_using_copied_data (job->normal.width, job->normal.height,
+                                                               (DATA32 *) &job->normal.pixels[0]);
+    if (canvas) {
+      imlib_context_set_image(canvas);
+      imlib_image_set_has_alpha(1);
+      surface[ICON_STATE_NORMAL] = canvas;
+      surface_x[ICON_STATE_NORMAL] = surface_y[ICON_STATE_NORMAL] = 0;
+      image_w = job->image_w;
+      image_h = job->image_h;
+      image_subx = job->image_subx;
+      adopted = true;
+
+      // Messages are laid out around the image, follow it if its size has changed
+      if (image_w != old_w || image_h != old_h || image_subx != old_subx) {
+        text_dirty = true;
+        invalidate_text();
+      }
+    }
+  }
+
+  if (job->hover_ready) {
+    invalidate_surface (ICON_STATE_HOVER);
+    Imlib_Image composed = imlib_create_image_using_copied_data (job->hover_surface.width, job->hover_surface.height,
+                                                                 (DATA32 *) &job->hover_surface.pixels[0]);
+    if (composed) {
+      imlib_context_set_image(composed);
+      imlib_image_set_has_alpha(1);
+      place_hover_surface (job->hover_surface.width);
+      surface[ICON_STATE_HOVER] = composed;
+      adopted = true;
+    }
+  }
+
+  return adopted;
+}
+
+void Icon::draw(Display *display, XEvent ev, bool fClear)
+{
+  // Icons on other grid pages have nothing to draw on
+  if (win == None) {
+    return;
+  }
+
+  imlib_context_set_display(display);
+  imlib_context_set_visual(vis);
+  imlib_context_set_colormap(cmap);
+  imlib_context_set_drawable(win);
+
+  log5 ("drawing icon (name @coords)", ficon, iconx, icony, iconw, iconh);
+
+  // Reinforcing the window to stay at the bottom of all windows. From the docs on XLowerWindow...
+  // "Lowering a mapped window will generate Expose events on any windows it formerly obscured."
+  //
+  XMapWindow(display, win);
+  XLowerWindow(display, win);
+
+  // Images are only loaded and composed when the icon attributes change,
+  // otherwise an Expose is just a blit of the surface we already have.
+  // Surfaces the decode pool has already prepared are not composed again here.
+  if (surface[ICON_STATE_NORMAL] == NULL) {
+    compose_normal();
+  }
+
+  // A hook might have changed the icon image, get the hover surface ready again.
+  // During startup it is left for a later slice, so the first icons show up sooner.
+  if (ficon_hover.length() > 0 && surface[ICON_STATE_HOVER] == NULL && hover_deferred == false) {
+    compose_hover();
+  }
+
+  // Text is laid out again only when it changes, or when the icon image does
+  if (text_dirty == true) {
+    layout_text (display);
+  }
+
+  if (compositing == true) {
+    // The final pixels live on the server as the window background,
+    // the XServer repaints exposed areas by itself without asking us.
+    if (frame[ICON_STATE_NORMAL] == None) {
+      compose_frames(display);
+    }
+
+    show_frame (display, visual_state);
+    return;
+  }
+
+  if (fClear == true) {
+    // Clear the icon area completely
+    // This is needed when for example the transparent background has changed due to blur effect
+    XClearWindow (display, win);
+  }
+
+  if (surface[ICON_STATE_NORMAL] != NULL) {
+    imlib_context_set_image(surface[ICON_STATE_NORMAL]);
+    imlib_context_set_color_modifier(NULL);
+    imlib_context_set_blend(1);
+    imlib_render_image_on_drawable (surface_x[ICON_STATE_NORMAL], surface_y[ICON_STATE_NORMAL]);
+  }
+
+  if (winpic != None) {
+    draw_text (display, winpic);
+  }
+
+  // save the current icon render so we can restore when mouse hovers out
+  imlib_context_set_image (backsafe);
+  imlib_context_set_drawable (win);
+  imlib_copy_drawable_to_image (0, 0, 0, iconw, iconh, 0, 0, 1);
+
+  // If the mouse is over the icon, keep showing the hover effect on top
+  if (visual_state == ICON_STATE_HOVER && surface[ICON_STATE_HOVER] != NULL) {
+    imlib_context_set_image(surface[ICON_STATE_HOVER]);
+    imlib_context_set_color_modifier(NULL);
+    imlib_context_set_blend(1);
+    imlib_render_image_on_drawable (surface_x[ICON_STATE_HOVER], surface_y[ICON_STATE_HOVER]);
+  }
+}
+
+bool Icon::layout_text(Display *display)
+{
+  // Lays out caption and message literals, only when they change or the icon image does.
+  // Positions, fonts and the resulting window size are kept for compose_text to render.
+  // Returns true if the icon window had to be resized to fit the text.
+  int w=image_w, h=image_h, subx=image_subx;
+  int new_winw=iconw, new_winh=0;
+  bool resized=false;
+  XGlyphInfo fiSmaller;
+
+  invalidate_text();
+  text_dirty = false;
+
+  memset (&fontInfoCaption, 0x00, sizeof (XGlyphInfo));
+  memset (&fontInfoMessage, 0x00, sizeof (XGlyphInfo));
+  memset (&fiSmaller, 0x00, sizeof (XGlyphInfo));
+  caption_x = caption_y = message1_x = message1_y = message2_x = message2_y = 0;
+  message_text1 = message_line1;
+
+  if (fontmessage) {
+    pool->release_font (fontmessage);
+    fontmessage = NULL;
   }
 
-  // Render the message information area for non-grid icons
+  // The icon name goes centered below the image
+  if (font && caption.length() > 0) {
+    XftTextExtentsUtf8 (display, font, (XftChar8*) caption.c_str(), caption.length(), &fontInfoCaption);
+    caption_x = (iconw - fontInfoCaption.width) / 2;
+    caption_y = iconh + icontitlegap;
+  }
+
+  // The message information area is for non-grid icons only
   // Can be at the left or right side of the image
   // Or in absolute coordinates on top of the image (Message: {x,y} Line1|Line2)
   if (is_grid == false && message_line1.length() > 0 && font && fontsmaller) {
 
-    // Ask how wide the rendered text will occupy in pixels
-    XftTextExtentsUtf8 (display, font, (XftChar8*) message_line1.c_str(), message_line1.length(), &fontInfoMessage);
+    string fontname = get_font_name();
+    int fontsize = configuration->get_settings().font_size;
     int xgap=5;        // used to avoid the text from blending with the icon when halign=right
     int y_font_gap=5;  // used to give vertical empty space between the two text lines
 
+    // Ask how wide the rendered text will occupy in pixels
+    fontmessage = pool->acquire_font (fontname, fontsize);
+    if (fontmessage) {
+      XftTextExtentsUtf8 (display, fontmessage, (XftChar8*) message_text1.c_str(), message_text1.length(), &fontInfoMessage);
+    }
+
     // Decide where to position the message (absolute coords, or next to the image)
     if (message_x && message_y) {
+      message1_x = message_x;
+      message1_y = message_y;
+
+      int room = w - message_x - 10;
+      if (fontmessage && fontInfoMessage.width > room) {
+
+        // Absolute positioning and the text is too long to fit. Search for the largest font size
+        // that does, fonts come from the pool so only sizes never seen before are opened.
+        int lo=MIN_MESSAGE_FONT_SIZE, hi=fontsize - 1, best=MIN_MESSAGE_FONT_SIZE;
+        while (lo <= hi) {
+          int size = (lo + hi) / 2;
+          XGlyphInfo extents;
+          memset (&extents, 0x00, sizeof (XGlyphInfo));
+          XftFont *candidate = pool->acquire_font (fontname, size);
+          if (candidate) {
+            XftTextExtentsUtf8 (display, candidate, (XftChar8*) message_text1.c_str(), message_text1.length(), &extents);
+            pool->release_font (candidate);
+          }
+
+          if (candidate && extents.width <= room) {
+            best = size;
+            lo = size + 1;
+          }
+          else {
+            hi = size - 1;
+          }
+        }
 
-        // Absolute positioning. If the text is too long to fit, downscale font size,
-        // based on remaining rendering space in pixels, and string length.
-        if ((message_x + fontInfoMessage.width + 10) > w) {
-            XftFontClose(display, font);
-            string fontname = get_font_name();
-            int fontsize = configuration->get_config_int ("fontsize");
-            int new_fontsize = (w - message_x) / message_line1.length() + 4;
-            log2 ("Text cannot fit: choosing a smaller font (tex, new size)", message_line1, new_fontsize);
-
-            // rectify the baseline position of the text
-            message_y -= (fontsize - new_fontsize) / 8;
-
-            font = XftFontOpen (display, DefaultScreen(display),
-                                XFT_FAMILY, XftTypeString, fontname.c_str(),
-                                XFT_SIZE, XftTypeDouble, (float) new_fontsize,
-                                NULL);
-
-            // Obtain new font extents information
-            memset(&fontInfoMessage, 0x00, sizeof(fontInfoMessage));
-            XftTextExtentsUtf8 (display, font, (XftChar8*) message_line1.c_str(), message_line1.length(), &fontInfoMessage);
-
-            // Check for boundaries once again, this time we will cut the text if still is too long
-            
-            if ((message_x + fontInfoMessage.width + new_fontsize) > w) {
-                // Cut the text and append 3 dots to it
-                int num_chars_cut = (fontInfoMessage.width + message_x - w) / new_fontsize + 5;
-                message_line1 = message_line1.substr(0, message_line1.length() - num_chars_cut);
-                message_line1 += "...";
-
-                log2 ("Cutting text after downscale as it still wont fit(msg, num_chars_cut)",
-                      message_line1, num_chars_cut);
-            }
+        log2 ("Text cannot fit: choosing a smaller font (text, new size)", message_line1, best);
+        XftFont *smaller = pool->acquire_font (fontname, best);
+        if (smaller) {
+          pool->release_font (fontmessage);
+          fontmessage = smaller;
+          XftTextExtentsUtf8 (display, fontmessage, (XftChar8*) message_text1.c_str(), message_text1.length(), &fontInfoMessage);
         }
-    } 
-    else {
-        // Automatic position. Next to the image.
-        // (left or right, depending on how close to the screen border)
-        message_y = h / 2;      // FIXME: This is not pixel-accurate
-        if (subx > 0) {
-            // Icon is aligned to the right - Align the message to the left of the icon
-            message_x = subx - fontInfoMessage.width - xgap;
+
+        // rectify the baseline position of the text
+        message1_y -= (fontsize - best) / 8;
+
+        // Still too long at the smallest size, cut the text and append 3 dots to it
+        while (fontInfoMessage.width > room && message_text1.length() > 3) {
+          string cut = message_text1.substr (0, message_text1.length() - 3);
+          do {
+            cut.erase (cut.length() - 1);
+          } while (cut.length() > 0 && (cut[cut.length() - 1] & 0xc0) == 0x80);
+
+          message_text1 = cut + "...";
+          XftTextExtentsUtf8 (display, fontmessage, (XftChar8*) message_text1.c_str(), message_text1.length(), &fontInfoMessage);
         }
-        else {
-            // Message is aligned to the right side of the image
-            message_x = w + icontitlegap;
+
+        if (message_text1 != message_line1) {
+          log1 ("Cutting text after downscale as it still wont fit", message_text1);
         }
+      }
+    }
+    else {
+      // Automatic position. Next to the image.
+      // (left or right, depending on how close to the screen border)
+      message1_y = h / 2;      // FIXME: This is not pixel-accurate
+      if (subx > 0) {
+        // Icon is aligned to the right - Align the message to the left of the icon
+        message1_x = subx - fontInfoMessage.width - xgap;
+      }
+      else {
+        // Message is aligned to the right side of the image
+        message1_x = w + icontitlegap;
+      }
     }
 
-    // Render the first line
-    log3 ("Drawing first message (msg, x, y)", message_line1, message_x, message_y);
-    XftDrawStringUtf8 (xftdraw1, &xftcolor, font, message_x, message_y,
-                       (XftChar8 *) message_line1.c_str(), message_line1.length());
-
-    // Render the second line below using a smaller font
-    XGlyphInfo fiSmaller;
-    memset(&fiSmaller, 0x00, sizeof(fiSmaller));
+    // The second line goes below the first one using a smaller font
     if (message_line2.length()) {
-        XftTextExtentsUtf8 (display, fontsmaller, (XftChar8*) message_line2.c_str(),
-                            message_line2.length(), &fiSmaller);
-
-        int fx2=message_x;
-        
-        // If the icon has the "Halign=right" attribute, rectify the horizontal position
-        // of the second lign to be aligned to the right, with respect the first line
-        if (subx) {
-            fx2 = (message_x + fontInfoMessage.width) - fiSmaller.width;
-        }
-
-        // The vertical position of the second line goes below the first line
-        int fy2=message_y + fiSmaller.height + y_font_gap;
+      XftTextExtentsUtf8 (display, fontsmaller, (XftChar8*) message_line2.c_str(),
+                          message_line2.length(), &fiSmaller);
+
+      // If the icon has the "Halign=right" attribute, rectify the horizontal position
+      // of the second lign to be aligned to the right, with respect the first line
+      message2_x = message1_x;
+      if (subx) {
+        message2_x = (message1_x + fontInfoMessage.width) - fiSmaller.width;
+      }
 
-        log3 ("Drawing second message (msg, x, y)", message_line2, fx2, fy2);
-        XftDrawStringUtf8 (xftdraw1, &xftcolor_shadow, fontsmaller ? fontsmaller : font, 
-                           fx2, fy2, (XftChar8*) message_line2.c_str(),
-                           message_line2.length());
+      message2_y = message1_y + fiSmaller.height + y_font_gap;
     }
 
     // Automatically expand icon's width if message text
     // is aligned to the left, so that the "message" attribute is not cut.
-    if (configuration->get_icon_string (iconid, "halign") == "left")
-      {
-	XWindowChanges xwc;
-	memset (&xwc, 0x00, sizeof (xwc));
-	int longest_text = fiSmaller.width > fontInfoMessage.width ? fiSmaller.width : fontInfoMessage.width;
-
-	xwc.width = w + longest_text + 5;
-	log2 ("Adjusting icon box width (icon, new width)", get_icon_name(), xwc.width);
-	XConfigureWindow (display, win, CWWidth, &xwc);
-        XFlush (display);
-      }
+    if (spec->halign == ICON_HALIGN_LEFT) {
+      int longest_text = fiSmaller.width > fontInfoMessage.width ? fiSmaller.width : fontInfoMessage.width;
+      new_winw = w + longest_text + 5;
+    }
   }
 
-  // If we have a status icon, draw it centered on top of the icon
-  // Or at given coordinates if specifed in the form "IconStatus: {x,y} /my/path/file.png"
-  // The status icon uses the coordinates of the complete icon space (width and height keys)
-  // not those of the image. This allows to put the status icon anywhere in the icon box.
+  new_winh = iconh + fontInfoCaption.height + icontitlegap;
+  if (win && (new_winw != winw || new_winh != winh)) {
+    XWindowChanges xwc;
+    memset (&xwc, 0x00, sizeof (xwc));
+    xwc.width = new_winw;
+    xwc.height = new_winh;
+    log3 ("Adjusting icon box size (icon, new width, new height)", get_icon_name(), xwc.width, xwc.height);
+    XConfigureWindow (display, win, CWWidth | CWHeight, &xwc);
+    resized = true;
+  }
 
-  if (image_status != NULL) {
+  winw = new_winw;
+  winh = new_winh;
+  return resized;
+}
 
-        imlib_context_set_image(image_status);
+void Icon::invalidate_text (void)
+{
+  // Discard the text raster, and the frames it was composited into
+  invalidate_frames();
+  if (textpic != None && icon_display) {
+    XRenderFreePicture (icon_display, textpic);
+  }
+
+  if (textpix != None && icon_display) {
+    XFreePixmap (icon_display, textpix);
+  }
+
+  textpic = None;
+  textpix = None;
+}
+
+bool Icon::compose_text(Display *display)
+{
+  // The caption with its shadow, and the message lines, are rendered once into a translucent
+  // ARGB pixmap. Redraws are then a single server side composite of this raster.
+  if (textpic != None) {
+    return true;
+  }
+
+  if (!xftcolor || !xftcolor_shadow || (!caption.length() && !fontmessage)) {
+    return false;
+  }
+
+  // Xft only renders with alpha through XRender when given a visual with an alpha channel,
+  // a bare depth 32 drawable makes it fall back to core drawing, which leaves alpha at zero.
+  XVisualInfo vinfo;
+  XRenderPictFormat *argb = NULL;
+  if (XMatchVisualInfo (display, DefaultScreen(display), 32, TrueColor, &vinfo)) {
+    argb = XRenderFindVisualFormat (display, vinfo.visual);
+  }
+
+  if (!argb || argb->type != PictTypeDirect || !argb->direct.alphaMask) {
+    log ("XRender ARGB32 visual is not available, icon text will not be rendered");
+    return false;
+  }
+
+  textpix = XCreatePixmap (display, win, winw, winh, 32);
+  textpic = XRenderCreatePicture (display, textpix, argb, 0, NULL);
 
-        // Center the icon if coordinates are set to zero
-        if (!status_x) status_x = (iconw - imlib_image_get_width()) / 2;
-        if (!status_y) status_y = (iconh - imlib_image_get_height()) / 2;
+  XRenderColor transparent;
+  memset (&transparent, 0x00, sizeof (transparent));
+  XRenderFillRectangle (display, PictOpSrc, textpic, &transparent, 0, 0, winw, winh);
+
+  Colormap argb_cmap = XCreateColormap (display, DefaultRootWindow(display), vinfo.visual, AllocNone);
+  XftDraw *xftdraw = XftDrawCreate (display, textpix, vinfo.visual, argb_cmap);
+  if (!xftdraw) {
+    log1 ("Could not create the text raster for icon", get_icon_name());
+    XFreeColormap (display, argb_cmap);
+    invalidate_text();
+    return false;
+  }
 
-        log3 ("Drawing status icon(icon,x,y)", ficon_status, status_x, status_y);
-        imlib_render_image_on_drawable (status_x, status_y);
-        imlib_context_set_image(image_status);
-        imlib_free_image_and_decache();
+  // Render the icon name below it, twice to create a shadow effect
+  if (font && caption.length() > 0) {
+    log1 ("Rendering icon caption", caption);
+    if (configuration->get_settings().shadow) {
+      XftDrawStringUtf8 (xftdraw, xftcolor_shadow, font,
+                         caption_x + shadowx, caption_y + shadowy,
+                         (XftChar8 *) caption.c_str(), caption.size());
     }
 
-  // save the current icon render so we can restore when mouse hovers out
-  imlib_context_set_image (backsafe);
-  imlib_context_set_drawable (win);
-  imlib_copy_drawable_to_image (0, 0, 0, iconw, iconh, 0, 0, 1);
+    XftDrawStringUtf8 (xftdraw, xftcolor, font, caption_x, caption_y,
+                       (XftChar8 *) caption.c_str(), caption.size());
+  }
+
+  if (fontmessage) {
+    log3 ("Rendering first message (msg, x, y)", message_text1, message1_x, message1_y);
+    XftDrawStringUtf8 (xftdraw, xftcolor, fontmessage, message1_x, message1_y,
+                       (XftChar8 *) message_text1.c_str(), message_text1.length());
+
+    if (message_line2.length()) {
+      log3 ("Rendering second message (msg, x, y)", message_line2, message2_x, message2_y);
+      XftDrawStringUtf8 (xftdraw, xftcolor_shadow, fontsmaller, message2_x, message2_y,
+                         (XftChar8*) message_line2.c_str(), message_line2.length());
+    }
+  }
 
+  XftDrawDestroy (xftdraw);
+  XFreeColormap (display, argb_cmap);
+  return true;
 }
 
-bool Icon::blink_icon(Display *display, XEvent ev)
+void Icon::draw_text(Display *display, Picture dest)
 {
-  bool bsuccess = false;
-  Imlib_Image original = imlib_load_image(ficon.c_str());
-  Imlib_Color_Modifier colorMod=NULL;
-
-  // Set the cursor to hand icon
-  XDefineCursor(display, win, cursor);
+  // Composite the cached text raster on top of the icon window or one of its frames
+  if (textpic == None && !compose_text (display)) {
+    return;
+  }
 
-  // If a second texture is provided, create a visual effect when mouse moves over the icon (hover effect)
-  if (ficon_hover.length() > 0) {
+  XRenderComposite (display, PictOpOver, textpic, None, dest,
+                    0, 0, 0, 0, 0, 0, winw, winh);
+}
 
-    // start by laoding the second texture icon
-    log1 ("drawing second texture icon", ficon_hover);
-    Imlib_Image imghover = imlib_load_image (ficon_hover.c_str());
-    
-    // if blending is also requested (HoverTransparent) mix original icon with the second texture
-    // with a transparency percentage specified by this same flag (0 will blend with desktop, 255 full opaque blend)
-    if (configuration->get_icon_int (iconid, "hovertransparent") > 0) {
-
-      // Set drawing operations using the original icon
-      imlib_context_set_drawable(win);
-      imlib_context_set_image(original);
-      imlib_context_set_anti_alias(1);
-      imlib_context_set_blend(1);
-      
-      // Create a color modifier which we'll use to blend both images
-      colorMod = imlib_create_color_modifier();
-      imlib_context_set_color_modifier(colorMod);
-
-      if (iconMapNone && iconMapGlow) {
-	imlib_get_color_modifier_tables(iconMapNone, iconMapNone, iconMapNone, iconMapGlow);
-	imlib_reset_color_modifier();
-
-	for (int n=0; n < 256; n++) {
-	  if (iconMapGlow[n] > 127) {
-	    // The value 127 shows me it smoothly blends both images without distorting their alphas
-	    // The higher the value (hovertransparent), the more the textures blend.
-	    iconMapGlow[n] = configuration->get_icon_int (iconid, "hovertransparent");
-	  }
-	}
-      }
-      else {
-	log ("iconMapNone / iconMapGlow have not been allocated, no blending possible");
-      }
+void Icon::invalidate_frames (void)
+{
+  // Discard the server side frames, they will be composed again on the next draw
+  for (int state=0; state < ICON_STATE_MAX; state++) {
+    if (frame[state] != None && icon_display) {
+      XFreePixmap (icon_display, frame[state]);
+    }
+    frame[state] = None;
+  }
+}
 
-      // Use the new modified color mapping, and blend the second texture on top of the original icon
-      imlib_set_color_modifier_tables (iconMapNone, iconMapNone, iconMapNone, iconMapGlow);
-      imlib_blend_image_onto_image (imghover, 1, 0, 0, iconw, iconh, 0, 0, iconw, iconh);
-      
-    } // if HoverTransparent
-    else {
+bool Icon::compose_frames(Display *display)
+{
+  // Compositing mode: each visual state is blended client side against the region
+  // of kdesk's wallpaper that sits below the icon window, and the resulting opaque pixels
+  // are pushed once into a pixmap. Nothing is ever read back from the XServer.
+  XRenderPictFormat *format = XRenderFindVisualFormat (display, vis);
+
+  invalidate_frames();
+  for (int state=0; state < ICON_STATE_MAX; state++) {
+    if (state == ICON_STATE_HOVER && surface[ICON_STATE_HOVER] == NULL) {
+      continue;
+    }
 
-      // If there is no blending requested, just draw the second texture as the icon representation
-      imlib_context_set_drawable(win);
-      imlib_context_set_image(imghover);
+    Imlib_Image region = pbackground->crop_wallpaper (iconx, icony, winw, winh);
+    if (!region) {
+      log1 ("Could not obtain the wallpaper region for icon", get_icon_name());
+      return false;
     }
-    
-    int xoffset = configuration->get_icon_int (iconid, "hoverxoffset");
-    int yoffset = configuration->get_icon_int (iconid, "hoveryoffset");
-
-    // Account for icons with HAlign=right
-    int image_width = imlib_image_get_width();
-    int subx = get_icon_horizontal_placement(image_width);
-
-    // If the icon is in a grid, the hover icon will be on top, horizontally centered
-    if (configuration->get_icon_string(iconid, "relative-to") == "grid") {
-      int horzx = (configuration->get_config_int ("gridwidth") - image_width) / 2;
-      if (horzx > configuration->get_config_int ("gridwidth")) {
-	horzx = 0; // rectify possible wrong hover icons that are wider than the grid
+
+    imlib_context_set_image(region);
+    imlib_context_set_color_modifier(NULL);
+    imlib_context_set_blend(1);
+    for (int layer=ICON_STATE_NORMAL; layer <= state; layer++) {
+      if (surface[layer] != NULL) {
+        imlib_context_set_image(surface[layer]);
+        int sw = imlib_image_get_width();
+        int sh = imlib_image_get_height();
+        imlib_context_set_image(region);
+        imlib_blend_image_onto_image (surface[layer], 0, 0, 0, sw, sh,
+                                      surface_x[layer], surface_y[layer], sw, sh);
       }
-      imlib_render_image_on_drawable (horzx, 0);
     }
-    else {
-      imlib_render_image_on_drawable (xoffset + subx, yoffset);
+
+    frame[state] = XCreatePixmap (display, win, winw, winh, DefaultDepth(display, DefaultScreen(display)));
+    imlib_context_set_drawable(frame[state]);
+    imlib_context_set_blend(0);
+    imlib_render_image_on_drawable (0, 0);
+    imlib_free_image();
+
+    // The text raster goes on top of the opaque frame, composited on the server
+    if (format) {
+      Picture framepic = XRenderCreatePicture (display, frame[state], format, 0, NULL);
+      draw_text (display, framepic);
+      XRenderFreePicture (display, framepic);
     }
+  }
 
-    if (colorMod) {
-      // The color modifier might have been used during texture blending
-      imlib_free_color_modifier();
+  imlib_context_set_drawable(win);
+  return true;
+}
+
+void Icon::show_frame(Display *display, int state)
+{
+  if (frame[state] == None) {
+    state = ICON_STATE_NORMAL;
+  }
+
+  if (frame[state] != None) {
+    XSetWindowBackgroundPixmap (display, win, frame[state]);
+    XClearWindow (display, win);
+  }
+}
+
+bool Icon::blink_icon(Display *display, XEvent ev)
+{
+  // Set the cursor to hand icon
+  XDefineCursor(display, win, cursor);
+
+  // If a second texture is provided, create a visual effect when mouse moves over the icon (hover effect)
+  // The surface has been prepared in advance, so this is just a swap of what is rendered.
+  visual_state = ICON_STATE_HOVER;
+
+  // The mouse got here before the startup slices did, compose the hover surface right now
+  if (hover_deferred == true) {
+    defer_hover (false);
+    if (compose_hover() && compositing == true) {
+      compose_frames (display);
     }
+  }
 
-    imlib_free_image_and_decache();
-    bsuccess = true;
+  if (surface[ICON_STATE_HOVER] == NULL) {
+    return false;
+  }
+
+  if (compositing == true) {
+    show_frame (display, ICON_STATE_HOVER);
+    return true;
   }
 
-  return bsuccess;
+  log1 ("drawing second texture icon", ficon_hover);
+  imlib_context_set_drawable(win);
+  imlib_context_set_image(surface[ICON_STATE_HOVER]);
+  imlib_context_set_color_modifier(NULL);
+  imlib_context_set_blend(1);
+  imlib_render_image_on_drawable (surface_x[ICON_STATE_HOVER], surface_y[ICON_STATE_HOVER]);
+  return true;
 }
 
 bool Icon::unblink_icon(Display *display, XEvent ev)
 {
   // Mouse is moving out of the icon
   // smoothly restore the original rendered icon.
+  visual_state = ICON_STATE_NORMAL;
+  if (surface[ICON_STATE_HOVER] == NULL) {
+    return false;
+  }
+
+  if (compositing == true) {
+    show_frame (display, ICON_STATE_NORMAL);
+    return true;
+  }
+
   log ("smoothly restoring original rendered icon");
   imlib_context_set_image(backsafe);
   imlib_context_set_drawable(win);
+  imlib_context_set_color_modifier(NULL);
+  imlib_context_set_blend(0);
   imlib_render_image_on_drawable(0, 0);
   return true;
 }
@@ -979,6 +1557,11 @@ Window Icon::find_icon_window (Display *display, std::string appid)
   appid.erase (std::remove(appid.begin(), appid.end(), '['), appid.end());
   appid.erase (std::remove(appid.begin(), appid.end(), ']'), appid.end());
 
+  // The desktop keeps a live index of application windows, no need to ask the XServer
+  if (pwindex && pwindex->is_live()) {
+    return pwindex->find (appid);
+  }
+
   log1 ("Searching for Icon Window from Appid string match", appid);
 
   // Enumerate top-level windows in search for the appid.
@@ -1015,29 +1598,11 @@ Window Icon::find_icon_window (Display *display, std::string appid)
 	  if ( (classHint.res_name && !strncasecmp (classHint.res_name, appid.c_str(), strlen (appid.c_str()))) ||
 	       (windowname && !strncasecmp (windowname, appid.c_str(), strlen (appid.c_str()))) )
 	    {
-	      // And the window's Icon Geometry returns 4 leftover LONGs,
-	      // This means that's the window associated with AppID and it's
-	      // represented with an icon on the desktop, which also means it accepts movement events (restore, maximize, ...)
-	      unsigned long nitems=0L;
-	      unsigned long leftover=0L;
-	      Atom xa_IconGeometry, actual_type;
-	      int actual_format;
-	      int status=-1;
-	      unsigned char *p = NULL;
-	      xa_IconGeometry = XInternAtom(display, "_NET_WM_ICON_GEOMETRY", false);
-	      status = XGetWindowProperty (display, subchildren[k],
-					   xa_IconGeometry, 0L, sizeof(unsigned long) * 64,
-					   false, xa_IconGeometry, &actual_type, &actual_format,
-					   &nitems, &leftover, &p);
-	      if (status == Success) {
-		if (leftover == 4) {
-		  log2 ("Icon app window was found (Appid, WindowID)", appid, subchildren[k]);
-		  wmax = subchildren[k];
-		}
-
-		if (p) {
-		  XFree (p);
-		}
+	      // And the window's Icon Geometry is provided, this means that's the window associated with AppID
+	      Atom xa_IconGeometry = XInternAtom(display, "_NET_WM_ICON_GEOMETRY", false);
+	      if (WindowIndex::has_icon_geometry (display, subchildren[k], xa_IconGeometry)) {
+		log2 ("Icon app window was found (Appid, WindowID)", appid, subchildren[k]);
+		wmax = subchildren[k];
 	      }
 	    }
 
@@ -1106,7 +1671,7 @@ bool Icon::maximize(Display *display)
     return fdone;
   }
   else {
-    string appid = configuration->get_icon_string (iconid, "appid");
+    string appid = spec->appid;
     Window wmaximize = find_icon_window (display, appid);
     if (wmaximize) {
       log2 ("found window to maximize (appid, window)", appid, wmaximize);
@@ -1121,10 +1686,10 @@ bool Icon::maximize(Display *display)
   return fdone;
 }
 
-bool Icon::double_click(Display *display, XEvent ev)
+bool Icon::double_click(Display *display, XEvent ev, Reactor *reactor)
 {
   bool success = false;
-  string filename = configuration->get_icon_string (iconid, "filename");
+  string filename = spec->filename;
   string command  = get_commandline();
   
   bool isrunning = is_singleton_running (display);
@@ -1136,31 +1701,14 @@ bool Icon::double_click(Display *display, XEvent ev)
       // Remove the hand icon to let the system show the startup hourglass
       XUndefineCursor (display, win);
 
-      // Launch the icon's appplication asynchronously,
+      // Launch the icon's appplication asynchronously, in its own session.
       // Set the status to starting, so that icons get disabled
-      // Until the app is up and running
-      pid_t pid = fork();
-      if (pid == 0) {
-	// we are in the new forked process
-	setsid ();
-	int rc = execl ("/bin/sh", "/bin/sh", "-c", command.c_str(), 0);
-	if (rc == -1)
-	  // We are in the child process
-	  {
-	    log2 ("error starting app (rc, command)", rc, command.c_str());
-	    _exit (1); // rather than exit() because the latter could interfere with parent's atexit()
-	  }
-	
-	log1 ("app has finished", filename);
-	_exit (0);
-      }
-      else if (pid == -1) {
-	log1 ("fork call failed, could not start app (errno)", errno);
+      // Until the app is up and running. The reactor collects it when it terminates.
+      pid_t pid = reactor->spawn (command.c_str(), true, NULL, NULL);
+      if (pid == -1) {
+	log1 ("could not start app (errno)", errno);
       }
       else {
-	// we are in the parent process, tell the kernel we don't bother about its termination
-	signal(SIGCHLD, SIG_IGN);
-
 	success = true;
 	log2 ("app has been started (pid, icon)", pid, filename);
       }
@@ -23,12 +23,27 @@
 // Number of points to decrease the font size for subtitle text in icons
 #define DEFAULT_SUBTITLE_FONT_POINT_DECREASE 6
 
+// Smallest point size an absolutely positioned message can be downscaled to
+#define MIN_MESSAGE_FONT_SIZE 6
+
+// Visual states of an icon, each one is backed by a composed surface
+// which is kept in memory until the icon attributes change.
+#define ICON_STATE_NORMAL  0
+#define ICON_STATE_HOVER   1
+#define ICON_STATE_MAX     2
+
 class IconGrid;
+class Background;
+class ResourcePool;
+class WindowIndex;
+class Reactor;
+typedef struct _decode_job DECODE_JOB;
 
 class Icon
 {
  private:
   Configuration *configuration;
+  const ICON_SPEC *spec;        // Attributes parsed from the lnk file, owned by the configuration
   Display *icon_display;
   Window win;
   IconGrid *pgrid;
@@ -43,17 +58,35 @@ class Icon
   int gridx, gridy;
   Cursor cursor;
   int cursor_id;
-  Imlib_Image image, image_stamp, image_status;
+  Imlib_Image surface[ICON_STATE_MAX];
+  int surface_x[ICON_STATE_MAX], surface_y[ICON_STATE_MAX];
+  int visual_state;
+  bool hover_deferred;          // The hover surface is composed later, during startup slices
+  int page;                     // Grid page the icon is on, only icons on the visible page are realized
+  int image_w, image_h, image_subx;
   Imlib_Image backsafe;
+  Background *pbackground;
+  bool compositing;
+  Pixmap frame[ICON_STATE_MAX];
+  int winw, winh;
   Visual *vis;
   Colormap cmap;
   XftFont *font;
   XftFont *fontsmaller;
+  XftFont *fontmessage;
   XGlyphInfo fontInfoCaption, fontInfoMessage;
-  XftDraw *xftdraw1;
-  XftColor xftcolor, xftcolor_shadow;
+  bool text_dirty;
+  int caption_x, caption_y;
+  int message1_x, message1_y, message2_x, message2_y;
+  std::string message_text1;
+  Pixmap textpix;
+  Picture textpic, winpic;
+  XftColor *xftcolor, *xftcolor_shadow;
+  ResourcePool *pool;
+  WindowIndex *pwindex;
   unsigned char *iconMapNone, *iconMapGlow, *iconMapTransparency;
   std::string filename;
+  std::string directory;
   std::string ficon;
   std::string ficon_hover;
   std::string ficon_stamp;
@@ -62,6 +95,9 @@ class Icon
   std::string message_line1;
   std::string message_line2;
 
+  void place_hover_surface (int image_width);
+  void allocate_maps (void);
+
  public:
   int iconid;
 
@@ -69,23 +105,48 @@ class Icon
   virtual ~Icon (void);
 
   int get_iconid(void);
+  Window get_window(void);
   int set_iconid(int iconidx);
+  bool refresh_spec(int iconidx, const ICON_SPEC &previous);
   std::string get_appid(void);
   std::string get_icon_filename(void);
+  std::string get_icon_directory(void);
   std::string get_icon_name(void);
   std::string get_commandline(void);
   std::string get_font_name(void);
   int get_icon_horizontal_placement (int image_width);
   bool is_singleton_running (Display *display);
 
-  Window create(Display *display, IconGrid *icon_grid);
+  bool compose_normal (void);
+  bool compose_hover (void);
+  bool prepare_decode (DECODE_JOB *job);
+  bool adopt_decoded (DECODE_JOB *job);
+  void defer_hover (bool deferred);
+  void invalidate_surface (int state);
+  bool compose_frames (Display *display);
+  void invalidate_frames (void);
+  void show_frame (Display *display, int state);
+
+  bool place(Display *display, IconGrid *icon_grid);
+  bool relayout(Display *display, IconGrid *icon_grid);
+  Window realize(Display *display, Background *background,
+                 ResourcePool *resource_pool, WindowIndex *window_index);
+  void unrealize(Display *display);
+  bool is_realized(void);
+  int get_page(void);
+  bool is_on_page(int grid_page);
+  void get_placement(int *x, int *y, int *w, int *h);
   void destroy(Display *display);
 
   void draw(Display *display, XEvent ev, bool fClear);
+  bool layout_text(Display *display);
+  bool compose_text(Display *display);
+  void invalidate_text(void);
+  void draw_text(Display *display, Picture dest);
   void clear(Display *display, XEvent ev);
   bool blink_icon(Display *display, XEvent ev);
   bool unblink_icon(Display *display, XEvent ev);
-  bool double_click(Display *display, XEvent ev);
+  bool double_click(Display *display, XEvent ev, Reactor *reactor);
   bool motion(Display *display, XEvent ev);
   bool maximize(Display *display);
   bool maximize(Display *display, Window win);
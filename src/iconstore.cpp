@@ -0,0 +1,260 @@
+//
+// iconstore.cpp  -  Content addressed cache of rendered SVG icons, with an index and LRU eviction
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Rendered icons are named after a hash of the SVG contents and the size they were rendered at,
+// so two SVG files with the same name in different directories no longer overwrite each other,
+// and identical files share their renders. A small index remembers the modification time, size
+// and hash of each SVG, and when each render was last used. Looking up an icon takes one stat
+// of the SVG and the in-memory index. Once the index is saved, least recently used renders are
+// removed until the cache fits its byte budget. Renders used since kdesk started are always kept.
+//
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "iconstore.h"
+#include "logging.h"
+
+IconStore::IconStore (void)
+{
+  session_start = time (NULL);
+  loaded = false;
+}
+
+IconStore::~IconStore (void)
+{
+}
+
+std::string IconStore::content_hash (std::string filename)
+{
+  // 64 bit FNV-1a of the file contents, empty if it cannot be read
+  unsigned char buffer[16384];
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t nread;
+
+  FILE *fp = fopen (filename.c_str(), "r");
+  if (!fp) {
+    return std::string("");
+  }
+
+  while ((nread = fread (buffer, 1, sizeof (buffer), fp)) > 0) {
+    for (size_t n=0; n < nread; n++) {
+      hash ^= buffer[n];
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  fclose (fp);
+
+  char chhash[32];
+  snprintf (chhash, sizeof (chhash), "%016llx", (unsigned long long) hash);
+  return std::string(chhash);
+}
+
+bool IconStore::load (std::string cache_directory)
+{
+  // Reads the index once, later calls only pick up a change of directory
+  if (loaded && directory == cache_directory) {
+    return true;
+  }
+
+  directory = cache_directory;
+  sources.clear();
+  entries.clear();
+  loaded = true;
+
+  std::string index = directory + "/" + ICONSTORE_INDEX;
+  FILE *fp = fopen (index.c_str(), "r");
+  if (!fp) {
+    // No index: the cache is new, or holds renders named the old way, after the SVG file name
+    log1 ("Icon cache index not found, starting a new one", index);
+    remove_unindexed();
+    return false;
+  }
+
+  // "S <mtime> <size> <hash> <path>" and "E <last used> <bytes> <name>" lines
+  char line[4096];
+  while (fgets (line, sizeof (line), fp)) {
+    char chname[4096], chhash[32];
+    long a=0, b=0;
+
+    line[strcspn (line, "\n")] = 0x00;
+    if (sscanf (line, "S %ld %ld %31s %4095[^\n]", &a, &b, chhash, chname) == 4) {
+      ICONSTORE_SOURCE source;
+      source.mtime = a;
+      source.size = b;
+      source.hash = chhash;
+      sources[chname] = source;
+    }
+    else if (sscanf (line, "E %ld %ld %4095[^\n]", &a, &b, chname) == 3) {
+      ICONSTORE_ENTRY entry;
+      entry.last_used = (time_t) a;
+      entry.bytes = b;
+      entries[chname] = entry;
+    }
+  }
+
+  fclose (fp);
+  log2 ("Icon cache index loaded (sources, renders)", sources.size(), entries.size());
+  return true;
+}
+
+void IconStore::remove_unindexed (void)
+{
+  struct dirent **files;
+  int numfiles = scandir (directory.c_str(), &files, 0, 0);
+
+  for (int n=0; n < numfiles; n++) {
+    std::string name = files[n]->d_name;
+    if (name.length() > 4 && name.substr (name.length() - 4) == ".png" && entries.find (name) == entries.end()) {
+      unlink ((directory + "/" + name).c_str());
+    }
+    free (files[n]);
+  }
+
+  if (numfiles >= 0) {
+    free (files);
+  }
+}
+
+bool IconStore::lookup (std::string source, int width, int height, std::string &cached, bool &needs_render)
+{
+  // Gives the cache file for the SVG rendered at width x height, zero keeps the document size.
+  // Returns false if the SVG cannot be read, needs_render tells if the file has to be rendered.
+  struct stat info;
+
+  if (stat (source.c_str(), &info) == -1 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+
+  // The SVG is only read again when it has changed since it was hashed
+  std::map <std::string, ICONSTORE_SOURCE>::iterator it = sources.find (source);
+  if (it == sources.end() || it->second.mtime != (long) info.st_mtime || it->second.size != (long) info.st_size) {
+    ICONSTORE_SOURCE fresh;
+    fresh.mtime = (long) info.st_mtime;
+    fresh.size = (long) info.st_size;
+    fresh.hash = content_hash (source);
+    if (!fresh.hash.length()) {
+      return false;
+    }
+    sources[source] = fresh;
+    it = sources.find (source);
+  }
+
+  char chname[64];
+  if (width && height) {
+    snprintf (chname, sizeof (chname), "%s-%dx%d.png", it->second.hash.c_str(), width, height);
+  }
+  else {
+    snprintf (chname, sizeof (chname), "%s.png", it->second.hash.c_str());
+  }
+
+  cached = directory + "/" + chname;
+  std::map <std::string, ICONSTORE_ENTRY>::iterator entry = entries.find (chname);
+  needs_render = (entry == entries.end() || entry->second.bytes == 0);
+
+  // New renders are sized when the index is saved, after they have been written
+  ICONSTORE_ENTRY &used = entries[chname];
+  if (needs_render) {
+    used.bytes = 0;
+  }
+  used.last_used = time (NULL);
+  return true;
+}
+
+static bool least_recent (const std::pair <time_t, std::string> &a, const std::pair <time_t, std::string> &b)
+{
+  return a.first < b.first;
+}
+
+bool IconStore::save (long budget)
+{
+  // Sizes new renders, evicts the least recently used ones over budget, and writes the index
+  std::vector < std::pair <time_t, std::string> > candidates;
+  std::map <std::string, ICONSTORE_ENTRY>::iterator it;
+  long total=0;
+
+  if (!loaded) {
+    return false;
+  }
+
+  for (it=entries.begin(); it != entries.end(); ) {
+    // Lookups trust the index, renders used this time are checked here once instead
+    if (it->second.bytes == 0 || it->second.last_used >= session_start) {
+      struct stat info;
+      if (stat ((directory + "/" + it->first).c_str(), &info) == -1) {
+        // The render failed, or the file was removed behind our back: forget about it
+        entries.erase (it++);
+        continue;
+      }
+      it->second.bytes = (long) info.st_size;
+    }
+
+    total += it->second.bytes;
+    if (it->second.last_used < session_start) {
+      candidates.push_back (std::make_pair (it->second.last_used, it->first));
+    }
+    ++it;
+  }
+
+  std::sort (candidates.begin(), candidates.end(), least_recent);
+  for (unsigned int n=0; n < candidates.size() && total > budget; n++) {
+    log1 ("Evicting rendered icon from the cache", candidates[n].second);
+    unlink ((directory + "/" + candidates[n].second).c_str());
+    total -= entries[candidates[n].second].bytes;
+    entries.erase (candidates[n].second);
+  }
+
+  // Hashes of SVG files whose renders are all gone are not worth remembering
+  std::map <std::string, ICONSTORE_SOURCE>::iterator source;
+  for (source=sources.begin(); source != sources.end(); ) {
+    it = entries.lower_bound (source->second.hash);
+    if (it == entries.end() || it->first.compare (0, source->second.hash.length(), source->second.hash)) {
+      sources.erase (source++);
+    }
+    else {
+      ++source;
+    }
+  }
+
+  // Written next to the index and renamed over it, so a crash never leaves half an index
+  std::string index = directory + "/" + ICONSTORE_INDEX;
+  std::string temporary = index + ".tmp";
+  FILE *fp = fopen (temporary.c_str(), "w");
+  if (!fp) {
+    log2 ("Could not write the icon cache index (file, errno)", temporary, errno);
+    return false;
+  }
+
+  for (source=sources.begin(); source != sources.end(); ++source) {
+    fprintf (fp, "S %ld %ld %s %s\n", source->second.mtime, source->second.size,
+             source->second.hash.c_str(), source->first.c_str());
+  }
+
+  for (it=entries.begin(); it != entries.end(); ++it) {
+    fprintf (fp, "E %ld %ld %s\n", (long) it->second.last_used, it->second.bytes, it->first.c_str());
+  }
+
+  bool written = (fclose (fp) == 0 && rename (temporary.c_str(), index.c_str()) == 0);
+  if (!written) {
+    unlink (temporary.c_str());
+  }
+
+  log3 ("Icon cache index saved (sources, renders, bytes)", sources.size(), entries.size(), total);
+  return written;
+}
@@ -0,0 +1,53 @@
+//
+// iconstore.h  -  Content addressed cache of rendered SVG icons, with an index and LRU eviction
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <time.h>
+
+#include <map>
+#include <string>
+
+// Index file in the icon cache directory, rewritten after each round of rendering
+#define ICONSTORE_INDEX           "index"
+
+// Default bytes the rendered icons can take on disk (kdeskrc IconCacheSize)
+#define ICONSTORE_DEFAULT_BUDGET  (16 * 1024 * 1024)
+
+// What the index knows about an SVG file, so it is only read again when it changes
+typedef struct _iconstore_source {
+  long mtime;
+  long size;
+  std::string hash;         // Content hash, names the rendered variants
+} ICONSTORE_SOURCE;
+
+// A rendered variant, named "<hash>-<width>x<height>.png", or "<hash>.png" at the document size
+typedef struct _iconstore_entry {
+  long bytes;               // 0 until the render has been found on disk
+  time_t last_used;
+} ICONSTORE_ENTRY;
+
+class IconStore
+{
+ private:
+  std::string directory;
+  std::map <std::string, ICONSTORE_SOURCE> sources;
+  std::map <std::string, ICONSTORE_ENTRY> entries;
+  time_t session_start;
+  bool loaded;
+
+  static std::string content_hash (std::string filename);
+  void remove_unindexed (void);
+
+ public:
+  IconStore (void);
+  virtual ~IconStore (void);
+
+  bool load (std::string cache_directory);
+  bool lookup (std::string source, int width, int height, std::string &cached, bool &needs_render);
+  bool save (long budget);
+};
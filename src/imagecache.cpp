@@ -0,0 +1,232 @@
+//
+// imagecache.cpp  -  Persistent cache of decoded and resized icon images
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Each cached image is a file with the pixels ready to be blended, resized to the size they are
+// displayed at. Files are named after a hash of the source path and the target size, and the key
+// stored in them adds the source modification time and size: an updated image misses the cache,
+// and its new pixels replace the old entry. Entries are read straight into the pixel buffer,
+// and written to a temporary file which is renamed in place, so readers never see partial entries.
+// Images no longer used are evicted, least recently used first, once the cache is over budget.
+//
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+#include <algorithm>
+
+#include "decodepool.h"
+#include "imagecache.h"
+#include "logging.h"
+
+// Entries used since kdesk started are never evicted, load refreshes their modification time
+static time_t session_start = time (NULL);
+
+std::string ImageCache::directory (void)
+{
+  char *home = getenv ("HOME");
+  if (!home || !strlen (home)) {
+    return std::string("");
+  }
+
+  return std::string(home) + "/" + CACHE_DIRECTORY_PIXELS;
+}
+
+bool ImageCache::prepare (void)
+{
+  // The parent directory is created along with the svg icons cache when icons are loaded
+  std::string cache_directory = directory();
+  if (!cache_directory.length()) {
+    return false;
+  }
+
+  if (mkdir (cache_directory.c_str(), 0755) == -1 && errno != EEXIST) {
+    log2 ("Could not create the image cache directory (directory, errno)", cache_directory, errno);
+    return false;
+  }
+
+  return true;
+}
+
+bool ImageCache::make_key (std::string source, int width, int height, std::string &key, std::string &entry)
+{
+  // Width and height are zero for images kept at their original size
+  struct stat info;
+  char chkey[64];
+
+  std::string cache_directory = directory();
+  if (!cache_directory.length() || stat (source.c_str(), &info) == -1 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+
+  snprintf (chkey, sizeof (chkey), "|%ld.%09ld|%ld|%dx%d",
+            (long) info.st_mtim.tv_sec, (long) info.st_mtim.tv_nsec, (long) info.st_size, width, height);
+  key = source + chkey;
+
+  // 64 bit FNV-1a of the source and size only, so a new version of the image takes the place
+  // of the old one. The key itself is stored in the entry to tell versions and collisions apart.
+  std::string name = source + strrchr (chkey, '|');
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t n=0; n < name.length(); n++) {
+    hash ^= (unsigned char) name[n];
+    hash *= 0x100000001b3ULL;
+  }
+
+  char chentry[32];
+  snprintf (chentry, sizeof (chentry), "/%016llx.argb", (unsigned long long) hash);
+  entry = cache_directory + chentry;
+  return true;
+}
+
+bool ImageCache::load (std::string &entry, std::string &key, PIXBUF &pixbuf)
+{
+  IMAGECACHE_HEADER header;
+  struct stat info;
+
+  int fd = open (entry.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+
+  // Anything that does not add up is a miss, the entry is written again
+  std::vector <char> stored_key;
+  bool loaded = false;
+  if (fstat (fd, &info) == 0 && (size_t) info.st_size >= sizeof (header) &&
+      pread (fd, &header, sizeof (header), 0) == (ssize_t) sizeof (header) &&
+      header.magic == IMAGECACHE_MAGIC && header.version == IMAGECACHE_VERSION &&
+      header.keylen == key.length()) {
+    size_t npixels = (size_t) header.width * header.height;
+    stored_key.resize (header.keylen + 1);
+    if ((size_t) info.st_size == sizeof (header) + header.keylen + npixels * sizeof (uint32_t) &&
+        pread (fd, &stored_key[0], header.keylen, sizeof (header)) == (ssize_t) header.keylen &&
+        !memcmp (&stored_key[0], key.c_str(), key.length())) {
+      pixbuf.width = header.width;
+      pixbuf.height = header.height;
+      pixbuf.pixels.resize (npixels);
+      ssize_t bytes = npixels * sizeof (uint32_t);
+      loaded = (pread (fd, &pixbuf.pixels[0], bytes, sizeof (header) + header.keylen) == bytes);
+    }
+  }
+
+  // Mark the entry as recently used, once per kdesk start
+  if (loaded && info.st_mtime < session_start) {
+    futimens (fd, NULL);
+  }
+
+  close (fd);
+  return loaded;
+}
+
+bool ImageCache::store (std::string &entry, std::string &key, PIXBUF &pixbuf)
+{
+  IMAGECACHE_HEADER header;
+  char chsuffix[64];
+
+  if (!pixbuf.width || !pixbuf.height) {
+    return false;
+  }
+
+  header.magic = IMAGECACHE_MAGIC;
+  header.version = IMAGECACHE_VERSION;
+  header.width = pixbuf.width;
+  header.height = pixbuf.height;
+  header.keylen = key.length();
+
+  // Each worker thread writes its own temporary file
+  snprintf (chsuffix, sizeof (chsuffix), ".%d.%lx.tmp", (int) getpid(), (unsigned long) pthread_self());
+  std::string temporary = entry + chsuffix;
+
+  FILE *fp = fopen (temporary.c_str(), "w");
+  if (!fp) {
+    log2 ("Could not create image cache entry (entry, errno)", temporary, errno);
+    return false;
+  }
+
+  bool written = (fwrite (&header, sizeof (header), 1, fp) == 1 &&
+                  fwrite (key.c_str(), key.length(), 1, fp) == 1 &&
+                  fwrite (&pixbuf.pixels[0], pixbuf.pixels.size() * sizeof (uint32_t), 1, fp) == 1);
+  if (fclose (fp) != 0) {
+    written = false;
+  }
+
+  if (!written || rename (temporary.c_str(), entry.c_str()) == -1) {
+    log2 ("Could not write image cache entry (entry, errno)", entry, errno);
+    unlink (temporary.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+static bool least_recent (const std::pair <time_t, std::string> &a, const std::pair <time_t, std::string> &b)
+{
+  return a.first < b.first;
+}
+
+bool ImageCache::trim (long budget)
+{
+  // Removes least recently used entries until the cache fits its budget,
+  // and temporary files left behind by a kdesk that did not finish writing them.
+  std::vector < std::pair <time_t, std::string> > candidates;
+  long total=0;
+
+  std::string cache_directory = directory();
+  DIR *dir = (cache_directory.length() ? opendir (cache_directory.c_str()) : NULL);
+  if (!dir) {
+    return false;
+  }
+
+  std::map <std::string, long> bytes;
+  struct dirent *dent;
+  while ((dent = readdir (dir)) != NULL) {
+    struct stat info;
+    std::string name = dent->d_name;
+    std::string path = cache_directory + "/" + name;
+    if (name[0] == '.' || stat (path.c_str(), &info) == -1 || !S_ISREG(info.st_mode)) {
+      continue;
+    }
+
+    if (name.length() > 4 && name.compare (name.length() - 4, 4, ".tmp") == 0) {
+      if (info.st_mtime < session_start) {
+        unlink (path.c_str());
+      }
+      continue;
+    }
+
+    total += (long) info.st_size;
+    if (info.st_mtime < session_start) {
+      candidates.push_back (std::make_pair (info.st_mtime, name));
+      bytes[name] = (long) info.st_size;
+    }
+  }
+  closedir (dir);
+
+  std::sort (candidates.begin(), candidates.end(), least_recent);
+  int evicted=0;
+  for (unsigned int n=0; n < candidates.size() && total > budget; n++) {
+    if (unlink ((cache_directory + "/" + candidates[n].second).c_str()) == 0) {
+      total -= bytes[candidates[n].second];
+      evicted++;
+    }
+  }
+
+  log2 ("Image cache trimmed (evicted entries, bytes kept)", evicted, total);
+  return true;
+}
@@ -0,0 +1,41 @@
+//
+// imagecache.h  -  Persistent cache of decoded and resized icon images
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <stdint.h>
+
+#include <string>
+
+// Decoded images are kept here, next to the converted SVG icons (CACHE_DIRECTORY_ICONS)
+#define CACHE_DIRECTORY_PIXELS  ".cache/kdesk/pixels"
+
+// Cache files start with this header, followed by the key and the ARGB pixels
+#define IMAGECACHE_MAGIC        0x5850444b    // "KDPX"
+#define IMAGECACHE_VERSION      2
+
+// Default bytes the cached images can take on disk (kdeskrc PixelCacheSize)
+#define IMAGECACHE_DEFAULT_BUDGET  (32 * 1024 * 1024)
+
+typedef struct _imagecache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t keylen;
+} IMAGECACHE_HEADER;
+
+class ImageCache
+{
+ public:
+  static std::string directory (void);
+  static bool prepare (void);
+  static bool make_key (std::string source, int width, int height, std::string &key, std::string &entry);
+  static bool load (std::string &entry, std::string &key, PIXBUF &pixbuf);
+  static bool store (std::string &entry, std::string &key, PIXBUF &pixbuf);
+  static bool trim (long budget);
+};
@@ -17,6 +17,8 @@
 #include <signal.h>
 #include <fcntl.h>
 
+#include <set>
+
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xft/Xft.h>
@@ -30,9 +32,12 @@
 #include "icon.h"
 #include "background.h"
 #include "sound.h"
+#include "hookpool.h"
 #include "desktop.h"
 #include "logging.h"
 #include "ssaver.h"
+#include "reactor.h"
+#include "control.h"
 
 
 // A printf macro sensitive to the -v (verbose) flag
@@ -48,39 +53,18 @@ static Desktop dsk;
 bool enable_shm=false;
 
 // local function prototypes
-void signal_callback_handler(int signum);
 void reload_configuration (Display *display);
 void reload_icons (Display *display);
 void trigger_icon_hook (Display *display, char *message);
 void finish_kdesk (Display *display);
 
 Display *get_current_display(void);
+Display *open_display_or_exit(void);
 void close_display(Display *display);
+int send_control_command (std::string command, bool print_reply);
 
 
 
-// Signal handler reached via a kill -USR
-void signal_callback_handler(int signum)
-{
-  Display *display=get_current_display();
-  if (!display) {
-    return;
-  }
-
-  log1 ("Received signal", signum);
-  if (signum == SIGHUP) {
-    log ("Received signal to reload configuration");
-    reload_configuration(display);
-  }
-  else if (signum == SIGUSR1) {
-    log ("Received graceful kdesk quit signal");
-    finish_kdesk(display);
-  }
-  
-  close_display(display);
-  return;
-}
-
 void reload_configuration (Display *display)
 {
   log ("Reloading kdesk configuration");
@@ -160,6 +144,50 @@ Display *get_current_display(void)
     return XOpenDisplay(NULL);
 }
 
+Display *open_display_or_exit(void)
+{
+  Display *display=get_current_display();
+  if (!display) {
+    kprintf ("Could not connect to the XServer\n");
+    kprintf ("Is the DISPLAY variable correctly set?\n\n");
+    exit (1);
+  }
+  return display;
+}
+
+// Sends a command through the kdesk control socket, no XServer connection is needed.
+// Returns the exit code for the command line, or -1 if kdesk could not be reached
+// and the control window atoms need to be used instead. A request that reached kdesk
+// is never sent again through the atoms, even without a reply, so it does not run twice.
+int send_control_command (std::string command, bool print_reply)
+{
+  string reply;
+  bool success=false;
+
+  // Don't trigger anything if we have inherited the environment variable
+  // set on calls to icon hook script
+  if (command.compare (0, 5, "query") && getenv("KDESK_NO_RECURSE")) {
+    log("Error! Attempt to use kdesk from a process run via iconhook script");
+    return 1;
+  }
+
+  if (!ControlServer::send_request (getenv ("DISPLAY"), command, reply, success)) {
+    log1 ("Control socket not available, falling back to the control window", reply);
+    return -1;
+  }
+
+  if (!success) {
+    kprintf ("Kdesk could not run the command: %s\n", reply.c_str());
+    return 1;
+  }
+
+  if (print_reply) {
+    printf ("%s", reply.c_str());
+  }
+
+  return 0;
+}
+
 void close_display(Display *display)
 {
     XCloseDisplay(display);
@@ -185,14 +213,14 @@ int XShmQueryExtension(Display *d)
 int main(int argc, char *argv[])
 {
   Status rc;
-  Display *display=get_current_display();
+  Display *display=NULL;
   Configuration conf;
   KSAVER_DATA ksaver_data;
   string strKdeskRC, strHomeKdeskRC, strKdeskDir, strKdeskUser;
   string configuration_file;
   bool test_mode = false, wallpaper_mode = false, screen_saver_mode = false;
   bool reload = false, running=true;
-  int c;
+  int c, control_rc;
 
 
   // Collect command-line parameters
@@ -243,49 +271,45 @@ int main(int argc, char *argv[])
 	  break;
 
 	case 'r':
-	  if (!display) {
-	    kprintf ("Could not connect to the XServer\n");
-	    kprintf ("Is the DISPLAY variable correctly set?\n\n");
-	    exit (1);
+	  kprintf ("Sending a refresh signal to Kdesk\n");
+	  if ((control_rc = send_control_command ("reload", false)) != -1) {
+	    exit (control_rc);
 	  }
 
-	  kprintf ("Sending a refresh signal to Kdesk\n");
+	  display = open_display_or_exit();
 	  reload_configuration(display);
 	  close_display(display);
 	  exit (0);
 
 	case 'i':
-	  if (!display) {
-	    kprintf ("Could not connect to the XServer\n");
-	    kprintf ("Is the DISPLAY variable correctly set?\n\n");
-	    exit (1);
+	  kprintf ("Sending an icon refresh signal to Kdesk\n");
+	  if ((control_rc = send_control_command ("reload-icons", false)) != -1) {
+	    exit (control_rc);
 	  }
 
-	  kprintf ("Sending an icon refresh signal to Kdesk\n");
+	  display = open_display_or_exit();
 	  reload_icons(display);
 	  close_display(display);
 	  exit (0);
 
 	case 'a':
-	  if (!display) {
-	    kprintf ("Could not connect to the XServer\n");
-	    kprintf ("Is the DISPLAY variable correctly set?\n\n");
-	    exit (1);
+	  kprintf ("Triggering icon hook with message: %s\n\n", optarg);
+	  if ((control_rc = send_control_command (string("alert ") + optarg, false)) != -1) {
+	    exit (control_rc);
 	  }
 
-	  kprintf ("Triggering icon hook with message: %s\n\n", optarg);
+	  display = open_display_or_exit();
 	  trigger_icon_hook(display, optarg);
 	  close_display(display);
 	  exit (0);
 
 	case 'j':
-	  if (!display) {
-	    kprintf ("Could not connect to the XServer\n");
-	    kprintf ("Is the DISPLAY variable correctly set?\n\n");
-	    exit (1);
+	  kprintf ("Querying information for icon name: %s\n\n", optarg);
+	  if ((control_rc = send_control_command (string("query icon ") + optarg, true)) != -1) {
+	    exit (control_rc);
 	  }
 
-	  kprintf ("Querying information for icon name: %s\n\n", optarg);
+	  display = open_display_or_exit();
 	  if(print_json_icon_placement(display, optarg) == true) {
 	    exit(0);
 	  }
@@ -297,23 +321,22 @@ int main(int argc, char *argv[])
             break;
 
 	case 'q':
-	  if (!display) {
-	    kprintf ("Could not connect to the XServer\n");
-	    kprintf ("Is the DISPLAY variable correctly set?\n\n");
-	    exit (1);
+	  if (send_control_command ("query running", false) == 0) {
+	    kprintf ("Kdesk is running on this Display\n");
+	    exit (0);
+	  }
+
+	  // Kdesk versions without a control socket are found through their control window
+	  display = open_display_or_exit();
+	  if (dsk.find_kdesk_control_window (display)) {
+	    kprintf ("Kdesk is running on this Display\n");
+	    close_display(display);
+	    exit (0);
 	  }
 	  else {
-	    //dsk.initialize (&bg);
-	    if (dsk.find_kdesk_control_window (display)) {
-	      kprintf ("Kdesk is running on this Display\n");
-              close_display(display);
-	      exit (0);
-	    }
-	    else {
-	      kprintf ("Kdesk is not running on this Display\n");
-              close_display(display);
-	      exit (-1);
-	    }
+	    kprintf ("Kdesk is not running on this Display\n");
+	    close_display(display);
+	    exit (-1);
 	  }
 	}
     }
@@ -373,11 +396,20 @@ int main(int argc, char *argv[])
     log ("Warning: no icons have been loaded");
   }
 
+  // All events are attended from a single reactor loop. It needs to block the signals it handles
+  // before any thread is created, so that they are only received through its descriptor.
+  Reactor reactor;
+  if (!reactor.initialize()) {
+    kprintf ("could not initialize the event loop\n");
+    exit (1);
+  }
+
   // Kdesk is a multithreaded X app
   rc = XInitThreads();
   log1 ("XInitThreads rc", rc);
 
   // Connect to the X Server
+  display = get_current_display();
   if (!display) {
     char *env_display = getenv ("DISPLAY");
     kprintf ("could not connect to X display\n");
@@ -403,7 +435,7 @@ int main(int argc, char *argv[])
   // Play sound once the background is displayed
   // Only if we are running on the first available display,
   // Otherwise disable sound - VNC remote sessions
-  Sound ksound(&conf);
+  Sound ksound(&conf, &reactor);
   if (!(strncmp (DisplayString(display), DEFAULT_DISPLAY, strlen (DEFAULT_DISPLAY)))) {
     ksound.init();
     ksound.play_sound("soundwelcome");
@@ -420,13 +452,9 @@ int main(int argc, char *argv[])
     exit (1);
   }
   else {
-    dsk.initialize(display, &conf, &ksound);
+    dsk.initialize(display, &conf, &ksound, &reactor);
   }
 
-  // Register signal handlers to provide for external wake-ups
-  signal (SIGUSR1, signal_callback_handler);
-  signal (SIGUSR2, signal_callback_handler);
-
   // Delay desktop startup if requested
   unsigned long startup_delay=0L;
   startup_delay = conf.get_config_int ("background.delay");
@@ -448,7 +476,9 @@ int main(int argc, char *argv[])
     else {
       memset(&ksaver_data, 0, sizeof(KSAVER_DATA));
 
-      ksaver_data.display_name  = NULL;   // NULL means the currently attached display
+      ksaver_data.display       = display;
+      ksaver_data.reactor       = &reactor;
+      ksaver_data.hookpool      = dsk.get_hookpool();
       ksaver_data.idle_timeout  = conf.get_config_int("screensavertimeout");
       ksaver_data.saver_program = strdup(conf.get_config_string("screensaverprogram").c_str());
       ksaver_data.saver_hooks   = strdup(conf.get_config_string("iconhook").c_str());
@@ -466,6 +496,9 @@ int main(int argc, char *argv[])
 
         // terminate gracefully via user signal SIGUSR1
         kprintf ("terminating screensaver mode gracefully\n");
+        if (ksaver_data.info) {
+            XFree(ksaver_data.info);
+        }
         free(ksaver_data.saver_program);
         free(ksaver_data.saver_hooks);
         exit(0);
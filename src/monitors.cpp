@@ -0,0 +1,144 @@
+//
+// monitors.cpp  -  Screen areas of each monitor, as reported by the RandR extension
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// A projector plugged next to the classroom screen makes the root window span both of them.
+// The wallpaper is drawn for each CRTC and the icon grid goes on the primary one,
+// rather than stretched across the whole root window.
+//
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+
+#include "monitors.h"
+#include "logging.h"
+
+bool Monitors::select_changes (Display *display, int *event_base)
+{
+  // Asks the XServer to tell when monitors are plugged, unplugged, moved or change resolution.
+  // The event base is -1 if the server has no RandR extension.
+  int error_base, major=0, minor=0;
+
+  *event_base = -1;
+  if (!XRRQueryExtension (display, event_base, &error_base) || !XRRQueryVersion (display, &major, &minor)) {
+    log ("RandR extension not available, monitor changes will not be followed");
+    *event_base = -1;
+    return false;
+  }
+
+  int mask = RRScreenChangeNotifyMask;
+  if (major > 1 || minor >= 2) {
+    mask |= RRCrtcChangeNotifyMask | RROutputChangeNotifyMask;
+  }
+
+  XRRSelectInput (display, DefaultRootWindow(display), mask);
+  log3 ("Following monitor changes (RandR major, minor, event base)", major, minor, *event_base);
+  return true;
+}
+
+bool Monitors::is_change_event (Display *display, int event_base, XEvent *ev)
+{
+  // Returns true for RandR notifications. Xlib is told about them too,
+  // so the screen size it reports follows the new configuration.
+  if (event_base < 0 ||
+      (ev->type != event_base + RRScreenChangeNotify && ev->type != event_base + RRNotify)) {
+    return false;
+  }
+
+  XRRUpdateConfiguration (ev);
+  return true;
+}
+
+int Monitors::query (Display *display, std::vector <MONITOR> &monitors)
+{
+  // Fills in the area of each lit CRTC and returns the index of the primary one.
+  // Without RandR 1.2, or with no CRTC lit, the whole screen is taken as one monitor.
+  int screen = DefaultScreen(display);
+  Window root = RootWindow(display, screen);
+  int event_base, error_base, major=0, minor=0;
+
+  monitors.clear();
+  if (XRRQueryExtension (display, &event_base, &error_base) && XRRQueryVersion (display, &major, &minor) &&
+      (major > 1 || minor >= 2)) {
+
+    // Servers before RandR 1.3 have no primary output, and probe the outputs to answer
+    bool current = (major > 1 || minor >= 3);
+    XRRScreenResources *resources = (current ? XRRGetScreenResourcesCurrent (display, root) :
+                                     XRRGetScreenResources (display, root));
+    RROutput primary = (current ? XRRGetOutputPrimary (display, root) : None);
+    RRCrtc primary_crtc = None;
+
+    if (resources && primary != None) {
+      XRROutputInfo *output = XRRGetOutputInfo (display, resources, primary);
+      if (output) {
+        primary_crtc = output->crtc;
+        XRRFreeOutputInfo (output);
+      }
+    }
+
+    for (int n=0; resources && n < resources->ncrtc; n++) {
+      XRRCrtcInfo *crtc = XRRGetCrtcInfo (display, resources, resources->crtcs[n]);
+      if (!crtc) {
+        continue;
+      }
+
+      // CRTCs which are off have no mode, mirrored ones show the same area
+      if (crtc->mode != None && crtc->width > 0 && crtc->height > 0) {
+        MONITOR monitor;
+        monitor.x = crtc->x;
+        monitor.y = crtc->y;
+        monitor.width = crtc->width;
+        monitor.height = crtc->height;
+        monitor.primary = (resources->crtcs[n] == primary_crtc);
+
+        bool mirrored = false;
+        for (unsigned int m=0; m < monitors.size(); m++) {
+          if (monitors[m].x == monitor.x && monitors[m].y == monitor.y &&
+              monitors[m].width == monitor.width && monitors[m].height == monitor.height) {
+            monitors[m].primary = (monitors[m].primary || monitor.primary);
+            mirrored = true;
+          }
+        }
+
+        if (!mirrored) {
+          monitors.push_back (monitor);
+        }
+      }
+
+      XRRFreeCrtcInfo (crtc);
+    }
+
+    if (resources) {
+      XRRFreeScreenResources (resources);
+    }
+  }
+
+  if (!monitors.size()) {
+    MONITOR monitor;
+    monitor.x = monitor.y = 0;
+    monitor.width = DisplayWidth(display, screen);
+    monitor.height = DisplayHeight(display, screen);
+    monitor.primary = true;
+    monitors.push_back (monitor);
+  }
+
+  // Without a primary output the first CRTC is taken
+  int primary_index = 0;
+  for (unsigned int n=0; n < monitors.size(); n++) {
+    if (monitors[n].primary) {
+      primary_index = n;
+      break;
+    }
+  }
+
+  for (unsigned int n=0; n < monitors.size(); n++) {
+    monitors[n].primary = ((int) n == primary_index);
+    log4 ("Monitor area (x, y, width, height)", monitors[n].x, monitors[n].y, monitors[n].width, monitors[n].height);
+  }
+
+  return primary_index;
+}
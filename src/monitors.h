@@ -0,0 +1,27 @@
+//
+// monitors.h  -  Screen areas of each monitor, as reported by the RandR extension
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <vector>
+
+#include <X11/Xlib.h>
+
+// Area of the screen scanned out by one CRTC, in root window coordinates
+typedef struct _monitor {
+  int x, y;
+  int width, height;
+  bool primary;             // Icons are laid out on the primary monitor
+} MONITOR;
+
+class Monitors
+{
+ public:
+  static bool select_changes (Display *display, int *event_base);
+  static bool is_change_event (Display *display, int event_base, XEvent *ev);
+  static int query (Display *display, std::vector <MONITOR> &monitors);
+};
@@ -0,0 +1,306 @@
+//
+// reactor.cpp  -  Single event loop for X, signals, timers and child processes
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Everything kdesk waits for is a file descriptor watched by one epoll set: the XServer
+// connection, a signalfd for the signals kdesk handles, a timerfd per periodic job,
+// and SIGCHLD to collect the processes it starts. Callbacks run on the main thread,
+// so there is no need for signal handlers or sleeping threads to talk to the desktop.
+//
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+
+#include "reactor.h"
+#include "logging.h"
+
+Reactor::Reactor (void)
+{
+  epfd = -1;
+  sigfd = -1;
+  sigemptyset (&sigmask);
+}
+
+Reactor::~Reactor (void)
+{
+  std::map <int, REACTOR_FD>::iterator it;
+  for (it=fds.begin(); it != fds.end(); ++it) {
+    if (it->second.is_timer) {
+      close (it->first);
+    }
+  }
+
+  if (sigfd != -1) {
+    close (sigfd);
+  }
+
+  if (epfd != -1) {
+    close (epfd);
+  }
+}
+
+bool Reactor::initialize (void)
+{
+  // Must be called before any thread is created, so that they all inherit the blocked signals
+  epfd = epoll_create1 (EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    log1 ("Could not create the epoll descriptor (errno)", errno);
+    return false;
+  }
+
+  // Children are reaped from the loop, SIGCHLD must not be ignored or the kernel discards it
+  signal (SIGCHLD, SIG_DFL);
+  sigaddset (&sigmask, SIGCHLD);
+  return update_signalfd();
+}
+
+bool Reactor::update_signalfd (void)
+{
+  // Block the signals we listen for, so they are only delivered through the descriptor
+  if (sigprocmask (SIG_BLOCK, &sigmask, NULL) == -1) {
+    log1 ("Could not block signals (errno)", errno);
+    return false;
+  }
+
+  bool created = (sigfd == -1);
+  sigfd = signalfd (sigfd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (sigfd == -1) {
+    log1 ("Could not create the signal descriptor (errno)", errno);
+    return false;
+  }
+
+  if (created) {
+    struct epoll_event ev;
+    memset (&ev, 0x00, sizeof (ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sigfd;
+    if (epoll_ctl (epfd, EPOLL_CTL_ADD, sigfd, &ev) == -1) {
+      log1 ("Could not watch the signal descriptor (errno)", errno);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool Reactor::add_fd (int fd, unsigned int events, REACTOR_FD_CALLBACK callback, void *data)
+{
+  struct epoll_event ev;
+  memset (&ev, 0x00, sizeof (ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    log2 ("Could not watch descriptor (fd, errno)", fd, errno);
+    return false;
+  }
+
+  REACTOR_FD rfd;
+  memset (&rfd, 0x00, sizeof (rfd));
+  rfd.callback = callback;
+  rfd.data = data;
+  rfd.is_timer = false;
+  fds[fd] = rfd;
+  return true;
+}
+
+bool Reactor::remove_fd (int fd)
+{
+  if (fds.find (fd) == fds.end()) {
+    return false;
+  }
+
+  epoll_ctl (epfd, EPOLL_CTL_DEL, fd, NULL);
+  fds.erase (fd);
+  return true;
+}
+
+int Reactor::add_timer (unsigned long first_ms, unsigned long interval_ms, REACTOR_TIMER_CALLBACK callback, void *data)
+{
+  // Returns a timer id to remove it later, or -1 on error.
+  // An interval of zero means the timer fires only once.
+  int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (tfd == -1) {
+    log1 ("Could not create a timer descriptor (errno)", errno);
+    return -1;
+  }
+
+  struct itimerspec its;
+  memset (&its, 0x00, sizeof (its));
+  its.it_value.tv_sec = first_ms / 1000;
+  its.it_value.tv_nsec = (first_ms % 1000) * 1000000L;
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+  // A zero expiration would disarm the timer, fire as soon as possible instead
+  if (!first_ms) {
+    its.it_value.tv_nsec = 1;
+  }
+
+  if (timerfd_settime (tfd, 0, &its, NULL) == -1 || !add_fd (tfd, EPOLLIN, NULL, data)) {
+    log1 ("Could not arm the timer (errno)", errno);
+    close (tfd);
+    return -1;
+  }
+
+  fds[tfd].is_timer = true;
+  fds[tfd].timer_callback = callback;
+  log3 ("Timer added (id, first ms, interval ms)", tfd, first_ms, interval_ms);
+  return tfd;
+}
+
+bool Reactor::remove_timer (int timer_id)
+{
+  if (!remove_fd (timer_id)) {
+    return false;
+  }
+
+  close (timer_id);
+  return true;
+}
+
+bool Reactor::add_signal (int signum, REACTOR_SIGNAL_CALLBACK callback, void *data)
+{
+  REACTOR_SIGNAL rs;
+  rs.callback = callback;
+  rs.data = data;
+  signals[signum] = rs;
+
+  sigaddset (&sigmask, signum);
+  return update_signalfd();
+}
+
+bool Reactor::watch_child (pid_t pid, REACTOR_CHILD_CALLBACK callback, void *data)
+{
+  // The child is reaped when it terminates, then the callback is told about its exit status
+  REACTOR_CHILD rc;
+  rc.callback = callback;
+  rc.data = data;
+  children[pid] = rc;
+  return true;
+}
+
+pid_t Reactor::spawn (const char *cmdline, bool new_session, REACTOR_CHILD_CALLBACK callback, void *data)
+{
+  // Runs a shell command line asynchronously, the callback is optional
+  pid_t pid = fork();
+  if (pid == 0) {
+    // We are in the child process, it must not inherit the signals we keep blocked
+    sigset_t empty;
+    sigemptyset (&empty);
+    sigprocmask (SIG_SETMASK, &empty, NULL);
+
+    if (new_session) {
+      setsid ();
+    }
+
+    execl ("/bin/sh", "/bin/sh", "-c", cmdline, (char *) NULL);
+    _exit (127); // rather than exit() because the latter could interfere with parent's atexit()
+  }
+  else if (pid == -1) {
+    log2 ("fork call failed (errno, command)", errno, cmdline);
+    return -1;
+  }
+
+  log2 ("Process started (pid, command)", pid, cmdline);
+  watch_child (pid, callback, data);
+  return pid;
+}
+
+void Reactor::read_signals (void)
+{
+  struct signalfd_siginfo si;
+
+  while (read (sigfd, &si, sizeof (si)) == sizeof (si)) {
+    log1 ("Received signal", si.ssi_signo);
+    if (si.ssi_signo == SIGCHLD) {
+      // Several children may have finished behind a single SIGCHLD
+      reap_children();
+      continue;
+    }
+
+    std::map <int, REACTOR_SIGNAL>::iterator it = signals.find (si.ssi_signo);
+    if (it != signals.end() && it->second.callback) {
+      it->second.callback (si.ssi_signo, it->second.data);
+    }
+  }
+}
+
+void Reactor::reap_children (void)
+{
+  // Only wait for the processes we started, others are not ours to collect
+  std::vector <pid_t> finished;
+  std::vector <int> statuses;
+
+  std::map <pid_t, REACTOR_CHILD>::iterator it;
+  for (it=children.begin(); it != children.end(); ++it) {
+    int status=0;
+    if (waitpid (it->first, &status, WNOHANG) == it->first) {
+      finished.push_back (it->first);
+      statuses.push_back (status);
+    }
+  }
+
+  // Callbacks may start new children, so they are called once the map is no longer walked
+  for (size_t n=0; n < finished.size(); n++) {
+    REACTOR_CHILD child = children[finished[n]];
+    children.erase (finished[n]);
+    log2 ("Process finished (pid, status)", finished[n], statuses[n]);
+    if (child.callback) {
+      child.callback (finished[n], statuses[n], child.data);
+    }
+  }
+}
+
+int Reactor::dispatch (int timeout_ms)
+{
+  // Waits for ready descriptors, up to timeout_ms (-1 waits forever), and runs their callbacks.
+  // Returns the number of descriptors that were ready.
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  int nready = epoll_wait (epfd, events, REACTOR_MAX_EVENTS, timeout_ms);
+  if (nready == -1) {
+    if (errno != EINTR) {
+      log1 ("epoll_wait failed (errno)", errno);
+    }
+    return 0;
+  }
+
+  for (int n=0; n < nready; n++) {
+    int fd = events[n].data.fd;
+    if (fd == sigfd) {
+      read_signals();
+      continue;
+    }
+
+    // A previous callback on this same round might have removed the descriptor
+    std::map <int, REACTOR_FD>::iterator it = fds.find (fd);
+    if (it == fds.end()) {
+      continue;
+    }
+
+    REACTOR_FD rfd = it->second;
+    if (rfd.is_timer) {
+      uint64_t expirations=0;
+      if (read (fd, &expirations, sizeof (expirations)) == sizeof (expirations) && rfd.timer_callback) {
+        rfd.timer_callback (fd, rfd.data);
+      }
+    }
+    else if (rfd.callback) {
+      rfd.callback (fd, events[n].events, rfd.data);
+    }
+  }
+
+  return nready;
+}
@@ -0,0 +1,71 @@
+//
+// reactor.h  -  Single event loop for X, signals, timers and child processes
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <map>
+#include <signal.h>
+#include <sys/types.h>
+
+// Maximum number of ready descriptors collected on each loop iteration
+#define REACTOR_MAX_EVENTS 16
+
+typedef void (*REACTOR_FD_CALLBACK) (int fd, unsigned int events, void *data);
+typedef void (*REACTOR_TIMER_CALLBACK) (int timer_id, void *data);
+typedef void (*REACTOR_SIGNAL_CALLBACK) (int signum, void *data);
+typedef void (*REACTOR_CHILD_CALLBACK) (pid_t pid, int status, void *data);
+
+typedef struct _reactor_fd {
+  REACTOR_FD_CALLBACK callback;
+  void *data;
+  bool is_timer;
+  REACTOR_TIMER_CALLBACK timer_callback;
+} REACTOR_FD;
+
+typedef struct _reactor_signal {
+  REACTOR_SIGNAL_CALLBACK callback;
+  void *data;
+} REACTOR_SIGNAL;
+
+typedef struct _reactor_child {
+  REACTOR_CHILD_CALLBACK callback;
+  void *data;
+} REACTOR_CHILD;
+
+class Reactor
+{
+ private:
+  int epfd;
+  int sigfd;
+  sigset_t sigmask;
+  std::map <int, REACTOR_FD> fds;
+  std::map <int, REACTOR_SIGNAL> signals;
+  std::map <pid_t, REACTOR_CHILD> children;
+
+  bool update_signalfd (void);
+  void read_signals (void);
+  void reap_children (void);
+
+ public:
+  Reactor (void);
+  virtual ~Reactor (void);
+
+  bool initialize (void);
+
+  bool add_fd (int fd, unsigned int events, REACTOR_FD_CALLBACK callback, void *data);
+  bool remove_fd (int fd);
+
+  int add_timer (unsigned long first_ms, unsigned long interval_ms, REACTOR_TIMER_CALLBACK callback, void *data);
+  bool remove_timer (int timer_id);
+
+  bool add_signal (int signum, REACTOR_SIGNAL_CALLBACK callback, void *data);
+
+  bool watch_child (pid_t pid, REACTOR_CHILD_CALLBACK callback, void *data);
+  pid_t spawn (const char *cmdline, bool new_session, REACTOR_CHILD_CALLBACK callback, void *data);
+
+  int dispatch (int timeout_ms);
+};
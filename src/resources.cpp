@@ -0,0 +1,291 @@
+//
+// resources.cpp  -  Desktop-wide pool of fonts, colors, cursors and windows shared by all icons
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// All icons render their titles with the same handful of fonts and colors, which come
+// from global kdeskrc settings. Opening them once per icon means one fontconfig pattern match
+// and several XServer requests for each one. The pool hands out reference counted resources
+// instead, and keeps them across icon reloads until the font settings change.
+//
+// Icon windows are all created alike, a few unmapped ones are kept when icons go away,
+// so flipping grid pages moves and resizes existing windows instead of creating new ones.
+//
+
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+#include <X11/cursorfont.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "configuration.h"
+#include "resources.h"
+#include "logging.h"
+
+ResourcePool::ResourcePool (void)
+{
+  display = NULL;
+}
+
+ResourcePool::~ResourcePool (void)
+{
+  // The display connection may already be closed at this point,
+  // the XServer reclaims fonts, colors and cursors along with it.
+}
+
+bool ResourcePool::validate (Display *new_display, Configuration *pconf)
+{
+  // Collect all kdeskrc settings that affect pooled resources.
+  // If any of them changed since the pool was filled, discard it.
+  string new_signature = pconf->get_config_string ("fontname");
+  new_signature += "|" + pconf->get_config_string ("bold");
+  new_signature += "|" + pconf->get_config_string ("fontsize");
+  new_signature += "|" + pconf->get_config_string ("subtitlefontsize");
+  new_signature += "|" + pconf->get_config_string ("fontcolor");
+  new_signature += "|" + pconf->get_config_string ("shadowcolor");
+  new_signature += "|" + pconf->get_config_string ("mousehovericon");
+
+  if (new_display == display && new_signature == signature) {
+    log ("Font settings unchanged, keeping the resource pool");
+    return false;
+  }
+
+  log1 ("Font settings changed, rebuilding the resource pool", new_signature);
+  purge();
+  display = new_display;
+  signature = new_signature;
+  return true;
+}
+
+void ResourcePool::purge (void)
+{
+  // Resources still in use by an icon are leaked rather than pulled from under its feet
+  if (!display) {
+    return;
+  }
+
+  std::map <std::string, POOL_FONT>::iterator itf;
+  for (itf=fonts.begin(); itf != fonts.end(); ++itf) {
+    if (itf->second.refs) {
+      log2 ("Warning: font still in use during purge (key, refs)", itf->first, itf->second.refs);
+    }
+    else if (itf->second.font) {
+      XftFontClose (display, itf->second.font);
+    }
+  }
+  fonts.clear();
+
+  std::map <std::string, POOL_COLOR>::iterator itc;
+  for (itc=colors.begin(); itc != colors.end(); ++itc) {
+    if (itc->second.refs) {
+      log2 ("Warning: color still in use during purge (key, refs)", itc->first, itc->second.refs);
+    }
+    else if (itc->second.allocated) {
+      XftColorFree (display, DefaultVisual(display, DefaultScreen(display)),
+                    DefaultColormap(display, DefaultScreen(display)), &itc->second.color);
+    }
+  }
+  colors.clear();
+
+  std::map <int, POOL_CURSOR>::iterator itr;
+  for (itr=cursors.begin(); itr != cursors.end(); ++itr) {
+    if (itr->second.refs) {
+      log2 ("Warning: cursor still in use during purge (id, refs)", itr->first, itr->second.refs);
+    }
+    else if (itr->second.cursor) {
+      XFreeCursor (display, itr->second.cursor);
+    }
+  }
+  cursors.clear();
+
+  for (size_t n=0; n < windows.size(); n++) {
+    XRenderFreePicture (display, windows[n].pic);
+    XDestroyWindow (display, windows[n].win);
+  }
+  windows.clear();
+}
+
+XftFont *ResourcePool::acquire_font (std::string family, int size)
+{
+  char key[256];
+
+  if (!display) {
+    return NULL;
+  }
+
+  snprintf (key, sizeof(key), "%s/%d", family.c_str(), size);
+  std::map <std::string, POOL_FONT>::iterator it = fonts.find(key);
+  if (it == fonts.end()) {
+    POOL_FONT pf;
+    log2 ("opening font name and point size", family, size);
+    pf.font = XftFontOpen (display, DefaultScreen(display),
+                           XFT_FAMILY, XftTypeString, family.c_str(),
+                           XFT_SIZE, XftTypeDouble, (double) size,
+                           NULL);
+    pf.refs = 0;
+    if (!pf.font) {
+      log1 ("Could not create font!", key);
+    }
+
+    it = fonts.insert (std::pair<std::string, POOL_FONT>(key, pf)).first;
+  }
+
+  if (it->second.font) {
+    it->second.refs++;
+  }
+
+  return it->second.font;
+}
+
+void ResourcePool::release_font (XftFont *font)
+{
+  std::map <std::string, POOL_FONT>::iterator it;
+  for (it=fonts.begin(); font && it != fonts.end(); ++it) {
+    if (it->second.font == font) {
+      if (it->second.refs > 0) {
+        it->second.refs--;
+      }
+      return;
+    }
+  }
+}
+
+XftColor *ResourcePool::acquire_color (std::string name)
+{
+  if (!display) {
+    return NULL;
+  }
+
+  std::map <std::string, POOL_COLOR>::iterator it = colors.find(name);
+  if (it == colors.end()) {
+    POOL_COLOR pc;
+    memset (&pc.color, 0x00, sizeof(pc.color));
+    pc.allocated = XftColorAllocName (display, DefaultVisual(display, DefaultScreen(display)),
+                                      DefaultColormap(display, DefaultScreen(display)),
+                                      name.c_str(), &pc.color);
+    pc.refs = 0;
+    log2 ("XftColorAllocName (color, bool)", name, pc.allocated);
+
+    it = colors.insert (std::pair<std::string, POOL_COLOR>(name, pc)).first;
+  }
+
+  it->second.refs++;
+  return &it->second.color;
+}
+
+void ResourcePool::release_color (XftColor *color)
+{
+  std::map <std::string, POOL_COLOR>::iterator it;
+  for (it=colors.begin(); color && it != colors.end(); ++it) {
+    if (&it->second.color == color) {
+      if (it->second.refs > 0) {
+        it->second.refs--;
+      }
+      return;
+    }
+  }
+}
+
+Cursor ResourcePool::acquire_cursor (int cursor_id)
+{
+  if (!display) {
+    return 0L;
+  }
+
+  std::map <int, POOL_CURSOR>::iterator it = cursors.find(cursor_id);
+  if (it == cursors.end()) {
+    POOL_CURSOR pr;
+    pr.cursor = XCreateFontCursor (display, cursor_id);
+    pr.refs = 0;
+    it = cursors.insert (std::pair<int, POOL_CURSOR>(cursor_id, pr)).first;
+  }
+
+  it->second.refs++;
+  return it->second.cursor;
+}
+
+void ResourcePool::release_cursor (Cursor cursor)
+{
+  std::map <int, POOL_CURSOR>::iterator it;
+  for (it=cursors.begin(); cursor && it != cursors.end(); ++it) {
+    if (it->second.cursor == cursor) {
+      if (it->second.refs > 0) {
+        it->second.refs--;
+      }
+      return;
+    }
+  }
+}
+
+Window ResourcePool::acquire_window (int x, int y, int width, int height, Picture *pic)
+{
+  if (!display) {
+    return None;
+  }
+
+  if (windows.size()) {
+    POOL_WINDOW pw = windows.back();
+    windows.pop_back();
+    XMoveResizeWindow (display, pw.win, x, y, width, height);
+    *pic = pw.pic;
+    return pw.win;
+  }
+
+  // In debug version, icons are drawn with a black frame
+  #ifdef DEBUG
+  int border = 1;
+  #else
+  int border = 0;
+  #endif
+
+  XSetWindowAttributes attr;
+  attr.background_pixmap = ParentRelative;
+  attr.backing_store = Always;
+  attr.event_mask = ExposureMask | EnterWindowMask | LeaveWindowMask;
+  attr.override_redirect = True;
+
+  Window win = XCreateWindow (display, DefaultRootWindow(display), x, y,
+                              width, height, border,
+                              CopyFromParent, CopyFromParent, CopyFromParent,
+                              CWBackPixmap|CWBackingStore|CWOverrideRedirect|CWEventMask,
+                              &attr );
+  if (win == None) {
+    return None;
+  }
+
+  // Text rasters are composited on the window through XRender
+  Visual *vis = DefaultVisual(display, DefaultScreen(display));
+  *pic = XRenderCreatePicture (display, win, XRenderFindVisualFormat (display, vis), 0, NULL);
+
+  XSelectInput(display, win, ButtonPressMask | ButtonReleaseMask | PointerMotionMask | ExposureMask | EnterWindowMask | LeaveWindowMask);
+  return win;
+}
+
+void ResourcePool::release_window (Window win, Picture pic)
+{
+  if (!display || win == None) {
+    return;
+  }
+
+  if (windows.size() < POOL_MAX_WINDOWS) {
+    POOL_WINDOW pw;
+    pw.win = win;
+    pw.pic = pic;
+    XUnmapWindow (display, win);
+
+    // Drop the kdesk-<icon> name, so "kdesk -j" does not find a pooled window
+    XStoreName (display, win, "");
+    windows.push_back (pw);
+    return;
+  }
+
+  if (pic != None) {
+    XRenderFreePicture (display, pic);
+  }
+
+  XDestroyWindow (display, win);
+}
@@ -0,0 +1,63 @@
+//
+// resources.h  -  Desktop-wide pool of fonts, colors, cursors and windows shared by all icons
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Unmapped icon windows kept for reuse when icons go away, as on grid page flips
+#define POOL_MAX_WINDOWS  32
+
+typedef struct _pool_font {
+  XftFont *font;
+  int refs;
+} POOL_FONT;
+
+typedef struct _pool_color {
+  XftColor color;
+  bool allocated;
+  int refs;
+} POOL_COLOR;
+
+typedef struct _pool_cursor {
+  Cursor cursor;
+  int refs;
+} POOL_CURSOR;
+
+typedef struct _pool_window {
+  Window win;
+  Picture pic;                  // XRender picture icons composite their text through
+} POOL_WINDOW;
+
+class ResourcePool
+{
+ private:
+  Display *display;
+  std::map <std::string, POOL_FONT> fonts;
+  std::map <std::string, POOL_COLOR> colors;
+  std::map <int, POOL_CURSOR> cursors;
+  std::vector <POOL_WINDOW> windows;
+  std::string signature;
+
+ public:
+  ResourcePool (void);
+  virtual ~ResourcePool (void);
+
+  bool validate (Display *display, Configuration *pconf);
+  void purge (void);
+
+  XftFont *acquire_font (std::string family, int size);
+  void release_font (XftFont *font);
+  XftColor *acquire_color (std::string name);
+  void release_color (XftColor *color);
+  Cursor acquire_cursor (int cursor_id);
+  void release_cursor (Cursor cursor);
+  Window acquire_window (int x, int y, int width, int height, Picture *pic);
+  void release_window (Window win, Picture pic);
+};
@@ -8,23 +8,20 @@
 //
 
 #include <stdlib.h>
-#include <pthread.h>
 
 #include "configuration.h"
 #include "logging.h"
 #include "sound.h"
+#include "reactor.h"
 
-Sound::Sound (Configuration *loaded_conf)
+Sound::Sound (Configuration *loaded_conf, Reactor *reactor)
 {
   configuration = loaded_conf;
-  playing = false;
+  preactor = reactor;
 }
 
 Sound::~Sound (void)
 {
-  if (playing) {
-    pthread_join(t, NULL);
-  }
 }
 
 bool Sound::init(void)
@@ -37,56 +34,33 @@ bool Sound::terminate(void)
   return true;
 }
 
-bool Sound::play(void)
+void Sound::play_finished(pid_t pid, int status, void *data)
 {
-  bool success=false;
-  int rc;
-
-  if (!tune || ! (tune->size() > 0)) {
-    log2 ("no tune file set, or a play is in progress (tune, playing)", tune, playing);
-  }
-  else {
-    // Call external tool with the sound file
-    playing = true;
-
-    string sound_cmdline;
-    sound_cmdline  = "/usr/bin/aplay ";
-    sound_cmdline += tune->c_str();
-    sound_cmdline += " &";
-    log1 ("Playing sound cmdline:", sound_cmdline);
-
-    // protect against eventual race condition
-    tune_tmp=tune;
-    tune = NULL;
-    delete (tune_tmp);
-
-    rc = system (sound_cmdline.c_str());
-    log1 ("Sound played (return code)", rc);
-    success = (rc == 0 ? true : false);
-    playing = false;
-  }
-
-  return success;
+  // The reactor collects the player process when the sound has finished
+  log2 ("Sound played (pid, status)", pid, status);
 }
 
 void Sound::play_sound(string sound_name)
 {
-  int rc;
   string sound_cmdline;
 
   // Do not play anything if sound is disabled in kdeskrc
-  if (!(configuration->get_config_string ("enablesound") == "true")) {
+  if (!configuration->get_settings().enable_sound) {
       return;
   }
 
-  if (playing == true) {
-    log ("A sound is currently being played");
-  }
-  else {
-    // sound name is the key name specified in the configuration file
-    tune = new std::string (configuration->get_config_string (sound_name));
-    pthread_create (&t, NULL, InternalThreadEntryFunc, this);
+  // sound name is the key name specified in the configuration file
+  string tune = configuration->get_config_string (sound_name);
+  if (!tune.size()) {
+    log1 ("no tune file set", sound_name);
+    return;
   }
 
+  // Call external tool with the sound file, it plays in the background
+  // while the reactor waits for it to finish, no need for a thread.
+  sound_cmdline  = "/usr/bin/aplay ";
+  sound_cmdline += tune;
+  log1 ("Playing sound cmdline:", sound_cmdline);
+  preactor->spawn (sound_cmdline.c_str(), false, play_finished, this);
   return;
 }
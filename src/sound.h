@@ -8,28 +8,23 @@
 //
 
 #include <string>
+#include <sys/types.h>
+
+class Reactor;
 
 class Sound
 {
  private:
   Configuration *configuration;
-  std::string * volatile tune;
-  std::string *tune_tmp;
-  pthread_t t;
-  bool playing;
+  Reactor *preactor;
 
  public:
-  Sound (Configuration *loaded_conf);
+  Sound (Configuration *loaded_conf, Reactor *reactor);
   virtual ~Sound (void);
 
   bool init(void);
 
-  static void * InternalThreadEntryFunc(void * This)
-  {
-    ((Sound *)This)->play(); return NULL;
-  }
-
-  bool play(void);
+  static void play_finished(pid_t pid, int status, void *data);
   void play_sound(std::string sound_name);
   bool terminate(void);
 };
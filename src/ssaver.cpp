@@ -9,12 +9,14 @@
 
 #include "X11/extensions/scrnsaver.h"
 
-#include <pthread.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "logging.h"
 #include "ssaver.h"
+#include "reactor.h"
+#include "hookpool.h"
 
 #include <sys/wait.h>
 
@@ -39,9 +41,9 @@ int get_current_console (void)
   return current_tty;
 }
 
-int execute_hook(const char *hook_script, const char *params)
+bool execute_hook(PKSAVER_DATA pdata, const char *params, HOOKPOOL_JOB_CALLBACK callback)
 {
-  int rc=-1;
+  bool queued=false;
   size_t cmdline_bytes=1024 * sizeof(char);
   char *chcmdline = (char *) calloc (1, cmdline_bytes);
 
@@ -49,57 +51,119 @@ int execute_hook(const char *hook_script, const char *params)
   // cannot accidentally create an infinite loop.
   const char *norec = "export KDESK_NO_RECURSE=1";
 
-  if (chcmdline != NULL && hook_script != NULL) {
+  if (chcmdline != NULL && pdata->saver_hooks != NULL) {
     snprintf (chcmdline, cmdline_bytes, "/bin/bash -c \"%s; %s %s\"",
 	      norec,
-	      hook_script,
+	      pdata->saver_hooks,
 	      (params ? params : ""));
-    log1 ("Executing screen saver hook:", chcmdline);
+    log1 ("Queueing screen saver hook:", chcmdline);
 
-    signal(SIGCHLD, SIG_DFL);
-    rc = system (chcmdline);
-    signal(SIGCHLD, SIG_IGN);
-
-    log2 ("Screen saver hook returns with RC, WEXITSTATUS", rc, WEXITSTATUS(rc));
-    if (rc != -1) {
-      rc = WEXITSTATUS(rc);
-    }
+    // The hook runs on a hook worker, or is sent to the hook coprocess.
+    // The callback receives its exit code from the main loop.
+    queued = pdata->hookpool->submit ((params ? params : ""), chcmdline, callback, pdata);
   }
 
   if (chcmdline) {
       free (chcmdline);
   }
 
-  return rc;
+  return queued;
+}
+
+static int exit_code (int status)
+{
+  return (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
 }
 
-int hook_ssaver_start(const char *hook_script)
+static void ssaver_finished (pid_t pid, int status, void *p)
 {
-  int rc = execute_hook (hook_script, SSAVER_HOOK_START);
+  PKSAVER_DATA pdata=(PKSAVER_DATA) p;
+  int rc = exit_code (status);
+
+  log1 ("Screen saver finished with rc", rc);
+  if (rc == 0) {
+    log1 ("Calling xrefresh: ", XREFRESH);
+    pdata->reactor->spawn (XREFRESH, false, NULL, NULL);
+
+    // Tell kdesk hooks that the screen saver has finished
+    hook_ssaver_finish(pdata, time (NULL) - pdata->time_start);
+
+    // some bluetooth keyboard devices need an explicit activity event,
+    // otherwise the inactivity timer stops working (returning 0 which means activity is being received).
+    fake_user_input(pdata->display);
+  }
+
+  pdata->state = SSAVER_STATE_IDLE;
+}
+
+static void start_ssaver (PKSAVER_DATA pdata)
+{
+  log2 ("Starting the Screen Saver (idle, timeout in secs)", pdata->info->idle / 1000, pdata->idle_timeout);
+  pdata->time_start = time (NULL);
+  pdata->state = SSAVER_STATE_RUNNING;
+  if (pdata->reactor->spawn (pdata->saver_program, false, ssaver_finished, pdata) == -1) {
+    pdata->state = SSAVER_STATE_IDLE;
+  }
+}
+
+static void hook_ssaver_start_finished (HOOK_JOB *job, void *p)
+{
+  PKSAVER_DATA pdata=(PKSAVER_DATA) p;
+  int rc = job->exit_code;
+
+  log2 ("Screen saver hook returns with RC, timed out", rc, job->timed_out);
   if (rc == -1) {
+    // If the hook script could not be executed or hung, assume success, go forward
+    log ("Warning: Screen saver start hook did not finish, assuming 0=success");
+    start_ssaver (pdata);
+  }
+  else if (rc == 0) {
+    start_ssaver (pdata);
+  }
+  else {
+    log1 ("Screen saver start hook not returning 0, cancelling the screen saver, rc=", rc);
+    fake_user_input(pdata->display);
+    pdata->state = SSAVER_STATE_IDLE;
+  }
+}
+
+void hook_ssaver_start(PKSAVER_DATA pdata)
+{
+  pdata->state = SSAVER_STATE_HOOK;
+  if (!execute_hook (pdata, SSAVER_HOOK_START, hook_ssaver_start_finished)) {
     // If the hook script cannot be executed, assume success, go forward
-    log ("Warning: Screen saver start hook returns -1, assuming 0=success");
-    rc = 0;
+    log ("Warning: Screen saver start hook could not be executed, assuming 0=success");
+    start_ssaver (pdata);
   }
+}
 
-  return rc;
+static void hook_ssaver_finish_finished (HOOK_JOB *job, void *p)
+{
+  // Nothing to wait for, but the job must not be taken for an icon hook
+  log2 ("Screen saver finish hook returns with RC, timed out", job->exit_code, job->timed_out);
 }
 
-int hook_ssaver_finish(const char *hook_script, time_t time_ssaver_run)
+void hook_ssaver_finish(PKSAVER_DATA pdata, time_t time_ssaver_run)
 {
   char hook_params[256];
 
   sprintf (hook_params, "%s %ld", SSAVER_HOOK_FINISH, time_ssaver_run);
-  int rc = execute_hook (hook_script, hook_params);
-  return 0;
+  execute_hook (pdata, hook_params, hook_ssaver_finish_finished);
 }
 
 bool setup_ssaver (KSAVER_DATA *kdata)
 {
-  pthread_t *tssaver = new pthread_t();
-  pthread_create (tssaver, NULL, &idle_time, (void *) kdata);
-  log1 ("SSaver thread started tid", tssaver);
-  return true;
+  kdata->info = XScreenSaverAllocInfo();
+  if (!kdata->info) {
+    log ("Error! Could not allocate screen saver information structure, screen saver disabled");
+    return false;
+  }
+
+  // Idle time is polled from the main loop, there is no need for a thread of its own
+  kdata->state = SSAVER_STATE_IDLE;
+  int timer = kdata->reactor->add_timer (POLL_INTERVAL, POLL_INTERVAL, idle_time, (void *) kdata);
+  log2 ("Setting screen saver - T/O (secs) and program", kdata->idle_timeout, kdata->saver_program);
+  return (timer != -1);
 }
 
 void fake_user_input (Display *display)
@@ -117,78 +181,28 @@ void fake_user_input (Display *display)
   XFlush(display);
 }
 
-void *idle_time (void *p)
+void idle_time (int timer_id, void *p)
 {
-  bool running=true;
-  Status rc=0, rchook=0;
-  unsigned long ms=1000 * POLL_INTERVAL;
-  unsigned long ultimeout=0L;
+  Status rc=0;
   PKSAVER_DATA pdata=(PKSAVER_DATA) p;
 
-  // Initial X11 connection delay
-  usleep(ms);
-
-  Display *display = XOpenDisplay(pdata->display_name);
-  if (!display) {
-    log ("Ssaver cannot connect to X Display! No screen saver available");
-    return NULL;
-  }
-  else {
-    log2 ("Setting screen saver - T/O (secs) and program", pdata->idle_timeout, pdata->saver_program);
-  }
-
-  XScreenSaverInfo *info = XScreenSaverAllocInfo();
-  if (!info) {
-    log ("Error! Could not allocate screen saver information structure, screen saver disabled");
-    return NULL;
+  // Nothing to poll while the start hook or the screen saver are running
+  if (pdata->state != SSAVER_STATE_IDLE) {
+    return;
   }
 
-  while (running)
+  rc = XScreenSaverQueryInfo(pdata->display, DefaultRootWindow(pdata->display), pdata->info);
+  log3 ("asking for system idle time - rcsuccess, T/O, and idle time in secs", rc, pdata->info->idle / 1000, pdata->idle_timeout);
+  log2 ("current tty, default X tty", get_current_console(), GUI_TTY_DEVICE);
+  if (rc)
     {
-      rc = XScreenSaverQueryInfo(display, DefaultRootWindow(display), info);
-      log3 ("asking for system idle time - rcsuccess, T/O, and idle time in secs", rc, info->idle / 1000, pdata->idle_timeout);
-      log2 ("current tty, default X tty", get_current_console(), GUI_TTY_DEVICE);
-      if (rc)
-	{
-          // If idle timeout expires, then launch the screen saver
-          // Note that this would trigger the screen saver whilst on a tty console as well
-	  if (info->idle > (pdata->idle_timeout * 1000)) {
-	    rchook = hook_ssaver_start(pdata->saver_hooks);
-	    if (rchook == 0) {
-	      log2 ("Starting the Screen Saver (idle, timeout in secs)", info->idle / 1000, pdata->idle_timeout);
-
-              time_t ssaver_time_start = time (NULL);
-              signal(SIGCHLD, SIG_DFL);
-              rc = system (pdata->saver_program);
-              signal(SIGCHLD, SIG_IGN);
-              time_t ssaver_time_end = time (NULL);
-
-              log1 ("Screen saver finished with rc", rc);
-	      if (rc == 0) {
-		log1 ("Calling xrefresh: ", XREFRESH);
-		rc = system (XREFRESH);
-
-		// Tell kdesk hooks that the screen saver has finished
-		rchook = hook_ssaver_finish(pdata->saver_hooks, ssaver_time_end - ssaver_time_start);
-
-		// some bluetooth keyboard devices need an explicit activity event,
-		// otherwise the inactivity timer stops working (returning 0 which means activity is being received).
-		fake_user_input(display);
-	      }
-	    }
-	    else {
-	      log1 ("Screen saver start hook not returning 0, cancelling the screen saver, rc=", rchook);
-	      fake_user_input(display);
-	    }
-	  }
-	}
-      else {
-	log1 ("XScreenSaverQueryInfo failed with rc", rc);
+      // If idle timeout expires, then launch the screen saver
+      // Note that this would trigger the screen saver whilst on a tty console as well
+      if (pdata->info->idle > (pdata->idle_timeout * 1000)) {
+	hook_ssaver_start(pdata);
       }
-
-      usleep(ms);
     }
-
-  XFree(info);
-  return NULL;
+  else {
+    log1 ("XScreenSaverQueryInfo failed with rc", rc);
+  }
 }
@@ -15,19 +15,33 @@
 
 #define GUI_TTY_DEVICE   7               // tty device number where the GUI XServer is running, normally tty7
 
+// Screen saver progress, each step waits for a child process to finish
+#define SSAVER_STATE_IDLE     0         // Polling for user idle time
+#define SSAVER_STATE_HOOK     1         // The start hook is deciding if the screen saver can run
+#define SSAVER_STATE_RUNNING  2         // The screen saver program is running
+
+class Reactor;
+class HookPool;
+
 typedef struct _ksaver_data {
 
-  char *display_name;           // Usually this can be set to NULL to attach to first available display
+  Display *display;             // Display attended by the main loop, queried for idle time
+  Reactor *reactor;             // Main loop reactor which drives the screen saver
+  HookPool *hookpool;           // Hook workers, which also run or talk to the screen saver hooks
   unsigned long idle_timeout;   // seconds to idle before starting the screen saver
   char *saver_program;          // path to binary program that paints the screen saver
   char *saver_hooks;            // path to a hook script that will be executed to alert on screen saver transitions (start, finish)
 
+  int state;                    // One of SSAVER_STATE_*
+  time_t time_start;            // When the screen saver program was started
+  XScreenSaverInfo *info;       // Idle time query results
+
 } KSAVER_DATA;
 
 typedef KSAVER_DATA* PKSAVER_DATA;
 
 bool setup_ssaver (KSAVER_DATA *kdata);
-void *idle_time (void *p);
-int hook_ssaver_start(const char *hook_script);
-int hook_ssaver_finish(const char *hook_script);
-void fake_user_input (void);
+void idle_time (int timer_id, void *p);
+void hook_ssaver_start(PKSAVER_DATA pdata);
+void hook_ssaver_finish(PKSAVER_DATA pdata, time_t time_ssaver_run);
+void fake_user_input (Display *display);
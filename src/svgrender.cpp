@@ -0,0 +1,228 @@
+//
+// svgrender.cpp  -  Renders SVG icons into the icon cache on worker threads
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// SVG icons used to be converted by spawning rsvg-convert once per file while the lnk files
+// were parsed. Now parsing only queues them, and librsvg renders them straight at the size
+// kdesk will display them, on a few threads. Each PNG is written to a temporary file and renamed
+// into the cache, so a half written icon is never picked up. Icons are created after waiting for the queue.
+//
+
+#include <librsvg/rsvg.h>
+#include <cairo.h>
+
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "svgrender.h"
+#include "logging.h"
+
+SvgRenderer::SvgRenderer (void)
+{
+#if !GLIB_CHECK_VERSION(2,36,0)
+  // Older glib needs its type system set up before librsvg creates any handle
+  g_type_init();
+#endif
+
+  pthread_mutex_init (&lock, NULL);
+  pthread_cond_init (&wakeup, NULL);
+  pthread_cond_init (&idle, NULL);
+  concurrency = 0;
+  busy = 0;
+  stopping = false;
+}
+
+SvgRenderer::~SvgRenderer (void)
+{
+  stop();
+  pthread_cond_destroy (&idle);
+  pthread_cond_destroy (&wakeup);
+  pthread_mutex_destroy (&lock);
+}
+
+void SvgRenderer::set_concurrency (int threads)
+{
+  // Zero uses all processors, takes effect if workers have not been started yet
+  concurrency = threads;
+}
+
+bool SvgRenderer::start (void)
+{
+  // Workers are started on the first SVG that needs rendering, most starts find them all cached
+  int threads = concurrency;
+  if (threads <= 0) {
+    threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+  }
+  if (threads <= 0) {
+    threads = 1;
+  }
+
+  for (int n=0; n < threads; n++) {
+    pthread_t thread;
+    if (pthread_create (&thread, NULL, worker, this) != 0) {
+      log1 ("Could not start an svg rendering thread (errno)", errno);
+      break;
+    }
+    workers.push_back (thread);
+  }
+
+  log1 ("SVG rendering threads started", workers.size());
+  return (workers.size() > 0);
+}
+
+void SvgRenderer::stop (void)
+{
+  pthread_mutex_lock (&lock);
+  stopping = true;
+  pthread_cond_broadcast (&wakeup);
+  pthread_mutex_unlock (&lock);
+
+  for (unsigned int n=0; n < workers.size(); n++) {
+    pthread_join (workers[n], NULL);
+  }
+  workers.clear();
+
+  while (pending.size()) {
+    delete pending.front();
+    pending.pop_front();
+  }
+  queued.clear();
+  stopping = false;
+}
+
+bool SvgRenderer::render (std::string source, std::string target, int width, int height)
+{
+  GError *error = NULL;
+  RsvgDimensionData dimensions;
+  bool rendered = false;
+
+  RsvgHandle *handle = rsvg_handle_new_from_file (source.c_str(), &error);
+  if (!handle) {
+    log2 ("Could not load svg icon (file, error)", source, (error ? error->message : ""));
+    if (error) {
+      g_error_free (error);
+    }
+    return false;
+  }
+
+  rsvg_handle_get_dimensions (handle, &dimensions);
+  if (!width || !height) {
+    width = dimensions.width;
+    height = dimensions.height;
+  }
+
+  if (width > 0 && height > 0 && dimensions.width > 0 && dimensions.height > 0) {
+    cairo_surface_t *surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t *cr = cairo_create (surface);
+    cairo_scale (cr, (double) width / dimensions.width, (double) height / dimensions.height);
+    rendered = rsvg_handle_render_cairo (handle, cr);
+    cairo_destroy (cr);
+
+    // Renamed into place only once complete
+    char chsuffix[64];
+    snprintf (chsuffix, sizeof (chsuffix), ".%d.%lx.tmp", (int) getpid(), (unsigned long) pthread_self());
+    std::string temporary = target + chsuffix;
+    if (rendered) {
+      rendered = (cairo_surface_write_to_png (surface, temporary.c_str()) == CAIRO_STATUS_SUCCESS &&
+                  rename (temporary.c_str(), target.c_str()) == 0);
+      if (!rendered) {
+        unlink (temporary.c_str());
+      }
+    }
+    cairo_surface_destroy (surface);
+  }
+
+  g_object_unref (handle);
+  log4 ("SVG icon rendered (file, width, height, success)", source, width, height, rendered);
+  return rendered;
+}
+
+bool SvgRenderer::submit (std::string source, std::string target, int width, int height)
+{
+  // Returns false if no worker could be started, the SVG then needs rendering by the caller
+  bool submitted = false;
+
+  pthread_mutex_lock (&lock);
+  if (queued.find (target) != queued.end()) {
+    submitted = true; // already on its way
+  }
+  else if (workers.size() || start()) {
+    SVG_JOB *job = new SVG_JOB;
+    job->source = source;
+    job->target = target;
+    job->width = width;
+    job->height = height;
+    pending.push_back (job);
+    queued.insert (target);
+    pthread_cond_signal (&wakeup);
+    submitted = true;
+  }
+  pthread_mutex_unlock (&lock);
+
+  return submitted;
+}
+
+bool SvgRenderer::wait (std::vector <std::string> &failed_targets)
+{
+  // Blocks until every submitted SVG is rendered, returns false if some could not be.
+  pthread_mutex_lock (&lock);
+  while (pending.size() || busy) {
+    pthread_cond_wait (&idle, &lock);
+  }
+
+  failed_targets.swap (failed);
+  failed.clear();
+  pthread_mutex_unlock (&lock);
+
+  return (failed_targets.size() == 0);
+}
+
+void *SvgRenderer::worker (void *data)
+{
+  SvgRenderer *renderer = (SvgRenderer *) data;
+
+  // Workers can be started before the reactor blocks the signals it reads through signalfd,
+  // a signal delivered to one of them would be lost or take the default action.
+  sigset_t signals;
+  sigfillset (&signals);
+  pthread_sigmask (SIG_BLOCK, &signals, NULL);
+
+  pthread_mutex_lock (&renderer->lock);
+  while (true)
+    {
+      while (!renderer->stopping && !renderer->pending.size()) {
+        pthread_cond_wait (&renderer->wakeup, &renderer->lock);
+      }
+
+      if (renderer->stopping) {
+        break;
+      }
+
+      SVG_JOB *job = renderer->pending.front();
+      renderer->pending.pop_front();
+      renderer->busy++;
+      pthread_mutex_unlock (&renderer->lock);
+
+      bool rendered = render (job->source, job->target, job->width, job->height);
+
+      pthread_mutex_lock (&renderer->lock);
+      if (!rendered) {
+        renderer->failed.push_back (job->target);
+      }
+      renderer->queued.erase (job->target);
+      renderer->busy--;
+      if (!renderer->pending.size() && !renderer->busy) {
+        pthread_cond_broadcast (&renderer->idle);
+      }
+      delete job;
+    }
+
+  pthread_mutex_unlock (&renderer->lock);
+  return NULL;
+}
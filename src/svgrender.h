@@ -0,0 +1,50 @@
+//
+// svgrender.h  -  Renders SVG icons into the icon cache on worker threads
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+
+typedef struct _svg_job {
+  std::string source;     // SVG file
+  std::string target;     // PNG file in the icon cache
+  int width, height;      // Size to render at, zero to keep the size of the SVG document
+} SVG_JOB;
+
+class SvgRenderer
+{
+ private:
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;  // signaled when there are jobs for the workers
+  pthread_cond_t idle;    // signaled when the last job has finished
+  std::vector <pthread_t> workers;
+  std::deque <SVG_JOB *> pending;
+  std::set <std::string> queued;   // targets pending or being rendered
+  std::vector <std::string> failed;
+  int concurrency;
+  int busy;
+  bool stopping;
+
+  static void *worker (void *data);
+  bool start (void);
+
+ public:
+  SvgRenderer (void);
+  virtual ~SvgRenderer (void);
+
+  static bool render (std::string source, std::string target, int width, int height);
+
+  void set_concurrency (int threads);
+  bool submit (std::string source, std::string target, int width, int height);
+  bool wait (std::vector <std::string> &failed_targets);
+  void stop (void);
+};
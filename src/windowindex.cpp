@@ -0,0 +1,299 @@
+//
+// windowindex.cpp  -  Live index of application windows, to find running apps without walking the X tree
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Finding out if an icon app is running used to mean enumerating every top-level window
+// and querying name, class and icon geometry of each one, all synchronous round trips
+// done on every click. The index below follows the window manager's _NET_CLIENT_LIST
+// and the property changes of each client instead, so a lookup never talks to the XServer.
+//
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+
+#include <string.h>
+#include <algorithm>
+#include <set>
+
+#include "windowindex.h"
+#include "logging.h"
+
+static std::string lowercase (const char *text)
+{
+  std::string s = (text ? text : "");
+  std::transform (s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
+}
+
+WindowIndex::WindowIndex (void)
+{
+  display = NULL;
+  root = 0L;
+  live = false;
+  atom_client_list = atom_icon_geometry = 0L;
+}
+
+WindowIndex::~WindowIndex (void)
+{
+}
+
+int WindowIndex::IgnoreBadWindowExceptions (Display *display, XErrorEvent *error)
+{
+  // Client windows can be destroyed at any time while we query them,
+  // their removal is picked up later through the client list.
+  return 0;
+}
+
+bool WindowIndex::initialize (Display *new_display)
+{
+  XWindowAttributes attr;
+
+  display = new_display;
+  root = DefaultRootWindow (display);
+  atom_client_list = XInternAtom (display, "_NET_CLIENT_LIST", False);
+  atom_icon_geometry = XInternAtom (display, "_NET_WM_ICON_GEOMETRY", False);
+
+  // Listen for client list changes and top-level window destruction,
+  // without dropping the root events other kdesk modules have asked for.
+  memset (&attr, 0x00, sizeof (attr));
+  XGetWindowAttributes (display, root, &attr);
+  XSelectInput (display, root, attr.your_event_mask | PropertyChangeMask | SubstructureNotifyMask);
+
+  live = refresh_client_list();
+  if (!live) {
+    log ("The window manager does not publish _NET_CLIENT_LIST yet, app windows will be searched for");
+  }
+
+  return live;
+}
+
+bool WindowIndex::is_live (void)
+{
+  return live;
+}
+
+bool WindowIndex::has_icon_geometry (Display *display, Window w, Atom atom_icon_geometry)
+{
+  // If the window's Icon Geometry returns 4 leftover LONGs,
+  // it's represented with an icon on the desktop, which also means
+  // it accepts movement events (restore, maximize, ...)
+  unsigned long nitems=0L;
+  unsigned long leftover=0L;
+  Atom actual_type;
+  int actual_format;
+  int status=-1;
+  unsigned char *p = NULL;
+  bool found=false;
+
+  status = XGetWindowProperty (display, w,
+                               atom_icon_geometry, 0L, sizeof(unsigned long) * 64,
+                               false, atom_icon_geometry, &actual_type, &actual_format,
+                               &nitems, &leftover, &p);
+  if (status == Success) {
+    found = (leftover == 4);
+    if (p) {
+      XFree (p);
+    }
+  }
+
+  return found;
+}
+
+bool WindowIndex::refresh_client_list (void)
+{
+  // Reconcile the index with the list of windows managed by the window manager
+  unsigned long nitems=0L, leftover=0L;
+  Atom actual_type;
+  int actual_format;
+  unsigned char *p = NULL;
+  std::set <Window> current;
+
+  if (XGetWindowProperty (display, root, atom_client_list, 0L, 4096L, False, XA_WINDOW,
+                          &actual_type, &actual_format, &nitems, &leftover, &p) != Success) {
+    return false;
+  }
+
+  if (actual_type != XA_WINDOW || !p) {
+    if (p) {
+      XFree (p);
+    }
+    return false;
+  }
+
+  Window *clients = (Window *) p;
+  for (unsigned long n=0; n < nitems; n++) {
+    current.insert (clients[n]);
+    if (windows.find (clients[n]) == windows.end()) {
+      add_window (clients[n]);
+    }
+  }
+  XFree (p);
+
+  std::map <Window, APP_WINDOW>::iterator it=windows.begin();
+  while (it != windows.end()) {
+    Window w = it->first;
+    ++it;
+    if (current.find (w) == current.end()) {
+      remove_window (w);
+    }
+  }
+
+  log1 ("Application window index refreshed (windows)", windows.size());
+  return true;
+}
+
+void WindowIndex::add_window (Window w)
+{
+  APP_WINDOW appwin;
+  appwin.has_icon_geometry = false;
+  windows[w] = appwin;
+
+  // Property changes tell us when the title, class or icon geometry change.
+  // The handler stays in place through update_window, whose round trips will flush any error.
+  XSetErrorHandler (IgnoreBadWindowExceptions);
+  XSelectInput (display, w, PropertyChangeMask);
+  update_window (w);
+  XSetErrorHandler (NULL);
+}
+
+void WindowIndex::unlink_keys (Window w)
+{
+  std::multimap <std::string, Window>::iterator it=keys.begin();
+  while (it != keys.end()) {
+    if (it->second == w) {
+      keys.erase (it++);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+void WindowIndex::remove_window (Window w)
+{
+  unlink_keys (w);
+  windows.erase (w);
+}
+
+void WindowIndex::update_window (Window w)
+{
+  char *windowname=NULL;
+  XClassHint classHint;
+
+  std::map <Window, APP_WINDOW>::iterator it=windows.find (w);
+  if (it == windows.end()) {
+    return;
+  }
+
+  classHint.res_name = classHint.res_class = NULL;
+  XSetErrorHandler (IgnoreBadWindowExceptions);
+  XFetchName (display, w, &windowname);
+  XGetClassHint (display, w, &classHint);
+  it->second.has_icon_geometry = has_icon_geometry (display, w, atom_icon_geometry);
+  XSetErrorHandler (NULL);
+
+  it->second.name = lowercase (windowname);
+  it->second.res_name = lowercase (classHint.res_name);
+
+  if (windowname) {
+    XFree (windowname);
+  }
+
+  if (classHint.res_name) {
+    XFree (classHint.res_name);
+  }
+
+  if (classHint.res_class) {
+    XFree (classHint.res_class);
+  }
+
+  // Both the class name and the window title can be matched against the AppID
+  unlink_keys (w);
+  if (it->second.res_name.length()) {
+    keys.insert (std::pair<std::string, Window>(it->second.res_name, w));
+  }
+
+  if (it->second.name.length() && it->second.name != it->second.res_name) {
+    keys.insert (std::pair<std::string, Window>(it->second.name, w));
+  }
+
+  log4 ("Indexed application window (window, class, title, icon geometry)",
+        w, it->second.res_name, it->second.name, it->second.has_icon_geometry);
+}
+
+bool WindowIndex::process_event (XEvent *ev)
+{
+  // Returns true if the event was meant for the index and needs no further dispatching
+  switch (ev->type)
+    {
+    case PropertyNotify:
+      if (ev->xproperty.window == root) {
+        if (ev->xproperty.atom == atom_client_list) {
+          live = refresh_client_list();
+        }
+        return true;
+      }
+
+      if (windows.find (ev->xproperty.window) != windows.end()) {
+        if (ev->xproperty.atom == XA_WM_NAME || ev->xproperty.atom == XA_WM_CLASS ||
+            ev->xproperty.atom == atom_icon_geometry) {
+          update_window (ev->xproperty.window);
+        }
+        return true;
+      }
+      break;
+
+    case DestroyNotify:
+      if (windows.find (ev->xdestroywindow.window) != windows.end()) {
+        remove_window (ev->xdestroywindow.window);
+        return true;
+      }
+      return (ev->xdestroywindow.event == root);
+
+    case CreateNotify:
+      return (ev->xcreatewindow.parent == root);
+
+    case MapNotify:
+    case UnmapNotify:
+    case ReparentNotify:
+    case GravityNotify:
+    case CirculateNotify:
+      // Substructure changes of top-level windows, nothing to index from them
+      return (ev->xany.window == root);
+
+    case ConfigureNotify:
+      // Keep the root's own configuration changes for the rest of kdesk
+      return (ev->xconfigure.event == root && ev->xconfigure.window != root);
+
+    default:
+      break;
+    }
+
+  return false;
+}
+
+Window WindowIndex::find (std::string appid)
+{
+  // AppID matches the beginning of a window class name or title, case insensitive.
+  // Keys are sorted, so matching candidates are contiguous from the lower bound.
+  appid = lowercase (appid.c_str());
+  if (!appid.length()) {
+    return 0L;
+  }
+
+  std::multimap <std::string, Window>::iterator it=keys.lower_bound (appid);
+  for (; it != keys.end() && !it->first.compare (0, appid.length(), appid); ++it) {
+    std::map <Window, APP_WINDOW>::iterator itw=windows.find (it->second);
+    if (itw != windows.end() && itw->second.has_icon_geometry) {
+      log2 ("Icon app window was found in the index (Appid, WindowID)", appid, it->second);
+      return it->second;
+    }
+  }
+
+  return 0L;
+}
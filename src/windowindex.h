@@ -0,0 +1,48 @@
+//
+// windowindex.h  -  Live index of application windows, to find running apps without walking the X tree
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+
+#include <map>
+#include <string>
+
+#include <X11/Xlib.h>
+
+typedef struct _app_window {
+  std::string name;         // Window title (WM_NAME), lowercase
+  std::string res_name;     // Class hint name (WM_CLASS), lowercase
+  bool has_icon_geometry;   // The window provides _NET_WM_ICON_GEOMETRY
+} APP_WINDOW;
+
+class WindowIndex
+{
+ private:
+  Display *display;
+  Window root;
+  bool live;
+  Atom atom_client_list, atom_icon_geometry;
+  std::map <Window, APP_WINDOW> windows;
+  std::multimap <std::string, Window> keys;
+
+  bool refresh_client_list (void);
+  void add_window (Window w);
+  void remove_window (Window w);
+  void update_window (Window w);
+  void unlink_keys (Window w);
+
+ public:
+  WindowIndex (void);
+  virtual ~WindowIndex (void);
+
+  bool initialize (Display *display);
+  bool is_live (void);
+  bool process_event (XEvent *ev);
+  Window find (std::string appid);
+
+  static bool has_icon_geometry (Display *display, Window w, Atom atom_icon_geometry);
+  static int IgnoreBadWindowExceptions (Display *display, XErrorEvent *error);
+};
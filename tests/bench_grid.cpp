@@ -0,0 +1,85 @@
+//
+// bench_grid.cpp  -  Measures icon grid position requests on large grids
+//
+// Copyright (C) 2013-2014 Kano Computing Ltd.
+// License: http://www.gnu.org/licenses/gpl-2.0.txt GNU General Public License v2
+//
+// An app to show and bring life to Kano-Make Desktop Icons.
+//
+// Grids are sized through a tall virtual screen, with the default number of columns.
+// Each grid is filled with auto placed icons over several pages, then icons are removed
+// and placed again at random. The cost per request should not grow with the size of the grid.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "configuration.h"
+#include "grid.h"
+
+static double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH_PAGES  4
+
+static bool bench (int rows)
+{
+  // Rows are the default grid height plus the vertical gap, margins are left outside
+  int screen_height = 84 + 50 + rows * (DEFAULT_GRID_HEIGHT + DEFAULT_ICON_VERT_SPACE) + 1;
+  IconGrid grid (1920, screen_height, NULL);
+  int cells = grid.get_width() * grid.get_height();
+  int x, y, gridx, gridy, page;
+
+  // Auto placement fills each page in row order, then moves on to a new one
+  double start = now_ns();
+  for (int n=0; n < cells * BENCH_PAGES; n++) {
+    if (!grid.request_position (-1, -1, &x, &y, &gridx, &gridy, &page) ||
+        page * cells + gridy * grid.get_width() + gridx != n) {
+      printf ("unexpected position for icon %d (%d,%d) page %d\n", n, gridx, gridy, page);
+      return false;
+    }
+  }
+  double fill_ns = (now_ns() - start) / (cells * BENCH_PAGES);
+
+  if (grid.get_pages() != BENCH_PAGES) {
+    printf ("grid should have %d pages, not %d\n", BENCH_PAGES, grid.get_pages());
+    return false;
+  }
+
+  // Icons come and go, each freed cell is the one given to the next request
+  int churn = 100000;
+  srand (cells);
+  start = now_ns();
+  for (int n=0; n < churn; n++) {
+    int cell = rand() % (cells * BENCH_PAGES);
+    grid.free_space_used (cell % cells % grid.get_width(), cell % cells / grid.get_width(), cell / cells);
+    if (!grid.request_position (-1, -1, &x, &y, &gridx, &gridy, &page) ||
+        page * cells + gridy * grid.get_width() + gridx != cell) {
+      printf ("freed cell %d was not reused\n", cell);
+      return false;
+    }
+  }
+  double churn_ns = (now_ns() - start) / churn;
+
+  printf ("%10d %10d %14.1f %14.1f\n", grid.get_height(), cells * BENCH_PAGES, fill_ns, churn_ns);
+  return true;
+}
+
+int main (int argc, char *argv[])
+{
+  int rows[] = { 1, 10, 100, 1000, 10000, 100000 };
+
+  printf ("%10s %10s %14s %14s\n", "rows", "cells", "fill ns/icon", "churn ns/icon");
+  for (unsigned int n=0; n < sizeof (rows) / sizeof (rows[0]); n++) {
+    if (!bench (rows[n])) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
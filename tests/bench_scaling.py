@@ -0,0 +1,163 @@
+#!/usr/bin/python
+#
+#  Measures how kdesk scales with the number of desktop icons.
+#
+#  For each icon count a HOME directory is populated with .lnk files, kdesk is started on it,
+#  and the startup, icon reload and icon lookup costs are timed. Costs should grow roughly
+#  linearly with the number of icons, or better.
+#
+#  Needs a built kdesk-dbg in ../src and an XServer, Xvfb is started if DISPLAY is not set:
+#
+#    $ python bench_scaling.py [icon counts...]
+#
+
+import json
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import zlib
+
+ICON_COUNTS=[10, 100, 1000]
+QUERIES=20
+TIMEOUT=120
+
+kdeskrc='''table Config
+  FontName: Bariol
+  FontSize: 14
+  GridWidth: 90
+  GridHeight: 125
+  GridIconWidth: 88
+  GridIconHeight: 88
+  GridColumns: 7
+  EnableSound: false
+  ScreenSaverTimeout: 0
+end
+'''
+
+lnk='''table Icon
+  Caption: Icon {n}
+  AppID: bench-{n}
+  Command: /bin/true
+  Icon: {icon}
+  Relative-To: grid
+  X: auto
+  Y: auto
+end
+'''
+
+def write_png(filename, size):
+    # A plain opaque square, so the benchmark does not depend on installed artwork
+    def chunk(kind, data):
+        return struct.pack('>I', len(data)) + kind + data + struct.pack('>I', zlib.crc32(kind + data) & 0xffffffff)
+
+    row=b'\x00' + b'\x30\x80\xc0\xff' * size
+    with open(filename, 'wb') as f:
+        f.write(b'\x89PNG\r\n\x1a\n')
+        f.write(chunk(b'IHDR', struct.pack('>IIBBBBB', size, size, 8, 6, 0, 0, 0)))
+        f.write(chunk(b'IDAT', zlib.compress(row * size)))
+        f.write(chunk(b'IEND', b''))
+
+def populate_home(home, count):
+    icon=os.path.join(home, 'icon.png')
+    write_png(icon, 88)
+    with open(os.path.join(home, '.kdeskrc'), 'w') as f:
+        f.write(kdeskrc)
+
+    os.mkdir(os.path.join(home, '.kdesktop'))
+    for n in range(count):
+        with open(os.path.join(home, '.kdesktop', 'bench-{:05d}.lnk'.format(n)), 'w') as f:
+            f.write(lnk.format(n=n, icon=icon))
+
+def read_metrics(metrics_file, since):
+    # The metrics file is written when the icons have been created, returns None until then
+    try:
+        if os.path.getmtime(metrics_file) < since:
+            return None
+        with open(metrics_file) as f:
+            metrics=json.loads(f.read())
+    except (OSError, IOError, ValueError):
+        return None
+
+    return metrics if metrics.get('time-to-complete', -1) >= 0 else None
+
+def wait_metrics(metrics_file, since):
+    deadline=time.time() + TIMEOUT
+    while time.time() < deadline:
+        metrics=read_metrics(metrics_file, since)
+        if metrics:
+            return metrics
+        time.sleep(0.01)
+
+    raise RuntimeError('kdesk did not finish in time')
+
+def kdesk(env, *args):
+    return subprocess.call(['kdesk-dbg'] + list(args), env=env,
+                           stdout=open(os.devnull, 'w'), stderr=subprocess.STDOUT)
+
+def bench(count, env):
+    home=tempfile.mkdtemp(prefix='kdesk-bench-')
+    env=dict(env, HOME=home)
+    metrics_file='/tmp/kdesk-metrics{}.dump'.format(env['DISPLAY'])
+    populate_home(home, count)
+
+    try:
+        # Startup, as measured by kdesk itself from its launch to the last icon
+        started=time.time()
+        process=subprocess.Popen(['kdesk-dbg', '-c', os.path.join(home, '.kdeskrc')], env=env,
+                                 stdout=open(os.devnull, 'w'), stderr=subprocess.STDOUT)
+        startup=wait_metrics(metrics_file, started)
+
+        # Icon reload after one lnk file has been edited and another one added
+        with open(os.path.join(home, '.kdesktop', 'bench-00000.lnk'), 'a') as f:
+            f.write('\n')
+        with open(os.path.join(home, '.kdesktop', 'bench-new.lnk'), 'w') as f:
+            f.write(lnk.format(n='new', icon=os.path.join(home, 'icon.png')))
+
+        time.sleep(1)
+        started=time.time()
+        kdesk(env, '-i')
+        wait_metrics(metrics_file, started)
+        reload_ms=(time.time() - started) * 1000
+
+        # Icon lookups by name, as done for hook alerts and queries, the process start is included
+        started=time.time()
+        for n in range(QUERIES):
+            kdesk(env, '-j', 'bench-{:05d}'.format(count - 1 - n % count))
+        query_ms=(time.time() - started) * 1000 / QUERIES
+
+        process.terminate()
+        process.wait()
+        return (startup['time-to-first-icon'], startup['time-to-complete'], reload_ms, query_ms)
+    finally:
+        shutil.rmtree(home, ignore_errors=True)
+
+def main(counts):
+    # allow the benchmark to run either isolated on this repo, or on a kano os image / real RPI
+    env=dict(os.environ)
+    env['PATH']=os.path.join(os.path.dirname(os.path.abspath(__file__)), '../src') + ':' + env['PATH']
+
+    xvfb=None
+    if not env.get('DISPLAY'):
+        env['DISPLAY']=':87'
+        xvfb=subprocess.Popen(['Xvfb', env['DISPLAY'], '-screen', '0', '1920x1080x24'],
+                              stdout=open(os.devnull, 'w'), stderr=subprocess.STDOUT)
+        time.sleep(1)
+
+    try:
+        print('{:>8} {:>14} {:>12} {:>10} {:>10} {:>14}'.format(
+            'icons', 'first icon ms', 'complete ms', 'reload ms', 'query ms', 'complete/icon'))
+        for count in counts:
+            first, complete, reload_ms, query_ms=bench(count, env)
+            print('{:>8} {:>14} {:>12} {:>10.1f} {:>10.1f} {:>14.3f}'.format(
+                count, first, complete, reload_ms, query_ms, float(complete) / count))
+            sys.stdout.flush()
+    finally:
+        if xvfb:
+            xvfb.terminate()
+
+if __name__ == '__main__':
+    main([int(n) for n in sys.argv[1:]] or ICON_COUNTS)